@@ -1,60 +1,4085 @@
+#define _GNU_SOURCE
 #include "POWERUDP_H.h"
 #include <stdio.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
 #include <arpa/inet.h>
+#include <sys/eventfd.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
 #include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
-// Variáveis globais para simulação básica
-static int simulated_loss = 0;
-static int last_retransmissions = 0;
-static int last_delivery_time = 0;
+#define MTU_DEFAULT 1400
+#define MTU_MAX 65507           // maior datagrama UDP sobre IPv4
+// Menor mtu: cabeçalho v1 e MAC mais, com FEC (que pode ser ligado depois, por
+// multicast), o cabeçalho FEC, o prefixo do símbolo e um byte de dados; um SACK cabe
+#define MTU_MIN ((int)(sizeof(PowerUDPHeaderV1) + sizeof(PowerUDPFecHeader)) + FEC_PREFIX + 1 + POWERUDP_MAC_LEN)
+#define WINDOW_MAX 256
+#define BATCH_MAX 256
+#define CACHE_LINE 64
+#define RTO_MIN_US 1000         // granularidade mínima do RTO
+#define DUP_THRESH 3            // pacotes posteriores confirmados para reenviar um buraco
+#define REORDER_MAX 4096        // profundidade máxima do anel de reordenação
+#define CWND_INIT 10            // janela de congestionamento inicial (pacotes)
+#define CWND_MIN 2              // ssthresh mínimo
+#define COALESCE_MAX 64         // registos por datagrama agrupado
+#define COALESCE_RECORD_MAX 512 // maior mensagem que é agrupada com outras
+#define LZ_MIN 256              // menor mensagem que se tenta comprimir
+#define LZ_SKIP_MIN 16          // mensagens em claro depois de uma amostra que não compensou
+#define LZ_SKIP_MAX 1024        // (duplica a cada amostra falhada, até aqui)
+#define LZ_MESSAGE_MAX (64 << 20) // maior mensagem descomprimida aceite
+#define MESSAGE_MAX (64 << 20)  // maior mensagem enviada ou reconstruída a partir de fragmentos
+#define FEC_PREFIX 4            // comprimento e flags à frente do payload em cada símbolo
+#define FEC_RX_RING 512         // pacotes de dados recentes guardados para reconstruir (>= WINDOW_MAX + K_MAX)
+#define FEC_GROUPS 16           // grupos com paridade por resolver, por peer
+#define SEND_SPIN 1024          // voltas de send_message à espera da conclusão antes do sem_wait
 
-int init_protocol(const char *server_ip, int server_port, const char *psk) {
-    // Aqui poderias abrir um socket e fazer handshake com o servidor PowerUDP
-    printf("[init_protocol] IP: %s | Porta: %d | PSK: %s\n", server_ip, server_port, psk);
+#define container_of(ptr, type, member) ((type *)((char *)(ptr) - offsetof(type, member)))
+
+#define MULTICAST_GROUP "239.0.0.1"
+#define MULTICAST_PORT 9876
+
+/*
+ * Arquitetura
+ * -----------
+ * Uma thread de I/O é dona do socket UDP, dos temporizadores de retransmissão e
+ * do tratamento de ACKs. As threads da aplicação nunca tocam no socket:
+ *   - send_message coloca um pedido numa fila MPSC lock-free (um único atomic
+ *     exchange por envio) e espera pela conclusão; send_message_async devolve
+ *     logo um handle e a conclusão chega por callback ou por uma fila de
+ *     conclusões com eventfd, pelo que uma thread pode ter milhares em voo;
+ *   - as mensagens recebidas passam da thread de I/O para a aplicação por um
+ *     anel SPSC; receive_message só usa o eventfd quando o anel está vazio.
+ * Enquanto há trabalho a thread de I/O não é acordada pelos produtores: um
+ * timerfd periódico acorda-a a cada io_tick_us para drenar a fila, e o mesmo tick
+ * faz avançar uma roda hierárquica de temporizadores que trata das retransmissões,
+ * dos ACKs atrasados e dos keepalives de todos os peers; armar e cancelar um
+ * temporizador é O(1) e não custa syscalls. Sem temporizadores armados nem nada
+ * pendente o tick é desligado e a thread fica parada nos sockets; só então os
+ * produtores a acordam, por um eventfd (ver io_park). send_message roda um pouco
+ * à espera da conclusão antes de dormir no semáforo, pelo que um envio rápido não
+ * custa syscalls ao chamador; os mais lentos pagam o futex do sem_wait.
+ * Os envios de cada peer são limitados pela janela de congestionamento do
+ * algoritmo escolhido na configuração e espaçados (pacing) ao longo do RTT.
+ * Os datagramas são recebidos diretamente para buffers de um pool (ver "Pool de
+ * buffers") que seguem, sem cópias, até ao anel de reordenação e à aplicação.
+ * No fio, a thread de I/O lê até batch_size datagramas por recvmmsg e acumula
+ * dados e ACKs num lote que é escrito com um único sendmmsg por volta do ciclo.
+ * Mensagens maiores do que um datagrama são partidas em fragmentos de até
+ * mtu bytes, cada um com o seu seq; o recetor junta-os pela ordem de seq.
+ * Com coalesce_us > 0 faz-se o contrário: mensagens pequenas seguidas para o mesmo
+ * peer saem num só datagrama (POWERUDP_FLAG_MULTI), até encher o mtu ou passar
+ * coalesce_us; cada uma mantém o seu seq e as retransmissões saem isoladas.
+ * O recetor guarda os pacotes que chegam adiantados num anel de reordenação
+ * (reorder_depth entradas por peer, indexado por seq) e responde com SACKs: um ACK
+ * cumulativo com um mapa dos POWERUDP_SACK_BITS seq seguintes. Os ACKs são
+ * atrasados até ack_delay_us ou ack_every pacotes, exceto quando há buracos ou o
+ * emissor pede confirmação imediata (POWERUDP_FLAG_ACK_NOW); o emissor só
+ * retransmite de imediato os buracos com pacotes posteriores já confirmados.
+ * Quando desiste de uma mensagem (max_retries), o emissor manda um salto (ack == 5)
+ * com os seq dela, repetido sempre que um SACK mostre o recetor parado lá dentro;
+ * o recetor descarta o que tinha dela e continua na mensagem seguinte.
+ * Com ConfigMessage.fec_k > 0 cada grupo de até fec_k pacotes de dados leva
+ * fec_parity pacotes de paridade (ver "Correção de erros"): o recetor reconstrói
+ * as perdas do grupo sem esperar pelo RTO nem pelo reenvio rápido.
+ * Para testes, um simulador de rede determinístico (ver "Simulador de rede") pode
+ * perder, atrasar, reordenar, duplicar e limitar o débito nos dois sentidos.
+ */
+
+/* ----------------------------- Pedidos de envio ----------------------------- */
+
+typedef struct send_req {
+    _Atomic(struct send_req *) next;    // ligação da fila MPSC
+    struct send_req *next_pending;      // fila de espera do peer (janela cheia)
+    struct sockaddr_in dest;
+    const char *data;                   // buffer do chamador (vivo até à conclusão)
+    size_t len;
+    size_t offset;                      // próximo byte a fragmentar
+    uint32_t first_seq, end_seq;        // seq dos fragmentos já atribuídos [first_seq, end_seq)
+    int frags_outstanding;              // fragmentos em voo por confirmar
+    int fully_queued;                   // todos os fragmentos já entraram na janela
+    uint64_t first_sent_us;
+    int status;                         // 0 = entregue, -1 = falhou
+    int retransmissions;
+    int delivery_time;                  // ms desde o primeiro envio até ao ACK
+    int rtt_us;                         // amostra de RTT (-1 se houve retransmissão)
+    int rto_us;                         // RTO do peer quando a mensagem foi confirmada
+    int spurious;                       // retransmissões que se revelaram desnecessárias
+    int cwnd;                           // janela de congestionamento na confirmação
+    sem_t done;                         // só nos envios síncronos
+    int async;
+    uint64_t handle;
+    PowerUDPCompletionFn callback;      // NULL = vai para a fila de conclusões
+    void *user_data;
+    struct pkt_buf *lz;                 // versão comprimida enviada em vez de data (ou NULL)
+    uint64_t tx_write;                  // tx_writes quando um fragmento dele entrou no lote
+} send_req;
+
+/*
+ * Fila MPSC intrusiva (Vyukov): push é um exchange + store, pop só é chamado por
+ * um consumidor de cada vez (a thread de I/O na fila de envios).
+ */
+typedef struct {
+    _Alignas(CACHE_LINE) _Atomic(send_req *) head;
+    _Alignas(CACHE_LINE) send_req *tail;
+    send_req stub;
+} mpsc_queue;
+
+static void mpsc_init(mpsc_queue *q) {
+    atomic_store_explicit(&q->stub.next, NULL, memory_order_relaxed);
+    atomic_store_explicit(&q->head, &q->stub, memory_order_relaxed);
+    q->tail = &q->stub;
+}
+
+static void mpsc_push(mpsc_queue *q, send_req *n) {
+    atomic_store_explicit(&n->next, NULL, memory_order_relaxed);
+    send_req *prev = atomic_exchange_explicit(&q->head, n, memory_order_acq_rel);
+    atomic_store_explicit(&prev->next, n, memory_order_release);
+}
+
+static send_req *mpsc_pop(mpsc_queue *q) {
+    send_req *tail = q->tail;
+    send_req *next = atomic_load_explicit(&tail->next, memory_order_acquire);
+
+    if (tail == &q->stub) {
+        if (!next) return NULL;
+        q->tail = next;
+        tail = next;
+        next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    }
+    if (next) {
+        q->tail = next;
+        return tail;
+    }
+    if (tail != atomic_load_explicit(&q->head, memory_order_acquire))
+        return NULL;    // produtor a meio do push; fica para a próxima volta
+
+    mpsc_push(q, &q->stub);
+    next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    if (next) {
+        q->tail = next;
+        return tail;
+    }
+    return NULL;
+}
+
+static inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ volatile("yield" ::: "memory");
+#endif
+}
+
+// Vista do consumidor: nada por tirar nem nenhum produtor a meio de um push
+static int mpsc_empty(mpsc_queue *q) {
+    return q->tail == &q->stub && atomic_load_explicit(&q->head, memory_order_seq_cst) == &q->stub;
+}
+
+/* -------------------------- Mensagens recebidas (SPSC) ---------------------- */
+
+/*
+ * Buffer de pacote: os do pool têm options.mtu bytes em raw; as mensagens
+ * reconstruídas de vários fragmentos usam um buffer de malloc (pooled = 0).
+ * Quem o guarda (lote de receção, anel de reordenação, anel da aplicação) tem
+ * uma referência; o último pkt_put devolve-o.
+ */
+typedef struct pkt_buf {
+    struct pkt_buf *next;               // lista livre
+    atomic_int refs;
+    int pooled;
+    size_t cap;                         // capacidade de raw (só nos de malloc)
+    size_t len;                         // bytes de payload em data
+    struct sockaddr_in src;
+    char *data;                         // payload, dentro de raw
+    _Alignas(CACHE_LINE) char raw[];
+} pkt_buf;
+
+typedef pkt_buf rx_msg;
+
+typedef struct {
+    _Alignas(CACHE_LINE) atomic_size_t head;    // escrito pela thread de I/O
+    _Alignas(CACHE_LINE) atomic_size_t tail;    // escrito pelo consumidor
+    _Alignas(CACHE_LINE) atomic_int waiting;    // consumidor bloqueado no eventfd
+    size_t mask;
+    rx_msg **slots;
+    int efd;
+} spsc_ring;
+
+static int spsc_push(spsc_ring *r, rx_msg *m) {
+    size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+    if (head - tail > r->mask) return -1;
+
+    r->slots[head & r->mask] = m;
+    atomic_store_explicit(&r->head, head + 1, memory_order_seq_cst);
+
+    if (atomic_load_explicit(&r->waiting, memory_order_seq_cst)) {
+        uint64_t one = 1;
+        if (write(r->efd, &one, sizeof(one)) < 0) perror("eventfd write");
+    }
+    return 0;
+}
+
+static rx_msg *spsc_pop(spsc_ring *r) {
+    size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+    if (tail == head) return NULL;
+
+    rx_msg *m = r->slots[tail & r->mask];
+    atomic_store_explicit(&r->tail, tail + 1, memory_order_release);
+    return m;
+}
+
+/* ------------------------- Roda de temporizadores --------------------------- */
+
+/*
+ * Roda hierárquica (estilo "cascading timer wheel"): WHEEL_LEVELS níveis de
+ * WHEEL_SIZE slots; o nível l cobre atrasos até WHEEL_SIZE^(l+1) ticks. Cada slot
+ * é uma lista duplamente ligada e intrusiva, por isso armar e cancelar são O(1).
+ * Quando o nível 0 dá a volta, o slot correspondente do nível seguinte é
+ * redistribuído pelos níveis de baixo. Com 4 níveis de 64 slots e ticks de
+ * 100 µs a roda cobre ~28 minutos; atrasos maiores ficam no último slot.
+ */
+#define WHEEL_BITS 6
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4
+
+typedef struct timer_node {
+    struct timer_node *next;
+    struct timer_node **pprev;          // NULL = desarmado
+    uint64_t expires;                   // tick em que dispara
+    void (*fire)(struct timer_node *t);
+} timer_node;
+
+static timer_node *wheel[WHEEL_LEVELS][WHEEL_SIZE];
+static uint64_t wheel_now;              // último tick processado
+static size_t wheel_armed;              // temporizadores armados (0 = o tick pode parar)
+
+static int timer_armed(const timer_node *t) {
+    return t->pprev != NULL;
+}
+
+static void timer_cancel(timer_node *t) {
+    if (!t->pprev) return;
+    wheel_armed--;
+    *t->pprev = t->next;
+    if (t->next) t->next->pprev = t->pprev;
+    t->next = NULL;
+    t->pprev = NULL;
+}
+
+static void wheel_insert(timer_node *t) {
+    uint64_t delta = t->expires - wheel_now;
+    int level = 0;
+    while (level < WHEEL_LEVELS - 1 && delta >> (WHEEL_BITS * (level + 1))) level++;
+    if (delta >> (WHEEL_BITS * WHEEL_LEVELS)) t->expires = wheel_now + (1ULL << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+
+    timer_node **head = &wheel[level][(t->expires >> (WHEEL_BITS * level)) & (WHEEL_SIZE - 1)];
+    t->next = *head;
+    if (t->next) t->next->pprev = &t->next;
+    t->pprev = head;
+    *head = t;
+}
+
+// Arma (ou rearma) t para o tick indicado; um prazo já passado dispara no próximo tick
+static void timer_arm(timer_node *t, uint64_t tick) {
+    timer_cancel(t);
+    t->expires = tick > wheel_now ? tick : wheel_now + 1;
+    wheel_insert(t);
+    wheel_armed++;
+}
+
+// Roda vazia: salta para o tick atual (depois de a thread de I/O ter estado parada)
+static void wheel_sync(uint64_t tick) {
+    if (!wheel_armed && wheel_now < tick) wheel_now = tick;
+}
+
+static void wheel_cascade(int level) {
+    timer_node *t = wheel[level][(wheel_now >> (WHEEL_BITS * level)) & (WHEEL_SIZE - 1)];
+    wheel[level][(wheel_now >> (WHEEL_BITS * level)) & (WHEEL_SIZE - 1)] = NULL;
+    while (t) {
+        timer_node *next = t->next;
+        t->pprev = NULL;
+        if (t->expires <= wheel_now) t->expires = wheel_now;
+        wheel_insert(t);
+        t = next;
+    }
+}
+
+// Processa todos os ticks até "tick", disparando os temporizadores expirados
+static void wheel_advance(uint64_t tick) {
+    wheel_sync(tick);
+    while (wheel_now < tick) {
+        wheel_now++;
+        for (int level = 1; level < WHEEL_LEVELS; level++) {
+            if (wheel_now & ((1ULL << (WHEEL_BITS * level)) - 1)) break;
+            wheel_cascade(level);
+        }
+
+        timer_node **head = &wheel[0][wheel_now & (WHEEL_SIZE - 1)];
+        while (*head) {
+            timer_node *t = *head;
+            timer_cancel(t);
+            t->fire(t);     // pode voltar a armar t ou outros temporizadores
+        }
+    }
+}
+
+/* ------------------------------- Estado por peer ---------------------------- */
+
+struct peer;
+
+typedef struct {
+    timer_node timer;           // retransmissão (primeiro campo: ver retx_fire)
+    struct peer *peer;
+    uint32_t seq;
+    send_req *req;
+    const char *data;           // fragmento dentro do buffer do pedido
+    int len;
+    uint8_t flags;
+    int tries;
+    int fast_retx;
+    uint64_t first_sent_us;
+    uint64_t last_sent_us;
+} inflight;
+
+// Pacote recebido antes da sua vez, guardado até expected_seq lá chegar
+typedef struct {
+    uint32_t seq;
+    uint8_t flags;
+    uint8_t used;
+    pkt_buf *buf;               // referência ao datagrama recebido (payload em buf->data)
+} rx_slot;
+
+// Grupo FEC de que já chegou paridade, à espera de poder reconstruir as perdas
+typedef struct {
+    uint32_t seq;               // primeiro seq do grupo
+    uint8_t count;
+    uint8_t rows;               // linhas de paridade recebidas
+    uint8_t used;
+    uint8_t index[POWERUDP_FEC_PARITY_MAX];
+    pkt_buf *parity[POWERUDP_FEC_PARITY_MAX];  // payload em data: PowerUDPFecHeader + símbolo
+} fec_group;
+
+// Seq de uma mensagem abandonada pelo emissor, [start, end)
+typedef struct {
+    uint32_t start, end;
+} seq_range;
+
+typedef struct peer {
+    struct sockaddr_in addr;
+    uint32_t next_seq;          // próximo seq a atribuir
+    uint32_t base;              // seq mais antigo por confirmar
+    uint32_t expected_seq;      // próximo seq esperado na receção
+    rx_slot *reorder;           // anel de reordenação (criado no primeiro pacote adiantado)
+    int acks_owed;              // pacotes de dados recebidos desde o último ACK
+    int ack_queued;             // já está em ack_list
+    struct peer *ack_next;
+    int rx_blocked;             // entrega parada à espera de espaço no anel da aplicação
+    timer_node ack_timer;       // limite do ACK atrasado
+    timer_node keepalive_timer;
+    uint64_t last_tx_us;        // último pacote enviado a este peer
+    uint8_t cc_algo;            // algoritmo + 1 com que o estado abaixo foi iniciado
+    uint32_t cwnd;              // janela de congestionamento (pacotes)
+    uint32_t cwnd_acc;          // ACKs acumulados para crescer um pacote em congestion avoidance
+    uint32_t ssthresh;
+    uint32_t recover;           // fim da janela em que houve a última redução
+    int in_recovery;
+    uint64_t pace_next_us;      // instante a partir do qual sai o próximo pacote
+    timer_node pace_timer;
+    uint32_t lz_skip;           // mensagens a enviar em claro antes da próxima amostra
+    uint32_t lz_backoff;        // tamanho da próxima pausa (0 = LZ_SKIP_MIN)
+    uint32_t coal_seq;          // primeiro seq do grupo de registos por enviar
+    int coal_count;
+    int coal_bytes;             // payload do grupo (prefixos de comprimento incluídos)
+    timer_node coal_timer;      // limite do atraso do grupo
+    uint32_t fec_seq;           // primeiro seq do grupo FEC em construção
+    int fec_count;
+    int fec_k, fec_m;           // configuração com que o grupo começou
+    int fec_len;                // maior payload do grupo
+    int fec_queued;             // já está em fec_list
+    struct peer *fec_next;
+    uint8_t *fec_rows;          // fec_m linhas de paridade, mtu bytes cada (criadas no primeiro grupo)
+    timer_node fec_timer;       // limite da espera por um grupo completo
+    rx_slot *fec_rx;            // pacotes de dados recentes (criado na primeira paridade recebida)
+    uint32_t fec_floor;         // seq abaixo dos quais fec_rx já foi libertado
+    fec_group fec_groups[FEC_GROUPS];
+    seq_range *gaps;            // mensagens abandonadas que o recetor pode ainda não ter saltado
+    int gap_count, gap_cap;
+    uint64_t srtt_us;           // RTT suavizado (0 = ainda sem amostras)
+    uint64_t rttvar_us;
+    uint64_t min_rtt_us;
+    uint64_t spurious_retx;
+    rx_msg *reasm;              // mensagem fragmentada em reconstrução
+    size_t reasm_cap;
+    size_t reasm_hint;          // tamanho da última mensagem reconstruída
+    int reasm_discard;          // descarta fragmentos até ao início da mensagem seguinte
+    send_req *pend_head, *pend_tail;
+    inflight win[WINDOW_MAX];
+} peer;
+
+/* ------------------------------- Estado global ------------------------------ */
+
+static _Thread_local int last_retransmissions = 0;
+static _Thread_local int last_delivery_time = 0;
+static _Thread_local PowerUDPMessageStats last_stats;
+
+static PowerUDPOptions options;
+static int udp_fd = -1;
+static int mcast_fd = -1;
+static int ctrl_fd = -1;
+static int epoll_fd = -1;
+static int timer_fd = -1;
+static int tick_on = 0;                 // timerfd armado (backend epoll)
+static int wake_fd = -1;
+static atomic_int io_parked = 0;        // thread de I/O sem tick, à espera de wake_fd
+static pthread_t io_thread;
+static atomic_int running = 0;
+static int send_spin = 0;               // SEND_SPIN com mais de um CPU; com um só, rodar atrasa a thread de I/O
+
+static mpsc_queue submit_q;
+// Conclusões dos envios assíncronos sem callback (produtor: thread de I/O)
+static mpsc_queue completion_q;
+static pthread_mutex_t completion_lock = PTHREAD_MUTEX_INITIALIZER;
+static int completion_fd = -1;
+static int completion_signal = 0;       // há conclusões novas desde o último aviso
+static atomic_uint_fast64_t next_handle = 1;
+static spsc_ring rx_ring;
+
+// Só a thread de I/O lê "config"; as alterações da aplicação passam por config_pending
+static ConfigMessage config = { 1, 1, 1, 500, 5, POWERUDP_CC_NEWRENO, 0, 0, 0 };
+static ConfigMessage config_pending = { 1, 1, 1, 500, 5, POWERUDP_CC_NEWRENO, 0, 0, 0 };
+static atomic_int config_dirty = 0;
+static pthread_mutex_t config_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t config_epoch;
+static int have_epoch = 0;
+
+// Tabela de peers (endereçamento aberto); apenas acedida pela thread de I/O
+static peer **peers = NULL;
+static size_t peer_cap = 0, peer_count = 0;
+
+// Peers com um ACK imediato por enviar no fim da volta, e peers com entrega parada
+static peer *ack_list = NULL;
+static peer *fec_list = NULL;           // peers com um grupo FEC aberto
+static int rx_blocked_count = 0;
+static uint64_t tx_writes = 0;          // lotes de envio já lidos pelo kernel
+
+// Payload de um pacote de controlo, guardado no lote até ser escrito
+typedef union {
+    PowerUDPSack sack;
+    PowerUDPSkip skip;
+} ctl_payload;
+
+// Lotes de I/O (batch_size entradas cada); apenas acedidos pela thread de I/O
+typedef struct {
+    struct mmsghdr *msgs;
+    struct iovec *iov;          // 3 por entrada: cabeçalho + payload + MAC
+    struct sockaddr_in *addr;
+    PowerUDPHeaderV1 *hdrs;     // só com checksum é enviado o cabeçalho v1 inteiro
+    ctl_payload *ctl;           // só no envio (payload dos SACKs e dos saltos)
+    uint64_t *tags;             // só no envio com MAC (o MAC de cada entrada, em little-endian)
+    char *coal;                 // só no envio com agrupamento (mtu bytes por entrada)
+    pkt_buf **pkts;             // só na receção (um buffer do pool por entrada)
+    int count;
+} io_batch;
+
+static io_batch tx_batch, rx_batch;
+
+/* --------------------------------- Métricas --------------------------------- */
+
+/*
+ * Cada thread que regista métricas tem o seu próprio bloco de contadores e
+ * histogramas, ligado numa lista global na primeira utilização. Só o dono escreve
+ * no bloco (load + store relaxed, sem RMW nem locks); get_protocol_metrics
+ * percorre a lista e soma os blocos.
+ *
+ * Os histogramas são log-lineares: 16 sub-buckets por potência de 2, o que dá
+ * um erro relativo abaixo de 6,25% em toda a gama.
+ */
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+
+enum {
+    M_PACKETS_SENT, M_PACKETS_RECEIVED, M_BYTES_SENT, M_BYTES_RECEIVED,
+    M_ACKS_SENT, M_ACKS_RECEIVED, M_NAKS_SENT, M_NAKS_RECEIVED,
+    M_TIMEOUTS, M_DUPLICATES, M_RETRANSMISSIONS,
+    M_MESSAGES_SENT, M_MESSAGES_FAILED, M_MESSAGES_RECEIVED,
+    M_TX_SYSCALLS, M_RX_SYSCALLS, M_STALE_CONFIGS, M_REORDERED, M_CC_EVENTS,
+    M_POOL_GETS, M_POOL_PUTS, M_POOL_SLABS, M_HEAP_ALLOCS, M_COALESCED,
+    M_SIM_DROPS, M_SIM_DUPS, M_SIM_DELAYED, M_AUTH_FAILED, M_CRC_FAILED, M_MALFORMED,
+    M_LZ_MESSAGES, M_LZ_SAVED, M_LZ_SKIPPED, M_LZ_NS, M_LZ_ERRORS,
+    M_FEC_PARITY, M_FEC_RECOVERED, M_FEC_NS, M_SKIPPED, M_REASM_DROPPED,
+    M_COUNT
+};
+
+enum { H_DELIVERY, H_RTT, H_RETRIES, H_COUNT };
+
+typedef struct {
+    atomic_uint_fast64_t count, sum, min, max;
+    atomic_uint_fast64_t buckets[POWERUDP_HIST_BUCKETS];
+} hist_block;
+
+typedef struct metrics_block {
+    struct metrics_block *next;
+    _Alignas(CACHE_LINE) atomic_uint_fast64_t c[M_COUNT];
+    hist_block h[H_COUNT];
+} metrics_block;
+
+static _Atomic(metrics_block *) metrics_head = NULL;
+static _Thread_local metrics_block *my_metrics = NULL;
+
+static metrics_block *metrics_self() {
+    if (my_metrics) return my_metrics;
+
+    metrics_block *m = aligned_alloc(CACHE_LINE, (sizeof(*m) + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE);
+    memset(m, 0, sizeof(*m));
+    for (int i = 0; i < H_COUNT; i++) atomic_init(&m->h[i].min, UINT64_MAX);
+    m->next = atomic_load(&metrics_head);
+    while (!atomic_compare_exchange_weak(&metrics_head, &m->next, m));
+    my_metrics = m;
+    return m;
+}
+
+static inline void owner_add(atomic_uint_fast64_t *a, uint64_t n) {
+    atomic_store_explicit(a, atomic_load_explicit(a, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+static inline void metric_add(int id, uint64_t n) {
+    owner_add(&metrics_self()->c[id], n);
+}
+
+static int hist_bucket(uint64_t v) {
+    if (v < 2 * HIST_SUB) return (int)v;
+    int msb = 63 - __builtin_clzll(v);
+    int shift = msb - HIST_SUB_BITS;
+    int idx = (shift + 1) * HIST_SUB + (int)((v >> shift) - HIST_SUB);
+    return idx < POWERUDP_HIST_BUCKETS ? idx : POWERUDP_HIST_BUCKETS - 1;
+}
+
+static uint64_t hist_bucket_value(int idx) {
+    if (idx < 2 * HIST_SUB) return idx;
+    int shift = idx / HIST_SUB - 1;
+    return (uint64_t)(idx % HIST_SUB + HIST_SUB) << shift;
+}
+
+static void metric_record(int id, uint64_t v) {
+    hist_block *h = &metrics_self()->h[id];
+    owner_add(&h->count, 1);
+    owner_add(&h->sum, v);
+    owner_add(&h->buckets[hist_bucket(v)], 1);
+    if (v < atomic_load_explicit(&h->min, memory_order_relaxed)) atomic_store_explicit(&h->min, v, memory_order_relaxed);
+    if (v > atomic_load_explicit(&h->max, memory_order_relaxed)) atomic_store_explicit(&h->max, v, memory_order_relaxed);
+}
+
+static uint64_t now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int same_addr(const struct sockaddr_in *a, const struct sockaddr_in *b) {
+    return a->sin_addr.s_addr == b->sin_addr.s_addr && a->sin_port == b->sin_port;
+}
+
+static size_t addr_hash(const struct sockaddr_in *a) {
+    uint64_t k = ((uint64_t)a->sin_addr.s_addr << 16) | a->sin_port;
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    return (size_t)k;
+}
+
+static void peer_table_insert(peer *p) {
+    size_t i = addr_hash(&p->addr) & (peer_cap - 1);
+    while (peers[i]) i = (i + 1) & (peer_cap - 1);
+    peers[i] = p;
+}
+
+static void ack_fire(timer_node *t);
+static void keepalive_fire(timer_node *t);
+static void retx_fire(timer_node *t);
+static void pace_fire(timer_node *t);
+static void coal_fire(timer_node *t);
+static void fec_fire(timer_node *t);
+
+// Tick da roda em que um instante absoluto (µs) já passou
+static uint64_t us_to_tick(uint64_t us) {
+    return (us + options.io_tick_us - 1) / options.io_tick_us;
+}
+
+static peer *peer_get(const struct sockaddr_in *addr) {
+    if (peer_cap) {
+        size_t i = addr_hash(addr) & (peer_cap - 1);
+        for (; peers[i]; i = (i + 1) & (peer_cap - 1))
+            if (same_addr(&peers[i]->addr, addr)) return peers[i];
+    }
+
+    if ((peer_count + 1) * 10 > peer_cap * 7) {
+        peer **old = peers;
+        size_t old_cap = peer_cap;
+        peer_cap = peer_cap ? peer_cap * 2 : 16;
+        peers = calloc(peer_cap, sizeof(*peers));
+        for (size_t i = 0; i < old_cap; i++)
+            if (old[i]) peer_table_insert(old[i]);
+        free(old);
+    }
+
+    peer *p = calloc(1, sizeof(*p));
+    p->addr = *addr;
+    p->ack_timer.fire = ack_fire;
+    p->keepalive_timer.fire = keepalive_fire;
+    p->pace_timer.fire = pace_fire;
+    p->coal_timer.fire = coal_fire;
+    p->fec_timer.fire = fec_fire;
+    if (options.keepalive_ms > 0)
+        timer_arm(&p->keepalive_timer, us_to_tick(now_us() + (uint64_t)options.keepalive_ms * 1000));
+    peer_table_insert(p);
+    peer_count++;
+    return p;
+}
+
+/* ------------------------------ Pool de buffers ----------------------------- */
+
+/*
+ * Buffers de pacote de tamanho fixo, alinhados à linha de cache e reservados em
+ * slabs de POOL_SLAB. Cada thread tem uma cache própria, sem locks; só quando
+ * ela esvazia ou passa de POOL_CACHE_MAX se troca um lote de POOL_BATCH buffers
+ * com a lista global. A thread de I/O tira buffers da sua cache para o lote de
+ * receção e a aplicação devolve-os à dela em receive_message, pelo que em regime
+ * estável não há malloc nem free por mensagem, só um lock a cada POOL_BATCH.
+ * Os buffers grandes das mensagens reconstruídas também são reciclados (até
+ * LARGE_CACHE, numa lista global), para não haver malloc por mensagem fragmentada.
+ * Os slabs são libertados em close_protocol; a época invalida as caches antigas.
+ */
+#define POOL_SLAB 256
+#define POOL_BATCH 32
+#define POOL_CACHE_MAX (2 * POOL_BATCH)
+#define LARGE_CACHE 16
+
+typedef struct pool_slab {
+    struct pool_slab *next;
+} pool_slab;
+
+static struct {
+    pthread_mutex_t lock;
+    pkt_buf *free;
+    pkt_buf *large;                     // buffers de malloc livres
+    int large_count;
+    pool_slab *slabs;
+    size_t stride;                      // bytes por buffer (múltiplo de CACHE_LINE)
+    uint64_t total;
+    atomic_uint epoch;
+} pool = { PTHREAD_MUTEX_INITIALIZER, NULL, NULL, 0, NULL, 0, 0, 0 };
+
+static _Thread_local struct {
+    pkt_buf *head;
+    int count;
+    unsigned int epoch;
+} pool_cache;
+
+static void pool_init(size_t bufsize) {
+    pool.stride = (sizeof(pkt_buf) + bufsize + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+}
+
+static void pool_destroy() {
+    pthread_mutex_lock(&pool.lock);
+    while (pool.slabs) {
+        pool_slab *next = pool.slabs->next;
+        free(pool.slabs);
+        pool.slabs = next;
+    }
+    while (pool.large) {
+        pkt_buf *next = pool.large->next;
+        free(pool.large);
+        pool.large = next;
+    }
+    pool.large_count = 0;
+    pool.free = NULL;
+    pool.total = 0;
+    atomic_fetch_add(&pool.epoch, 1);
+    pthread_mutex_unlock(&pool.lock);
+}
+
+static void pool_cache_check() {
+    unsigned int epoch = atomic_load_explicit(&pool.epoch, memory_order_relaxed);
+    if (pool_cache.epoch == epoch) return;
+    pool_cache.head = NULL;
+    pool_cache.count = 0;
+    pool_cache.epoch = epoch;
+}
+
+// Chamado com pool.lock
+static int pool_grow() {
+    pool_slab *slab = aligned_alloc(CACHE_LINE, CACHE_LINE + pool.stride * POOL_SLAB);
+    if (!slab) return -1;
+    slab->next = pool.slabs;
+    pool.slabs = slab;
+    for (int i = 0; i < POOL_SLAB; i++) {
+        pkt_buf *b = (pkt_buf *)((char *)slab + CACHE_LINE + pool.stride * i);
+        b->pooled = 1;
+        b->next = pool.free;
+        pool.free = b;
+    }
+    pool.total += POOL_SLAB;
+    metric_add(M_POOL_SLABS, 1);
+    return 0;
+}
+
+static pkt_buf *pool_get() {
+    pool_cache_check();
+    if (!pool_cache.head) {
+        pthread_mutex_lock(&pool.lock);
+        if (!pool.free && pool_grow() < 0) {
+            pthread_mutex_unlock(&pool.lock);
+            return NULL;
+        }
+        for (int i = 0; i < POOL_BATCH && pool.free; i++) {
+            pkt_buf *b = pool.free;
+            pool.free = b->next;
+            b->next = pool_cache.head;
+            pool_cache.head = b;
+            pool_cache.count++;
+        }
+        pthread_mutex_unlock(&pool.lock);
+    }
+    pkt_buf *b = pool_cache.head;
+    pool_cache.head = b->next;
+    pool_cache.count--;
+    atomic_store_explicit(&b->refs, 1, memory_order_relaxed);
+    b->data = b->raw;
+    b->len = 0;
+    metric_add(M_POOL_GETS, 1);
+    return b;
+}
+
+// Buffer fora do pool, para mensagens maiores do que um datagrama (old != NULL cresce-o)
+static pkt_buf *heap_buf(pkt_buf *old, size_t cap) {
+    pkt_buf *b = NULL;
+    if (!old) {
+        pthread_mutex_lock(&pool.lock);
+        for (pkt_buf **pp = &pool.large; *pp; pp = &(*pp)->next) {
+            if ((*pp)->cap < cap) continue;
+            b = *pp;
+            *pp = b->next;
+            pool.large_count--;
+            break;
+        }
+        pthread_mutex_unlock(&pool.lock);
+    }
+    if (!b) {
+        if (!(b = realloc(old, sizeof(*b) + cap))) return NULL;
+        b->cap = cap;
+        metric_add(M_HEAP_ALLOCS, 1);
+    }
+    if (!old) {
+        atomic_store_explicit(&b->refs, 1, memory_order_relaxed);
+        b->pooled = 0;
+        b->len = 0;
+    }
+    b->data = b->raw;
+    return b;
+}
+
+static void pkt_ref(pkt_buf *b) {
+    atomic_fetch_add_explicit(&b->refs, 1, memory_order_relaxed);
+}
+
+static void pkt_put(pkt_buf *b) {
+    if (atomic_fetch_sub_explicit(&b->refs, 1, memory_order_acq_rel) != 1) return;
+    if (!b->pooled) {
+        pthread_mutex_lock(&pool.lock);
+        if (pool.large_count < LARGE_CACHE) {
+            b->next = pool.large;
+            pool.large = b;
+            pool.large_count++;
+            b = NULL;
+        }
+        pthread_mutex_unlock(&pool.lock);
+        free(b);
+        return;
+    }
+    metric_add(M_POOL_PUTS, 1);
+    pool_cache_check();
+    b->next = pool_cache.head;
+    pool_cache.head = b;
+    if (++pool_cache.count <= POOL_CACHE_MAX) return;
+
+    // Cache cheia: devolve um lote à lista global
+    pkt_buf *first = pool_cache.head, *last = first;
+    for (int i = 1; i < POOL_BATCH; i++) last = last->next;
+    pool_cache.head = last->next;
+    pool_cache.count -= POOL_BATCH;
+    pthread_mutex_lock(&pool.lock);
+    last->next = pool.free;
+    pool.free = first;
+    pthread_mutex_unlock(&pool.lock);
+}
+
+/* ------------------------------ Backend io_uring ----------------------------- */
+
+/*
+ * Com io_backend = POWERUDP_IO_URING a thread de I/O usa um io_uring (syscalls
+ * diretas, sem liburing) em vez do epoll:
+ *   - um único recvmsg multishot no socket UDP recebe para um anel de buffers
+ *     fornecidos (IORING_REGISTER_PBUF_RING), que são buffers do pool: o datagrama
+ *     segue para o anel de reordenação ou para a aplicação sem cópia, como no epoll;
+ *   - o lote de envio vira um SENDMSG por pacote, com MSG_DONTWAIT para que sejam
+ *     executados durante a submissão (o lote pode ser reutilizado logo a seguir);
+ *   - o tick é o timeout do próprio io_uring_enter (IORING_ENTER_EXT_ARG), que no fim
+ *     da volta submete os envios e espera, numa só syscall.
+ * Se o kernel ou os headers não o suportarem, o motor fica no epoll.
+ */
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+#ifdef IORING_RECV_MULTISHOT
+#define HAVE_URING 1
+#else
+#define HAVE_URING 0
+#endif
+
+#define URING_ENTRIES 512       // SQEs (>= BATCH_MAX + rearmes)
+#define URING_CQ_ENTRIES 4096
+#define URING_BUFS 256          // buffers no anel de receção (potência de 2)
+#define URING_RX_HDR 32         // io_uring_recvmsg_out + sockaddr_in antes do datagrama
+
+enum { UD_RECV = 1, UD_SEND, UD_MCAST, UD_WAKE };
+
+#if HAVE_URING
+static struct {
+    int fd;                             // -1 = backend epoll
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ptr, *cq_ptr;
+    size_t sq_len, cq_len, sqes_len;
+    unsigned sq_entries;
+    unsigned sq_local;                  // SQEs preparados (ainda por publicar)
+    unsigned to_submit;
+    struct io_uring_buf_ring *br;
+    size_t br_len;
+    uint16_t br_tail;
+    pkt_buf *bufs[URING_BUFS];          // buffer do pool entregue ao kernel com cada bid
+    struct msghdr rx_hdr;               // só msg_namelen e msg_controllen contam no multishot
+    int rx_armed, mcast_armed, wake_armed;
+    int sends;                          // SENDMSG submetidos e por completar
+} uring = { .fd = -1 };
+
+static int uring_active() {
+    return uring.fd >= 0;
+}
+
+static int uring_enter(unsigned min_complete, unsigned flags, void *arg, size_t argsz) {
+    __atomic_store_n(uring.sq_tail, uring.sq_local, __ATOMIC_RELEASE);
+    int ret = (int)syscall(__NR_io_uring_enter, uring.fd, uring.to_submit, min_complete, flags, arg, argsz);
+    if (ret > 0) uring.to_submit -= (unsigned)ret < uring.to_submit ? (unsigned)ret : uring.to_submit;
+    // Nada por submeter nem no lote: o kernel já leu tudo o que foi posto a enviar
+    if (!uring.to_submit && !tx_batch.count) tx_writes++;
+    return ret;
+}
+
+static struct io_uring_sqe *uring_sqe() {
+    // SQ cheia: submete já o que está preparado para libertar entradas
+    while (uring.sq_local - __atomic_load_n(uring.sq_head, __ATOMIC_ACQUIRE) >= uring.sq_entries)
+        if (uring_enter(0, 0, NULL, 0) < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) return NULL;
+    unsigned idx = uring.sq_local & *uring.sq_mask;
+    struct io_uring_sqe *sqe = &uring.sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    uring.sq_array[idx] = idx;
+    uring.sq_local++;
+    uring.to_submit++;
+    return sqe;
+}
+
+// Devolve um buffer ao anel de receção com o bid indicado
+static void uring_provide(unsigned short bid, pkt_buf *b) {
+    struct io_uring_buf *buf = &uring.br->bufs[uring.br_tail & (URING_BUFS - 1)];
+    uring.bufs[bid] = b;
+    buf->addr = (uint64_t)(uintptr_t)b->raw;
+    buf->len = options.mtu + URING_RX_HDR;
+    buf->bid = bid;
+    uring.br_tail++;
+    __atomic_store_n(&uring.br->tail, uring.br_tail, __ATOMIC_RELEASE);
+}
+
+static int uring_arm_recv() {
+    struct io_uring_sqe *sqe = uring_sqe();
+    if (!sqe) return -1;
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = udp_fd;
+    sqe->addr = (uint64_t)(uintptr_t)&uring.rx_hdr;
+    sqe->len = 1;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    sqe->user_data = UD_RECV;
+    uring.rx_armed = 1;
+    return 0;
+}
+
+static int uring_arm_poll(int fd, uint64_t user_data) {
+    struct io_uring_sqe *sqe = uring_sqe();
+    if (!sqe) return -1;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = user_data;
+    return 0;
+}
+
+static int uring_arm_mcast() {
+    if (uring_arm_poll(mcast_fd, UD_MCAST) < 0) return -1;
+    uring.mcast_armed = 1;
+    return 0;
+}
+
+// wake_fd só é escrito com a thread parada (io_wake), por isso raramente dispara
+static int uring_arm_wake() {
+    if (uring_arm_poll(wake_fd, UD_WAKE) < 0) return -1;
+    uring.wake_armed = 1;
+    return 0;
+}
+
+// Transforma o lote de envio em SENDMSGs; são submetidos no próximo io_uring_enter
+static void tx_sign();
+
+static void uring_queue_tx() {
+    tx_sign();
+    for (int i = 0; i < tx_batch.count; i++) {
+        struct io_uring_sqe *sqe = uring_sqe();
+        if (!sqe) break;
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = udp_fd;
+        sqe->addr = (uint64_t)(uintptr_t)&tx_batch.msgs[i].msg_hdr;
+        sqe->len = 1;
+        sqe->msg_flags = MSG_DONTWAIT;      // nunca fica pendente a apontar para o lote
+        sqe->user_data = UD_SEND;
+        uring.sends++;
+    }
+    tx_batch.count = 0;
+}
+
+// Submete já os SQEs preparados (o lote de envio pode ser reutilizado a seguir)
+static void uring_submit() {
+    if (!uring.to_submit) return;
+    if (uring_enter(0, 0, NULL, 0) < 0 && errno != EINTR && errno != EBUSY) perror("io_uring_enter");
+    metric_add(M_TX_SYSCALLS, 1);
+}
+
+static void uring_close() {
+    if (uring.fd < 0) return;
+    close(uring.fd);
+    uring.fd = -1;
+    for (int i = 0; i < URING_BUFS; i++) {
+        if (uring.bufs[i]) pkt_put(uring.bufs[i]);
+        uring.bufs[i] = NULL;
+    }
+    if (uring.br) munmap(uring.br, uring.br_len);
+    if (uring.sqes) munmap(uring.sqes, uring.sqes_len);
+    if (uring.cq_ptr && uring.cq_ptr != uring.sq_ptr) munmap(uring.cq_ptr, uring.cq_len);
+    if (uring.sq_ptr) munmap(uring.sq_ptr, uring.sq_len);
+    uring.br = NULL;
+    uring.sqes = NULL;
+    uring.sq_ptr = uring.cq_ptr = NULL;
+}
+
+// Cria o anel e regista os buffers de receção; em caso de falha fica tudo como estava
+static int uring_setup() {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = URING_CQ_ENTRIES;
+
+    memset(&uring, 0, sizeof(uring));
+    uring.fd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (uring.fd < 0) return -1;
+    if (!(params.features & IORING_FEAT_EXT_ARG) || !(params.features & IORING_FEAT_NODROP)) {
+        errno = ENOTSUP;
+        goto fail;
+    }
+
+    uring.sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    uring.cq_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (uring.cq_len > uring.sq_len) uring.sq_len = uring.cq_len;
+        uring.cq_len = uring.sq_len;
+    }
+    uring.sq_ptr = mmap(NULL, uring.sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_SQ_RING);
+    if (uring.sq_ptr == MAP_FAILED) {
+        uring.sq_ptr = NULL;
+        goto fail;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        uring.cq_ptr = uring.sq_ptr;
+    } else {
+        uring.cq_ptr = mmap(NULL, uring.cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_CQ_RING);
+        if (uring.cq_ptr == MAP_FAILED) {
+            uring.cq_ptr = NULL;
+            goto fail;
+        }
+    }
+    uring.sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+    uring.sqes = mmap(NULL, uring.sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_SQES);
+    if (uring.sqes == MAP_FAILED) {
+        uring.sqes = NULL;
+        goto fail;
+    }
+    char *sq = uring.sq_ptr, *cq = uring.cq_ptr;
+    uring.sq_head = (unsigned *)(sq + params.sq_off.head);
+    uring.sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    uring.sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    uring.sq_array = (unsigned *)(sq + params.sq_off.array);
+    uring.cq_head = (unsigned *)(cq + params.cq_off.head);
+    uring.cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    uring.cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    uring.cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    uring.sq_entries = params.sq_entries;
+    uring.sq_local = *uring.sq_tail;
+
+    // Anel de buffers fornecidos (grupo 0), preenchido com buffers do pool
+    uring.br_len = URING_BUFS * sizeof(struct io_uring_buf);
+    uring.br = mmap(NULL, uring.br_len, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (uring.br == MAP_FAILED) {
+        uring.br = NULL;
+        goto fail;
+    }
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)uring.br;
+    reg.ring_entries = URING_BUFS;
+    reg.bgid = 0;
+    if (syscall(__NR_io_uring_register, uring.fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) goto fail;
+    for (int i = 0; i < URING_BUFS; i++) {
+        pkt_buf *b = pool_get();
+        if (!b) goto fail;
+        uring_provide(i, b);
+    }
+
+    uring.rx_hdr.msg_namelen = sizeof(struct sockaddr_in);
+    if (uring_arm_recv() < 0 || (mcast_fd >= 0 && uring_arm_mcast() < 0) || uring_arm_wake() < 0) goto fail;
+    return 0;
+
+fail:;
+    int err = errno;
+    uring_close();
+    errno = err;
+    return -1;
+}
+#else
+static int uring_active() {
+    return 0;
+}
+
+static void uring_queue_tx() {
+}
+
+static void uring_submit() {
+}
+
+static void uring_close() {
+}
+
+static int uring_setup() {
+    errno = ENOTSUP;
+    return -1;
+}
+#endif
+
+/* ------------------------------- Autenticação ------------------------------- */
+
+/*
+ * MAC dos datagramas (SipHash-2-4, ver POWERUDP_H.h) calculado em lote: a thread de
+ * I/O assina o lote de envio inteiro antes do sendmmsg e verifica o de receção a
+ * seguir ao recvmmsg. Cada lane de um vetor de MAC_LANES x 64 bits leva um
+ * datagrama, palavra a palavra; as lanes de datagramas mais curtos ficam paradas
+ * por máscara até os outros acabarem. O mesmo código é compilado para AVX2 (um
+ * registo ymm) e para o alvo base (dois xmm em SSE2, ou NEON), escolhido em
+ * tempo de execução. Sem rotações de 64 bits nos vetores (só com AVX-512) cada
+ * ronda custa mais instruções que no escalar; --mac-bench compara as três.
+ */
+#define MAC_LANES 4
+
+typedef uint64_t mac_vec __attribute__((vector_size(8 * MAC_LANES)));
+
+// Datagrama a autenticar: o cabeçalho (8 ou 16 bytes, palavras inteiras) e o payload podem estar separados
+typedef struct {
+    const uint8_t *head;
+    const uint8_t *body;
+    uint32_t head_len;
+    uint32_t body_len;
+} mac_input;
+
+static PowerUDPKey mac_key;
+static int mac_on = 0;          // datagramas UDP com MAC nesta sessão
+static int mac_mcast = 0;       // multicast do servidor com MAC (sempre que há servidor)
+static int mac_impl = -1;       // POWERUDP_MAC_*; -1 = ainda por escolher
+
+// Palavra w da mensagem cabeçalho || payload; a última leva o comprimento no byte de cima
+static inline uint64_t mac_word(const mac_input *in, uint32_t w) {
+    if (w < in->head_len / 8) return powerudp_le64(in->head + 8 * w);
+    uint32_t off = w * 8 - in->head_len;
+    if (off + 8 <= in->body_len) return powerudp_le64(in->body + off);
+    uint64_t m = (uint64_t)((in->head_len + in->body_len) & 0xff) << 56;
+    for (uint32_t i = off; i < in->body_len; i++) m |= (uint64_t)in->body[i] << (8 * (i - off));
+    return m;
+}
+
+static inline uint32_t mac_words(const mac_input *in) {
+    return (in->head_len + in->body_len) / 8 + 1;
+}
+
+static uint64_t mac_one(const PowerUDPKey *key, const mac_input *in) {
+    uint64_t v0 = key->k0 ^ 0x736f6d6570736575ULL, v1 = key->k1 ^ 0x646f72616e646f6dULL;
+    uint64_t v2 = key->k0 ^ 0x6c7967656e657261ULL, v3 = key->k1 ^ 0x7465646279746573ULL;
+    uint32_t words = mac_words(in);
+
+    for (uint32_t w = 0; w < words; w++) {
+        uint64_t m = mac_word(in, w);
+        v3 ^= m;
+        POWERUDP_SIPROUND(v0, v1, v2, v3);
+        POWERUDP_SIPROUND(v0, v1, v2, v3);
+        v0 ^= m;
+    }
+    v2 ^= 0xff;
+    for (int r = 0; r < 4; r++) POWERUDP_SIPROUND(v0, v1, v2, v3);
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+static inline __attribute__((always_inline)) void mac_lanes(const PowerUDPKey *key, const mac_input *in, int n, uint64_t *tags) {
+    mac_vec v0, v1, v2, v3;
+    uint32_t words[MAC_LANES], max_words = 0;
+
+    for (int l = 0; l < MAC_LANES; l++) {
+        v0[l] = key->k0 ^ 0x736f6d6570736575ULL;
+        v1[l] = key->k1 ^ 0x646f72616e646f6dULL;
+        v2[l] = key->k0 ^ 0x6c7967656e657261ULL;
+        v3[l] = key->k1 ^ 0x7465646279746573ULL;
+        words[l] = l < n ? mac_words(&in[l]) : 0;
+        if (words[l] > max_words) max_words = words[l];
+    }
+    // Cabeçalho e palavras cheias comuns a todas as pistas: sem máscaras nem casos especiais
+    uint32_t head_words = in[0].head_len / 8, common = UINT32_MAX, start = 0;
+    int uniform = n == MAC_LANES;
+    for (int l = 0; l < n; l++) {
+        uint32_t full = in[l].body_len / 8;
+        if (full < common) common = full;
+        if (in[l].head_len != in[0].head_len) uniform = 0;
+    }
+    mac_vec m;
+    if (uniform) {
+        for (uint32_t w = 0; w < head_words; w++) {
+            for (int l = 0; l < MAC_LANES; l++) m[l] = powerudp_le64(in[l].head + 8 * w);
+            v3 ^= m;
+            POWERUDP_SIPROUND(v0, v1, v2, v3);
+            POWERUDP_SIPROUND(v0, v1, v2, v3);
+            v0 ^= m;
+        }
+        for (uint32_t off = 0; off < common * 8; off += 8) {
+            for (int l = 0; l < MAC_LANES; l++) m[l] = powerudp_le64(in[l].body + off);
+            v3 ^= m;
+            POWERUDP_SIPROUND(v0, v1, v2, v3);
+            POWERUDP_SIPROUND(v0, v1, v2, v3);
+            v0 ^= m;
+        }
+        start = head_words + common;
+    }
+    for (uint32_t w = start; w < max_words; w++) {
+        mac_vec mask;
+        for (int l = 0; l < MAC_LANES; l++) {
+            m[l] = w < words[l] ? mac_word(&in[l], w) : 0;
+            mask[l] = w < words[l] ? ~0ULL : 0;
+        }
+        mac_vec s0 = v0, s1 = v1, s2 = v2, s3 = v3 ^ m;
+        POWERUDP_SIPROUND(s0, s1, s2, s3);
+        POWERUDP_SIPROUND(s0, s1, s2, s3);
+        s0 ^= m;
+        v0 = (s0 & mask) | (v0 & ~mask);
+        v1 = (s1 & mask) | (v1 & ~mask);
+        v2 = (s2 & mask) | (v2 & ~mask);
+        v3 = (s3 & mask) | (v3 & ~mask);
+    }
+    v2 ^= 0xff;
+    for (int r = 0; r < 4; r++) POWERUDP_SIPROUND(v0, v1, v2, v3);
+    mac_vec t = v0 ^ v1 ^ v2 ^ v3;
+    for (int l = 0; l < n; l++) tags[l] = t[l];
+}
+
+static void mac_lanes_vector(const PowerUDPKey *key, const mac_input *in, int n, uint64_t *tags) {
+    mac_lanes(key, in, n, tags);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2")))
+static void mac_lanes_avx2(const PowerUDPKey *key, const mac_input *in, int n, uint64_t *tags) {
+    mac_lanes(key, in, n, tags);
+}
+#else
+#define mac_lanes_avx2 mac_lanes_vector
+#endif
+
+static void mac_inputs(const PowerUDPKey *key, const mac_input *in, int n, uint64_t *tags) {
+    if (mac_impl < 0) set_mac_impl(-1);
+    for (int i = 0; i < n; i += MAC_LANES) {
+        int k = n - i < MAC_LANES ? n - i : MAC_LANES;
+        if (mac_impl == POWERUDP_MAC_SCALAR || k == 1) {
+            for (int j = 0; j < k; j++) tags[i + j] = mac_one(key, &in[i + j]);
+        } else if (mac_impl == POWERUDP_MAC_AVX2) {
+            mac_lanes_avx2(key, in + i, k, tags + i);
+        } else {
+            mac_lanes_vector(key, in + i, k, tags + i);
+        }
+    }
+}
+
+/*
+ * Verifica um datagrama recebido (len inclui o MAC). Devolve o comprimento sem o MAC,
+ * ou -1 se não confere. Os lotes do recvmmsg passam por rx_verify.
+ */
+static int mac_verify_one(const char *datagram, unsigned int len) {
+    if (len < sizeof(PowerUDPHeader) + POWERUDP_MAC_LEN) return -1;
+    len -= POWERUDP_MAC_LEN;
+    mac_input in = { (const uint8_t *)datagram, (const uint8_t *)datagram + sizeof(PowerUDPHeader),
+                     sizeof(PowerUDPHeader), len - sizeof(PowerUDPHeader) };
+    return mac_one(&mac_key, &in) == powerudp_le64((const uint8_t *)datagram + len) ? (int)len : -1;
+}
+
+/* -------------------------------- Compressão -------------------------------- */
+
+/*
+ * Codec LZ no formato de bloco do LZ4: sequências de um token (nibble alto = nº de
+ * literais, baixo = comprimento do match - 4, 15 = continua em bytes de 255), os
+ * literais, o offset do match (16 bits, little-endian) e o resto do comprimento.
+ * A última sequência só tem literais; os últimos 5 bytes são sempre literais e
+ * nenhum match começa nos últimos 12. O compressor é guloso, com uma tabela de
+ * hash de 4 bytes que não é limpa entre mensagens (as entradas velhas são
+ * verificadas contra os bytes), e acelera o passo em zonas sem matches.
+ */
+#define LZ_HASH_BITS 12
+#define LZ_MIN_MATCH 4
+#define LZ_LAST_LITERALS 5
+#define LZ_MF_LIMIT 12
+
+static inline uint32_t lz_read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t lz_hash(uint32_t v) {
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+static uint8_t *lz_length(uint8_t *op, size_t len) {
+    for (; len >= 255; len -= 255) *op++ = 255;
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+// Comprime src para dst; devolve o tamanho, ou 0 se não couber em cap
+static size_t lz_compress(const uint8_t *src, size_t n, uint8_t *dst, size_t cap) {
+    static uint32_t table[1 << LZ_HASH_BITS];   // só a thread de I/O comprime
+    uint8_t *op = dst, *end = dst + cap;
+    size_t ip = 0, anchor = 0;
+
+    while (n > LZ_MF_LIMIT && ip < n - LZ_MF_LIMIT) {
+        uint32_t seq = lz_read32(src + ip);
+        uint32_t h = lz_hash(seq);
+        size_t ref = table[h];
+        table[h] = (uint32_t)ip;
+        if (ref >= ip || ip - ref > 65535 || lz_read32(src + ref) != seq) {
+            ip += 1 + ((ip - anchor) >> 6);
+            continue;
+        }
+        while (ip > anchor && ref > 0 && src[ip - 1] == src[ref - 1]) {
+            ip--;
+            ref--;
+        }
+        size_t len = LZ_MIN_MATCH, limit = n - LZ_LAST_LITERALS;
+        while (ip + len + 8 <= limit) {
+            uint64_t a, b;
+            memcpy(&a, src + ip + len, 8);
+            memcpy(&b, src + ref + len, 8);
+            if (a != b) {
+                len += __builtin_ctzll(a ^ b) / 8;
+                goto matched;
+            }
+            len += 8;
+        }
+        while (ip + len < limit && src[ip + len] == src[ref + len]) len++;
+    matched:;
+        size_t lits = ip - anchor;
+        if (op + 1 + lits + lits / 255 + 2 + (len - LZ_MIN_MATCH) / 255 + 1 > end) return 0;
+        uint8_t *token = op++;
+        *token = (uint8_t)((lits >= 15 ? 15 : lits) << 4);
+        if (lits >= 15) op = lz_length(op, lits - 15);
+        memcpy(op, src + anchor, lits);
+        op += lits;
+        *op++ = (uint8_t)(ip - ref);
+        *op++ = (uint8_t)((ip - ref) >> 8);
+        size_t ml = len - LZ_MIN_MATCH;
+        *token |= ml >= 15 ? 15 : (uint8_t)ml;
+        if (ml >= 15) op = lz_length(op, ml - 15);
+        ip += len;
+        anchor = ip;
+        if (ip < n - LZ_MF_LIMIT) table[lz_hash(lz_read32(src + ip - 2))] = (uint32_t)(ip - 2);
+    }
+
+    size_t lits = n - anchor;
+    if (op + 1 + lits + lits / 255 + 1 > end) return 0;
+    *op++ = (uint8_t)((lits >= 15 ? 15 : lits) << 4);
+    if (lits >= 15) op = lz_length(op, lits - 15);
+    memcpy(op, src + anchor, lits);
+    return op + lits - dst;
+}
+
+// Descomprime exatamente out_len bytes; -1 se o bloco for inválido (vem da rede)
+static int lz_decompress(const uint8_t *src, size_t n, uint8_t *dst, size_t out_len) {
+    size_t ip = 0, op = 0;
+    for (;;) {
+        if (ip >= n) return -1;
+        uint8_t token = src[ip++];
+        size_t lits = token >> 4;
+        if (lits == 15) {
+            uint8_t c;
+            do {
+                if (ip >= n) return -1;
+                lits += c = src[ip++];
+            } while (c == 255);
+        }
+        if (lits > n - ip || lits > out_len - op) return -1;
+        memcpy(dst + op, src + ip, lits);
+        ip += lits;
+        op += lits;
+        if (ip == n) return op == out_len ? 0 : -1;
+
+        if (n - ip < 2) return -1;
+        size_t offset = src[ip] | (size_t)src[ip + 1] << 8;
+        ip += 2;
+        if (offset == 0 || offset > op) return -1;
+        size_t len = token & 15;
+        if (len == 15) {
+            uint8_t c;
+            do {
+                if (ip >= n) return -1;
+                len += c = src[ip++];
+            } while (c == 255);
+        }
+        len += LZ_MIN_MATCH;
+        if (len > out_len - op) return -1;
+        const uint8_t *match = dst + op - offset;
+        if (offset >= len) memcpy(dst + op, match, len);
+        else for (size_t i = 0; i < len; i++) dst[op + i] = match[i];
+        op += len;
+    }
+}
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Decide por peer: comprime enquanto poupar pelo menos 1/8; quando não poupa, as
+ * LZ_SKIP_MIN mensagens seguintes saem em claro sem custo, e depois uma volta a
+ * ser amostrada. Cada amostra falhada duplica a pausa (até LZ_SKIP_MAX), por isso
+ * dados incompressíveis quase não gastam CPU; uma amostra boa repõe a pausa.
+ */
+static void lz_prepare(peer *p, send_req *req) {
+    if (!config.compression || req->len < LZ_MIN || req->len > LZ_MESSAGE_MAX) return;
+    if (p->lz_skip) {
+        p->lz_skip--;
+        metric_add(M_LZ_SKIPPED, 1);
+        return;
+    }
+
+    size_t cap = req->len - req->len / 8;
+    pkt_buf *b = cap + 4 <= (size_t)options.mtu ? pool_get() : heap_buf(NULL, cap + 4);
+    if (!b) return;
+    uint64_t t0 = now_ns();
+    size_t n = lz_compress((const uint8_t *)req->data, req->len, (uint8_t *)b->raw + 4, cap);
+    metric_add(M_LZ_NS, now_ns() - t0);
+    if (!n) {
+        pkt_put(b);
+        p->lz_backoff = p->lz_backoff ? p->lz_backoff * 2 : LZ_SKIP_MIN;
+        if (p->lz_backoff > LZ_SKIP_MAX) p->lz_backoff = LZ_SKIP_MAX;
+        p->lz_skip = p->lz_backoff;
+        metric_add(M_LZ_SKIPPED, 1);
+        return;
+    }
+    p->lz_backoff = 0;
+
+    uint32_t orig = htonl((uint32_t)req->len);
+    memcpy(b->raw, &orig, 4);
+    b->data = b->raw;
+    b->len = n + 4;
+    metric_add(M_LZ_MESSAGES, 1);
+    metric_add(M_LZ_SAVED, req->len - b->len);
+    req->lz = b;
+}
+
+// Mensagem recebida com POWERUDP_FLAG_LZ: devolve a versão descomprimida (ou NULL)
+static pkt_buf *lz_unpack(const pkt_buf *b) {
+    uint32_t orig;
+    if (b->len < 4) goto invalid;
+    memcpy(&orig, b->data, 4);
+    orig = ntohl(orig);
+    // Um bloco LZ4 não passa de ~255:1; trava tamanhos forjados antes de alocar
+    if (orig > LZ_MESSAGE_MAX || orig > (b->len - 4) * 255 + 16) goto invalid;
+
+    pkt_buf *m = orig <= (uint32_t)options.mtu ? pool_get() : heap_buf(NULL, orig);
+    if (!m) return NULL;
+    uint64_t t0 = now_ns();
+    int r = lz_decompress((const uint8_t *)b->data + 4, b->len - 4, (uint8_t *)m->raw, orig);
+    metric_add(M_LZ_NS, now_ns() - t0);
+    if (r < 0) {
+        pkt_put(m);
+        goto invalid;
+    }
+    m->data = m->raw;
+    m->len = orig;
+    return m;
+
+invalid:
+    metric_add(M_LZ_ERRORS, 1);
+    return NULL;
+}
+
+/* ---------------------------- Correção de erros ----------------------------- */
+
+/*
+ * FEC sobre GF(2^8) (polinómio 0x11d). A paridade j de um grupo é a soma dos
+ * símbolos multiplicados por fec_coef[j][i]: uma matriz de Cauchy 1 / (x_j + y_i),
+ * com x_j = K_MAX + j e y_i = i, com cada coluna dividida pela da linha 0. Assim a
+ * linha 0 fica toda a 1 (XOR simples) e qualquer submatriz quadrada continua
+ * invertível, pelo que quaisquer e paridades recuperam quaisquer e perdas.
+ * O trabalho está todo em fec_madd (dst += c * src numa região): c parte-se em duas
+ * tabelas de 16 produtos, uma por nibble, consultadas com pshufb 16 ou 32 bytes de
+ * cada vez; a implementação é escolhida em tempo de execução, como a do MAC.
+ */
+static uint8_t gf_exp[512], gf_log[256];
+static uint8_t fec_coef[POWERUDP_FEC_PARITY_MAX][POWERUDP_FEC_K_MAX];
+static int fec_impl = -1;       // POWERUDP_FEC_*; -1 = ainda por escolher
+static uint8_t *fec_scratch;    // síndromes da reconstrução (PARITY_MAX linhas de mtu bytes)
+
+static inline uint8_t gf_mul(uint8_t a, uint8_t b) {
+    return a && b ? gf_exp[gf_log[a] + gf_log[b]] : 0;
+}
+
+static inline uint8_t gf_inv(uint8_t a) {
+    return gf_exp[255 - gf_log[a]];
+}
+
+static void gf_init() {
+    if (gf_exp[0]) return;
+    unsigned x = 1;
+    for (int i = 0; i < 255; i++) {
+        gf_exp[i] = gf_exp[i + 255] = (uint8_t)x;
+        gf_log[x] = (uint8_t)i;
+        x <<= 1;
+        if (x & 0x100) x ^= 0x11d;
+    }
+    for (int j = 0; j < POWERUDP_FEC_PARITY_MAX; j++)
+        for (int i = 0; i < POWERUDP_FEC_K_MAX; i++)
+            fec_coef[j][i] = gf_mul(POWERUDP_FEC_K_MAX ^ i, gf_inv((uint8_t)((POWERUDP_FEC_K_MAX + j) ^ i)));
+}
+
+static void gf_nibbles(uint8_t c, uint8_t lo[16], uint8_t hi[16]) {
+    for (int i = 0; i < 16; i++) {
+        lo[i] = gf_mul(c, (uint8_t)i);
+        hi[i] = gf_mul(c, (uint8_t)(i << 4));
+    }
+}
+
+static void fec_xor(uint8_t *dst, const uint8_t *src, size_t n) {
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        uint64_t a, b;
+        memcpy(&a, dst + i, 8);
+        memcpy(&b, src + i, 8);
+        a ^= b;
+        memcpy(dst + i, &a, 8);
+    }
+    for (; i < n; i++) dst[i] ^= src[i];
+}
+
+static void gf_madd_scalar(uint8_t *dst, const uint8_t *src, size_t n, const uint8_t lo[16], const uint8_t hi[16]) {
+    for (size_t i = 0; i < n; i++) dst[i] ^= lo[src[i] & 15] ^ hi[src[i] >> 4];
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("ssse3")))
+static void gf_madd_ssse3(uint8_t *dst, const uint8_t *src, size_t n, const uint8_t lo[16], const uint8_t hi[16]) {
+    __m128i tlo = _mm_loadu_si128((const __m128i *)lo), thi = _mm_loadu_si128((const __m128i *)hi);
+    __m128i mask = _mm_set1_epi8(0x0f);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i l = _mm_shuffle_epi8(tlo, _mm_and_si128(s, mask));
+        __m128i h = _mm_shuffle_epi8(thi, _mm_and_si128(_mm_srli_epi64(s, 4), mask));
+        __m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_xor_si128(d, _mm_xor_si128(l, h)));
+    }
+    gf_madd_scalar(dst + i, src + i, n - i, lo, hi);
+}
+
+__attribute__((target("avx2")))
+static void gf_madd_avx2(uint8_t *dst, const uint8_t *src, size_t n, const uint8_t lo[16], const uint8_t hi[16]) {
+    __m256i tlo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)lo));
+    __m256i thi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)hi));
+    __m256i mask = _mm256_set1_epi8(0x0f);
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i s = _mm256_loadu_si256((const __m256i *)(src + i));
+        __m256i l = _mm256_shuffle_epi8(tlo, _mm256_and_si256(s, mask));
+        __m256i h = _mm256_shuffle_epi8(thi, _mm256_and_si256(_mm256_srli_epi64(s, 4), mask));
+        __m256i d = _mm256_loadu_si256((const __m256i *)(dst + i));
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_xor_si256(d, _mm256_xor_si256(l, h)));
+    }
+    // A cauda de 16 bytes fica aqui (codificação VEX): chamar a versão SSSE3 mistura SSE com AVX
+    if (i + 16 <= n) {
+        __m128i s = _mm_loadu_si128((const __m128i *)(src + i)), m4 = _mm256_castsi256_si128(mask);
+        __m128i l = _mm_shuffle_epi8(_mm256_castsi256_si128(tlo), _mm_and_si128(s, m4));
+        __m128i h = _mm_shuffle_epi8(_mm256_castsi256_si128(thi), _mm_and_si128(_mm_srli_epi64(s, 4), m4));
+        __m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_xor_si128(d, _mm_xor_si128(l, h)));
+        i += 16;
+    }
+    gf_madd_scalar(dst + i, src + i, n - i, lo, hi);
+}
+#else
+#define gf_madd_ssse3 gf_madd_scalar
+#define gf_madd_avx2 gf_madd_scalar
+#endif
+
+// dst[i] += c * src[i] em GF(2^8), para i < n
+static void fec_madd(uint8_t *dst, const uint8_t *src, size_t n, uint8_t c) {
+    uint8_t lo[16], hi[16];
+    if (c == 0) return;
+    if (c == 1) {
+        fec_xor(dst, src, n);
+        return;
+    }
+    gf_nibbles(c, lo, hi);
+    if (fec_impl == POWERUDP_FEC_AVX2) gf_madd_avx2(dst, src, n, lo, hi);
+    else if (fec_impl == POWERUDP_FEC_SSSE3) gf_madd_ssse3(dst, src, n, lo, hi);
+    else gf_madd_scalar(dst, src, n, lo, hi);
+}
+
+// Soma c * símbolo (prefixo de comprimento e flags, depois o payload) a row
+static void fec_symbol_madd(uint8_t *row, uint8_t c, int len, uint8_t flags, const char *data) {
+    uint8_t prefix[FEC_PREFIX] = { (uint8_t)(len >> 8), (uint8_t)len, flags & ~POWERUDP_FLAG_ACK_NOW, 0 };
+    for (int i = 0; i < FEC_PREFIX; i++) row[i] ^= gf_mul(c, prefix[i]);
+    fec_madd(row + FEC_PREFIX, (const uint8_t *)data, len, c);
+}
+
+/*
+ * Inverte a matriz e x e de a para inv (Gauss-Jordan em GF(2^8)); -1 se for
+ * singular, o que com os coeficientes de Cauchy só acontece com lixo no fio.
+ */
+static int gf_invert(uint8_t a[][POWERUDP_FEC_PARITY_MAX], uint8_t inv[][POWERUDP_FEC_PARITY_MAX], int e) {
+    for (int r = 0; r < e; r++)
+        for (int c = 0; c < e; c++) inv[r][c] = r == c;
+    for (int c = 0; c < e; c++) {
+        int pivot = c;
+        while (pivot < e && !a[pivot][c]) pivot++;
+        if (pivot == e) return -1;
+        for (int k = 0; k < e; k++) {
+            uint8_t t = a[c][k]; a[c][k] = a[pivot][k]; a[pivot][k] = t;
+            t = inv[c][k]; inv[c][k] = inv[pivot][k]; inv[pivot][k] = t;
+        }
+        uint8_t f = gf_inv(a[c][c]);
+        for (int k = 0; k < e; k++) {
+            a[c][k] = gf_mul(a[c][k], f);
+            inv[c][k] = gf_mul(inv[c][k], f);
+        }
+        for (int r = 0; r < e; r++) {
+            uint8_t m = a[r][c];
+            if (r == c || !m) continue;
+            for (int k = 0; k < e; k++) {
+                a[r][k] ^= gf_mul(m, a[c][k]);
+                inv[r][k] ^= gf_mul(m, inv[c][k]);
+            }
+        }
+    }
+    return 0;
+}
+
+/* ----------------------------- Simulador de rede ---------------------------- */
+
+/*
+ * Imperfeições de rede simuladas dentro do processo, uma configuração por sentido
+ * (envio no fim de send_packet, receção antes de handle_datagram). Cada pacote:
+ *   - pode perder-se (Gilbert-Elliott: estado bom/mau, cada um com a sua perda, e
+ *     passagens entre eles sorteadas por pacote; sem elas é perda uniforme);
+ *   - passa pelo limitador de débito: sai quando a ligação acabar de transmitir os
+ *     anteriores, e perde-se se a fila de queue_bytes à frente dele estiver cheia;
+ *   - é atrasado delay_us mais um jitter uniforme, e reorder_us em reorder_pct dos
+ *     pacotes; em duplicate_pct deles sai também uma cópia, com jitter próprio.
+ * Os pacotes atrasados ficam num heap por instante de saída (desempate pela ordem
+ * de chegada) e são libertados no início de cada volta da thread de I/O, com a
+ * resolução de um tick. Cada pacote gasta sempre seis valores do gerador
+ * (xorshift64*, semeado com seed), qualquer que seja o destino dele: a mesma
+ * semente com o mesmo tráfego dá as mesmas decisões e atrasos. Só as perdas na
+ * fila do limitador dependem também do relógio.
+ */
+typedef struct {
+    uint64_t due_us;
+    uint64_t order;
+    pkt_buf *buf;
+    char *data;                 // datagrama (cabeçalho incluído), dentro de buf
+    unsigned int len;
+    struct sockaddr_in addr;    // destino no envio, origem na receção
+} sim_pkt;
+
+typedef struct {
+    PowerUDPImpairment cfg;
+    int active;
+    uint64_t rng;
+    int bad;                    // estado mau do Gilbert-Elliott
+    uint64_t link_free_us;      // fim da transmissão do último pacote no limitador
+    sim_pkt *heap;
+    size_t count, cap;
+} sim_dir;
+
+// Só a thread de I/O mexe em sim; set_impairment passa por sim_pending (config_lock)
+static sim_dir sim[2];
+static PowerUDPImpairment sim_pending[2];
+static atomic_int sim_dirty = 0;
+static uint64_t sim_order = 0;
+
+static void handle_datagram(pkt_buf *b, char *buffer, unsigned int len, const struct sockaddr_in *from);
+
+static uint64_t sim_next(sim_dir *d) {
+    d->rng ^= d->rng >> 12;
+    d->rng ^= d->rng << 25;
+    d->rng ^= d->rng >> 27;
+    return d->rng * 0x2545F4914F6CDD1DULL;
+}
+
+static double sim_pct(sim_dir *d) {
+    return (double)(sim_next(d) >> 11) * (100.0 / 9007199254740992.0);
+}
+
+static void sim_configure(sim_dir *d, const PowerUDPImpairment *cfg) {
+    const PowerUDPImpairment zero = { 0 };
+    d->cfg = *cfg;
+    d->cfg.seed = 0;
+    d->active = memcmp(&d->cfg, &zero, sizeof(zero)) != 0;
+    d->cfg.seed = cfg->seed;
+    // splitmix64: sementes próximas dão sequências independentes (e nunca zero)
+    uint64_t z = cfg->seed + 0x9E3779B97F4A7C15ULL;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    d->rng = (z ^ (z >> 31)) | 1;
+    d->bad = 0;
+    d->link_free_us = 0;
+}
+
+static int sim_before(const sim_pkt *a, const sim_pkt *b) {
+    return a->due_us < b->due_us || (a->due_us == b->due_us && a->order < b->order);
+}
+
+static int sim_push(sim_dir *d, pkt_buf *b, char *data, unsigned int len, const struct sockaddr_in *addr, uint64_t due) {
+    if (d->count == d->cap) {
+        size_t cap = d->cap ? d->cap * 2 : 256;
+        sim_pkt *heap = realloc(d->heap, cap * sizeof(*heap));
+        if (!heap) return -1;
+        d->heap = heap;
+        d->cap = cap;
+    }
+    pkt_ref(b);
+    sim_pkt pkt = { due, sim_order++, b, data, len, *addr };
+    size_t i = d->count++;
+    while (i > 0 && sim_before(&pkt, &d->heap[(i - 1) / 2])) {
+        d->heap[i] = d->heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    d->heap[i] = pkt;
+    metric_add(M_SIM_DELAYED, 1);
+    return 0;
+}
+
+static sim_pkt sim_pop(sim_dir *d) {
+    sim_pkt top = d->heap[0], last = d->heap[--d->count];
+    size_t i = 0;
+    for (;;) {
+        size_t c = 2 * i + 1;
+        if (c >= d->count) break;
+        if (c + 1 < d->count && sim_before(&d->heap[c + 1], &d->heap[c])) c++;
+        if (!sim_before(&d->heap[c], &last)) break;
+        d->heap[i] = d->heap[c];
+        i = c;
+    }
+    if (d->count) d->heap[i] = last;
+    return top;
+}
+
+/*
+ * Decide o destino de um pacote de len bytes: devolve 0 se se perde, ou o número
+ * de cópias (1 ou 2) com o atraso de cada uma em delay[].
+ */
+static int sim_decide(sim_dir *d, unsigned int len, uint64_t now, uint64_t delay[2]) {
+    const PowerUDPImpairment *c = &d->cfg;
+    double r_state = sim_pct(d), r_loss = sim_pct(d), r_reorder = sim_pct(d), r_dup = sim_pct(d);
+    uint64_t r_jitter = sim_next(d), r_dup_jitter = sim_next(d);
+
+    if (r_state < (d->bad ? c->bad_to_good_pct : c->good_to_bad_pct)) d->bad = !d->bad;
+    if (r_loss < (d->bad ? c->burst_loss_pct : c->loss_pct)) {
+        metric_add(M_SIM_DROPS, 1);
+        return 0;
+    }
+
+    uint64_t sent = now;
+    if (c->rate_kbps > 0) {
+        uint64_t backlog = d->link_free_us > now ? (d->link_free_us - now) * c->rate_kbps / 8000 : 0;
+        if (c->queue_bytes > 0 && backlog + len > (uint64_t)c->queue_bytes) {
+            metric_add(M_SIM_DROPS, 1);
+            return 0;
+        }
+        d->link_free_us = (d->link_free_us > now ? d->link_free_us : now) + (uint64_t)len * 8000 / c->rate_kbps;
+        sent = d->link_free_us;
+    }
+
+    uint64_t base = sent - now + (c->delay_us > 0 ? c->delay_us : 0);
+    if (r_reorder < c->reorder_pct) base += c->reorder_us > 0 ? c->reorder_us : options.io_tick_us;
+    uint64_t jitter = c->jitter_us > 0 ? c->jitter_us + 1 : 1;
+    delay[0] = base + r_jitter % jitter;
+    if (r_dup >= c->duplicate_pct) return 1;
+    metric_add(M_SIM_DUPS, 1);
+    delay[1] = base + r_dup_jitter % jitter;
+    return 2;
+}
+
+static size_t header_size() {
+    return options.checksum ? sizeof(PowerUDPHeaderV1) : sizeof(PowerUDPHeader);
+}
+
+// Preenche o cabeçalho de um pacote a enviar (v1 com CRC32C quando há checksum); devolve o tamanho
+static size_t header_build(PowerUDPHeaderV1 *h, uint32_t seq, uint8_t ack, uint8_t flags, const char *data, int len) {
+    h->base.seq_num = htonl(seq);
+    h->base.ack = ack;
+    h->base.flags = flags;
+    h->base.length = htons(len);
+    if (!options.checksum) return sizeof(h->base);
+
+    h->base.flags |= POWERUDP_HEADER_V1;
+    h->crc32c = 0;
+    h->reserved = 0;
+    uint32_t crc = powerudp_crc32c(0, h, sizeof(*h));
+    if (len > 0) crc = powerudp_crc32c(crc, data, len);
+    h->crc32c = htonl(crc);
+    return sizeof(*h);
+}
+
+// Envio: devolve 1 se o pacote ficou com o simulador (perdido ou atrasado)
+static int sim_send(const struct sockaddr_in *dest, uint32_t seq, uint8_t ack, uint8_t flags, const char *data, int len) {
+    sim_dir *d = &sim[POWERUDP_DIR_TX];
+    // A paridade FEC conta como dados: é perdida como eles
+    if (!d->active || (ack != 0 && ack != 4 && d->cfg.data_only)) return 0;
+
+    uint64_t now = now_us(), delay[2];
+    int copies = sim_decide(d, header_size() + len, now, delay);
+    if (copies == 1 && delay[0] == 0) return 0;
+    if (copies == 0) return 1;
+
+    pkt_buf *b = pool_get();
+    if (!b) return 1;
+    PowerUDPHeaderV1 header;
+    size_t hlen = header_build(&header, seq, ack, flags, data, len);
+    size_t total = hlen + len;
+    memcpy(b->raw, &header, hlen);
+    if (len > 0) memcpy(b->raw + hlen, data, len);
+    if (mac_on) {
+        mac_input in = { (const uint8_t *)b->raw, (const uint8_t *)b->raw + hlen, (uint32_t)hlen, (uint32_t)len };
+        powerudp_put_le64((uint8_t *)b->raw + total, mac_one(&mac_key, &in));
+        total += POWERUDP_MAC_LEN;
+    }
+    for (int i = 0; i < copies; i++)
+        sim_push(d, b, b->raw, total, dest, now + delay[i]);
+    pkt_put(b);
+    return 1;
+}
+
+// Receção: devolve 1 se o datagrama ficou com o simulador (mais uma referência a b)
+static int sim_receive(pkt_buf *b, char *buffer, unsigned int len, const struct sockaddr_in *from) {
+    sim_dir *d = &sim[POWERUDP_DIR_RX];
+    if (!d->active) return 0;
+    if (d->cfg.data_only && len > offsetof(PowerUDPHeader, ack) && buffer[offsetof(PowerUDPHeader, ack)] != 0
+        && buffer[offsetof(PowerUDPHeader, ack)] != 4) return 0;
+
+    uint64_t now = now_us(), delay[2];
+    int copies = sim_decide(d, len, now, delay);
+    if (copies == 1 && delay[0] == 0) return 0;
+    for (int i = 0; i < copies; i++) sim_push(d, b, buffer, len, from, now + delay[i]);
+    return 1;
+}
+
+// Liberta os pacotes atrasados cujo instante já passou
+static void sim_release() {
+    uint64_t now = now_us();
+    sim_dir *tx = &sim[POWERUDP_DIR_TX], *rx = &sim[POWERUDP_DIR_RX];
+    while (tx->count && tx->heap[0].due_us <= now) {
+        sim_pkt pkt = sim_pop(tx);
+        if (sendto(udp_fd, pkt.data, pkt.len, 0, (struct sockaddr *)&pkt.addr, sizeof(pkt.addr)) >= 0) {
+            metric_add(M_PACKETS_SENT, 1);
+            metric_add(M_BYTES_SENT, pkt.len);
+        }
+        metric_add(M_TX_SYSCALLS, 1);
+        pkt_put(pkt.buf);
+    }
+    while (rx->count && rx->heap[0].due_us <= now) {
+        sim_pkt pkt = sim_pop(rx);
+        handle_datagram(pkt.buf, pkt.data, pkt.len, &pkt.addr);
+        pkt_put(pkt.buf);
+    }
+}
+
+static void sim_apply_config() {
+    if (!atomic_exchange(&sim_dirty, 0)) return;
+    pthread_mutex_lock(&config_lock);
+    for (int i = 0; i < 2; i++) sim_configure(&sim[i], &sim_pending[i]);
+    pthread_mutex_unlock(&config_lock);
+}
+
+// Descarta o que ainda está atrasado (antes de pool_destroy)
+static void sim_clear() {
+    for (int i = 0; i < 2; i++) {
+        while (sim[i].count) pkt_put(sim[i].heap[--sim[i].count].buf);
+        free(sim[i].heap);
+        sim[i].heap = NULL;
+        sim[i].cap = 0;
+    }
+}
+
+/* ------------------------------- Envio no fio ------------------------------- */
+
+static int batch_alloc(io_batch *b, int n, int rx) {
+    b->msgs = calloc(n, sizeof(*b->msgs));
+    b->iov = calloc(3 * (size_t)n, sizeof(*b->iov));
+    b->addr = calloc(n, sizeof(*b->addr));
+    b->hdrs = calloc(n, sizeof(*b->hdrs));
+    b->ctl = rx ? NULL : calloc(n, sizeof(*b->ctl));
+    b->pkts = rx ? calloc(n, sizeof(*b->pkts)) : NULL;
+    b->coal = !rx && options.coalesce_us > 0 ? malloc((size_t)n * options.mtu) : NULL;
+    b->tags = rx ? NULL : calloc(n, sizeof(*b->tags));
+    b->count = 0;
+    return b->msgs && b->iov && b->addr && b->hdrs && (b->pkts || !rx) && (b->ctl || rx)
+        && (b->coal || rx || options.coalesce_us <= 0) && (b->tags || rx) ? 0 : -1;
+}
+
+static void batch_free(io_batch *b) {
+    for (int i = 0; b->pkts && i < options.batch_size; i++)
+        if (b->pkts[i]) pkt_put(b->pkts[i]);
+    free(b->msgs);
+    free(b->iov);
+    free(b->addr);
+    free(b->hdrs);
+    free(b->ctl);
+    free(b->pkts);
+    free(b->coal);
+    free(b->tags);
+    memset(b, 0, sizeof(*b));
+}
+
+// Assina o lote de envio inteiro de uma vez (antes de o entregar ao kernel)
+static void tx_sign() {
+    mac_input in[BATCH_MAX];
+    if (!mac_on || !tx_batch.count) return;
+
+    for (int i = 0; i < tx_batch.count; i++) {
+        struct iovec *iov = tx_batch.msgs[i].msg_hdr.msg_iov;
+        int has_body = tx_batch.msgs[i].msg_hdr.msg_iovlen == 3;
+        in[i].head = iov[0].iov_base;
+        in[i].head_len = iov[0].iov_len;
+        in[i].body = has_body ? iov[1].iov_base : NULL;
+        in[i].body_len = has_body ? iov[1].iov_len : 0;
+    }
+    mac_inputs(&mac_key, in, tx_batch.count, tx_batch.tags);
+    for (int i = 0; i < tx_batch.count; i++)
+        powerudp_put_le64((uint8_t *)&tx_batch.tags[i], tx_batch.tags[i]);
+}
+
+static void flush_tx() {
+    if (uring_active()) {
+        // Lote cheio a meio da volta: submete já, para o lote poder ser reutilizado
+        uring_queue_tx();
+        uring_submit();
+        return;
+    }
+
+    int sent = 0;
+    tx_sign();
+    while (sent < tx_batch.count) {
+        int n = sendmmsg(udp_fd, tx_batch.msgs + sent, tx_batch.count - sent, 0);
+        metric_add(M_TX_SYSCALLS, 1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN) perror("sendmmsg");
+            break;      // o que ficou por enviar é recuperado por retransmissão
+        }
+        sent += n;
+    }
+
+    uint64_t bytes = 0;
+    for (int i = 0; i < sent; i++) bytes += tx_batch.msgs[i].msg_len;
+    metric_add(M_PACKETS_SENT, sent);
+    metric_add(M_BYTES_SENT, bytes);
+    tx_batch.count = 0;
+    tx_writes++;
+}
+
+/*
+ * Acrescenta um pacote ao lote de envio; o lote é escrito quando enche ou no fim da volta.
+ * O payload não é copiado: o segundo iovec aponta diretamente para o buffer do chamador,
+ * que se mantém vivo até a mensagem ser confirmada.
+ */
+static void send_packet(const struct sockaddr_in *dest, uint32_t seq, uint8_t ack, uint8_t flags, const char *data, int len) {
+    if (sim_send(dest, seq, ack, flags, data, len)) return;
+
+    if (ack == 1 || ack == 3) metric_add(M_ACKS_SENT, 1);
+    else if (ack == 2) metric_add(M_NAKS_SENT, 1);
+
+    int i = tx_batch.count++;
+    struct iovec *iov = &tx_batch.iov[3 * i];
+    int iovs = 1;
+    iov[0].iov_base = &tx_batch.hdrs[i];
+    iov[0].iov_len = header_build(&tx_batch.hdrs[i], seq, ack, flags, data, len);
+    if (len > 0) {
+        iov[iovs].iov_base = (void *)data;
+        iov[iovs++].iov_len = len;
+    }
+    if (mac_on) {
+        iov[iovs].iov_base = &tx_batch.tags[i];     // preenchido por tx_sign
+        iov[iovs++].iov_len = POWERUDP_MAC_LEN;
+    }
+
+    tx_batch.addr[i] = *dest;
+    memset(&tx_batch.msgs[i].msg_hdr, 0, sizeof(tx_batch.msgs[i].msg_hdr));
+    tx_batch.msgs[i].msg_hdr.msg_name = &tx_batch.addr[i];
+    tx_batch.msgs[i].msg_hdr.msg_namelen = sizeof(tx_batch.addr[i]);
+    tx_batch.msgs[i].msg_hdr.msg_iov = iov;
+    tx_batch.msgs[i].msg_hdr.msg_iovlen = iovs;
+
+    if (tx_batch.count == options.batch_size) flush_tx();
+}
+
+/*
+ * RTO por peer (RFC 6298): SRTT + 4 * RTTVAR, com amostras só de pacotes que não
+ * foram retransmitidos (regra de Karn). Enquanto não há amostras usa-se o
+ * base_timeout da configuração; o RTO nunca excede base_timeout * max_retries.
+ */
+static uint64_t rto_max_us() {
+    uint64_t base = (uint64_t)(config.base_timeout ? config.base_timeout : 500) * 1000;
+    return base * (config.max_retries ? config.max_retries : 1);
+}
+
+static uint64_t peer_rto_us(peer *p) {
+    if (!p->srtt_us) return (uint64_t)(config.base_timeout ? config.base_timeout : 500) * 1000;
+
+    uint64_t rto = p->srtt_us + 4 * p->rttvar_us;
+    if (rto < RTO_MIN_US) rto = RTO_MIN_US;
+    if (rto > rto_max_us()) rto = rto_max_us();
+    return rto;
+}
+
+static void rtt_sample(peer *p, uint64_t rtt) {
+    if (!p->srtt_us) {
+        p->srtt_us = rtt;
+        p->rttvar_us = rtt / 2;
+        p->min_rtt_us = rtt;
+        return;
+    }
+    uint64_t err = rtt > p->srtt_us ? rtt - p->srtt_us : p->srtt_us - rtt;
+    p->rttvar_us = (3 * p->rttvar_us + err) / 4;
+    p->srtt_us = (7 * p->srtt_us + rtt) / 8;
+    if (rtt < p->min_rtt_us) p->min_rtt_us = rtt;
+}
+
+static uint64_t retransmit_timeout_us(peer *p, int tries) {
+    uint64_t rto = peer_rto_us(p);
+    if (!config.enable_backoff) return rto;
+    rto <<= (tries < 10 ? tries : 10);
+    return rto < rto_max_us() ? rto : rto_max_us();
+}
+
+/*
+ * Controlo de congestionamento. Cada algoritmo implementa cc_ops sobre o estado
+ * do peer; o ativo é o de config.congestion_control e o estado é reiniciado quando
+ * a configuração muda. A janela efetiva é min(window_size, cwnd).
+ */
+typedef struct {
+    const char *name;
+    void (*init)(peer *p);
+    void (*on_ack)(peer *p, uint32_t seq);                  // pacote novo confirmado
+    void (*on_loss)(peer *p, uint32_t seq, int timeout);    // buraco reenviado ou RTO
+    int pacing;
+} cc_ops;
+
+static void none_init(peer *p) {
+    p->cwnd = WINDOW_MAX;
+    p->ssthresh = UINT32_MAX;
+}
+
+static void none_on_ack(peer *p, uint32_t seq) {
+    (void)p;
+    (void)seq;
+}
+
+static void none_on_loss(peer *p, uint32_t seq, int timeout) {
+    (void)p;
+    (void)seq;
+    (void)timeout;
+}
+
+static void newreno_init(peer *p) {
+    p->cwnd = CWND_INIT;
+    p->cwnd_acc = 0;
+    p->ssthresh = UINT32_MAX;
+    p->in_recovery = 0;
+}
+
+// Slow start até ssthresh (+1 por ACK), depois +1 por janela (aditivo)
+static void newreno_on_ack(peer *p, uint32_t seq) {
+    if (p->in_recovery) {
+        if ((int32_t)(seq - p->recover) < 0) return;
+        p->in_recovery = 0;
+    }
+    if (p->cwnd < p->ssthresh) p->cwnd++;
+    else if (++p->cwnd_acc >= p->cwnd) {
+        p->cwnd++;
+        p->cwnd_acc = 0;
+    }
+    if (p->cwnd > WINDOW_MAX) p->cwnd = WINDOW_MAX;
+}
+
+/*
+ * Perdas da mesma janela contam como um só evento (NewReno); um RTO volta a 1 pacote.
+ * Os RTOs dos outros pacotes dessa janela mantêm a janela em 1, mas não voltam a
+ * calcular o ssthresh a partir dela.
+ */
+static void newreno_on_loss(peer *p, uint32_t seq, int timeout) {
+    if (p->in_recovery && (int32_t)(seq - p->recover) < 0) {
+        if (timeout) {
+            p->cwnd = 1;
+            p->cwnd_acc = 0;
+        }
+        return;
+    }
+    uint32_t flight = p->next_seq - p->base;
+    p->ssthresh = (flight < p->cwnd ? flight : p->cwnd) / 2;
+    if (p->ssthresh < CWND_MIN) p->ssthresh = CWND_MIN;
+    p->cwnd = timeout ? 1 : p->ssthresh;
+    p->cwnd_acc = 0;
+    p->recover = p->next_seq;
+    p->in_recovery = 1;
+    metric_add(M_CC_EVENTS, 1);
+}
+
+static const cc_ops cc_none = { "none", none_init, none_on_ack, none_on_loss, 0 };
+static const cc_ops cc_newreno = { "newreno", newreno_init, newreno_on_ack, newreno_on_loss, 1 };
+static const cc_ops *cc_algos[] = { &cc_none, &cc_newreno };
+
+static const cc_ops *peer_cc(peer *p) {
+    unsigned int algo = config.congestion_control;
+    if (algo >= sizeof(cc_algos) / sizeof(cc_algos[0])) algo = POWERUDP_CC_NONE;
+    if (p->cc_algo != algo + 1) {
+        p->cc_algo = algo + 1;
+        cc_algos[algo]->init(p);
+    }
+    return cc_algos[algo];
+}
+
+// Com FEC os fragmentos deixam espaço para o cabeçalho e o prefixo da paridade
+static int frag_payload() {
+    int fec = config.fec_k ? (int)(sizeof(PowerUDPFecHeader) + FEC_PREFIX) : 0;
+    return options.mtu - (int)header_size() - (mac_on ? POWERUDP_MAC_LEN : 0) - fec;
+}
+
+static uint32_t send_window(peer *p) {
+    peer_cc(p);
+    return p->cwnd < (uint32_t)options.window_size ? p->cwnd : (uint32_t)options.window_size;
+}
+
+/*
+ * Pacing: espaça os pacotes de srtt / cwnd (com ganho 2 em slow start e 1,25
+ * depois, para a janela poder crescer). Com a resolução do tick, saem de uma vez
+ * os pacotes cujo instante cai dentro do tick atual; crédito por usar nunca
+ * passa de um tick, para não haver rajadas depois de uma pausa.
+ */
+static int pace_ready(peer *p, uint64_t now) {
+    if (!peer_cc(p)->pacing || !p->srtt_us) return 1;
+    return p->pace_next_us < now + options.io_tick_us;
+}
+
+static void pace_sent(peer *p, uint64_t now) {
+    if (!peer_cc(p)->pacing || !p->srtt_us) return;
+    uint64_t gain_x4 = p->cwnd < p->ssthresh ? 8 : 5;
+    uint64_t interval = p->srtt_us * 4 / (gain_x4 * (p->cwnd ? p->cwnd : 1));
+    if (p->pace_next_us + options.io_tick_us < now) p->pace_next_us = now;
+    p->pace_next_us += interval;
+}
+
+/*
+ * Agrupamento: o grupo do peer é uma série de seq seguidos, ainda por enviar, cujos
+ * dados continuam no buffer de cada pedido. Só no envio é copiado, com os prefixos
+ * de comprimento, para a área do lote de envio da entrada que o datagrama ocupa.
+ */
+static void coal_flush(peer *p) {
+    if (!p->coal_count) return;
+    uint32_t seq = p->coal_seq;
+    int count = p->coal_count;
+    uint64_t now = now_us();
+    p->coal_count = 0;
+    p->coal_bytes = 0;
+    timer_cancel(&p->coal_timer);
+
+    for (int i = 0; i < count;) {
+        // Um registo cujo pedido já falhou não sai: parte o grupo em dois
+        if (!p->win[(seq + i) % WINDOW_MAX].req) {
+            i++;
+            continue;
+        }
+        int start = i;
+        char *out = tx_batch.coal + (size_t)tx_batch.count * options.mtu;
+        size_t used = 0;
+        uint8_t flags = 0;
+        for (; i < count && p->win[(seq + i) % WINDOW_MAX].req; i++) {
+            inflight *f = &p->win[(seq + i) % WINDOW_MAX];
+            uint16_t len = htons((uint16_t)f->len);
+            memcpy(out + used, &len, sizeof(len));
+            memcpy(out + used + sizeof(len), f->data, f->len);
+            used += sizeof(len) + f->len;
+            flags |= f->flags;
+            f->last_sent_us = now;      // o RTT conta a partir da saída, não da entrada no grupo
+        }
+        if (i - start == 1) {
+            inflight *f = &p->win[(seq + start) % WINDOW_MAX];
+            send_packet(&p->addr, seq + start, 0, f->flags, f->data, f->len);
+        } else {
+            metric_add(M_COALESCED, i - start);
+            send_packet(&p->addr, seq + start, 0, flags | POWERUDP_FLAG_MULTI, out, (int)used);
+        }
+    }
+}
+
+static void coal_fire(timer_node *t) {
+    coal_flush(container_of(t, peer, coal_timer));
+}
+
+static int coal_eligible(const inflight *f) {
+    return options.coalesce_us > 0 && f->tries == 0 && !(f->flags & (POWERUDP_FLAG_FRAG | POWERUDP_FLAG_LZ))
+        && f->len <= COALESCE_RECORD_MAX;
+}
+
+// Junta seq ao grupo do peer (o grupo anterior sai se não for contíguo ou não couber)
+static void coal_add(peer *p, uint32_t seq, const inflight *f, uint64_t now) {
+    int bytes = (int)sizeof(uint16_t) + f->len;
+    if (p->coal_count && (seq != p->coal_seq + p->coal_count || p->coal_count == COALESCE_MAX
+                          || p->coal_bytes + bytes > frag_payload()))
+        coal_flush(p);
+    if (!p->coal_count) {
+        p->coal_seq = seq;
+        timer_arm(&p->coal_timer, us_to_tick(now + options.coalesce_us));
+    }
+    p->coal_count++;
+    p->coal_bytes += bytes;
+}
+
+/*
+ * Grupo FEC do peer: série de seq seguidos na primeira transmissão, cada um somado
+ * às fec_m linhas de paridade logo que sai (os dados do pedido podem ser libertados
+ * antes de o grupo fechar). O grupo fecha com fec_k pacotes, no fim da volta se o
+ * peer não tiver mais nada à espera (a cauda de uma rajada é o que mais depende do
+ * RTO) ou, com a janela cheia, um quarto de RTT depois do primeiro pacote.
+ */
+static void fec_flush(peer *p) {
+    if (!p->fec_count) return;
+    timer_cancel(&p->fec_timer);
+    size_t sym = FEC_PREFIX + p->fec_len;
+    if (!tx_batch.coal) tx_batch.coal = malloc((size_t)options.batch_size * options.mtu);
+    for (int j = 0; j < p->fec_m && tx_batch.coal; j++) {
+        uint8_t *row = p->fec_rows + (size_t)j * options.mtu;
+        char *out = tx_batch.coal + (size_t)tx_batch.count * options.mtu;
+        PowerUDPFecHeader h = { (uint8_t)p->fec_count, (uint8_t)j, (uint8_t)p->fec_m, 0 };
+        memcpy(out, &h, sizeof(h));
+        memcpy(out + sizeof(h), row, sym);
+        send_packet(&p->addr, p->fec_seq, 4, 0, out, (int)(sizeof(h) + sym));
+        metric_add(M_FEC_PARITY, 1);
+    }
+    for (int j = 0; j < p->fec_m; j++) memset(p->fec_rows + (size_t)j * options.mtu, 0, sym);
+    p->fec_count = 0;
+    p->fec_len = 0;
+}
+
+static void fec_fire(timer_node *t) {
+    fec_flush(container_of(t, peer, fec_timer));
+}
+
+static void fec_add(peer *p, uint32_t seq, const inflight *f, uint64_t now) {
+    int k = config.fec_k < POWERUDP_FEC_K_MAX ? config.fec_k : POWERUDP_FEC_K_MAX;
+    int m = config.fec_parity < 1 ? 1 : config.fec_parity < POWERUDP_FEC_PARITY_MAX ? config.fec_parity : POWERUDP_FEC_PARITY_MAX;
+    // Fragmentos feitos antes de o FEC ser ligado não deixam espaço para a paridade: ficam de fora
+    if (!k || f->len > frag_payload()) {
+        fec_flush(p);
+        return;
+    }
+    if (p->fec_count && seq != p->fec_seq + p->fec_count) fec_flush(p);
+    if (!p->fec_rows && !(p->fec_rows = calloc(POWERUDP_FEC_PARITY_MAX, options.mtu))) return;
+    if (!p->fec_count) {
+        p->fec_seq = seq;
+        p->fec_k = k;
+        p->fec_m = m;
+        uint64_t wait = p->srtt_us / 4 > (uint64_t)options.io_tick_us ? p->srtt_us / 4 : (uint64_t)options.io_tick_us;
+        timer_arm(&p->fec_timer, us_to_tick(now + wait));
+        if (!p->fec_queued) {
+            p->fec_queued = 1;
+            p->fec_next = fec_list;
+            fec_list = p;
+        }
+    }
+
+    uint64_t t0 = now_ns();
+    for (int j = 0; j < p->fec_m; j++)
+        fec_symbol_madd(p->fec_rows + (size_t)j * options.mtu, fec_coef[j][p->fec_count], f->len, f->flags, f->data);
+    metric_add(M_FEC_NS, now_ns() - t0);
+    if (f->len > p->fec_len) p->fec_len = f->len;
+    if (++p->fec_count == p->fec_k) fec_flush(p);
+}
+
+// Fim da volta: fecha os grupos dos peers que ficaram sem mais nada para enviar
+static void flush_fec() {
+    peer *keep = NULL;
+    while (fec_list) {
+        peer *p = fec_list;
+        fec_list = p->fec_next;
+        if (p->fec_count && p->pend_head) {
+            // Ainda há pedidos à espera de janela: o grupo espera por eles (ou pelo fec_timer)
+            p->fec_next = keep;
+            keep = p;
+            continue;
+        }
+        p->fec_queued = 0;
+        fec_flush(p);
+    }
+    fec_list = keep;
+}
+
+static void transmit(peer *p, uint32_t seq) {
+    inflight *f = &p->win[seq % WINDOW_MAX];
+    uint64_t now = now_us();
+    if (f->tries == 0) f->first_sent_us = now;
+    else metric_add(M_RETRANSMISSIONS, 1);
+    if (!f->req->first_sent_us) f->req->first_sent_us = now;
+    f->req->tx_write = tx_writes;
+    if (coal_eligible(f)) {
+        coal_add(p, seq, f, now);
+    } else {
+        // O grupo pendente sai primeiro, para os seq chegarem pela ordem
+        coal_flush(p);
+        // Uma retransmissão é recuperação de perdas: o recetor não deve atrasar o ACK
+        send_packet(&p->addr, seq, 0, f->flags | (f->tries ? POWERUDP_FLAG_ACK_NOW : 0), f->data, f->len);
+        if (f->tries == 0 && config.fec_k) fec_add(p, seq, f, now);
+    }
+    f->last_sent_us = now;
+    p->last_tx_us = now;
+    timer_arm(&f->timer, us_to_tick(now + retransmit_timeout_us(p, f->tries)));
+    f->tries++;
+}
+
+/*
+ * Pedidos assíncronos: reciclados numa lista livre global, para não haver malloc
+ * por mensagem com milhares em voo.
+ */
+static send_req *req_free_list = NULL;
+static pthread_mutex_t req_free_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static send_req *req_alloc() {
+    pthread_mutex_lock(&req_free_lock);
+    send_req *req = req_free_list;
+    if (req) req_free_list = req->next_pending;
+    pthread_mutex_unlock(&req_free_lock);
+    if (!req && !(req = malloc(sizeof(*req)))) return NULL;
+    memset(req, 0, sizeof(*req));
+    return req;
+}
+
+static void req_release(send_req *req) {
+    pthread_mutex_lock(&req_free_lock);
+    req->next_pending = req_free_list;
+    req_free_list = req;
+    pthread_mutex_unlock(&req_free_lock);
+}
+
+static void req_stats(const send_req *req, PowerUDPMessageStats *stats) {
+    stats->retransmissions = req->retransmissions;
+    stats->delivery_time = req->delivery_time;
+    stats->rtt_us = req->rtt_us;
+    stats->rto_us = req->rto_us;
+    stats->spurious_retransmissions = req->spurious;
+    stats->cwnd = req->cwnd;
+}
+
+// Acorda quem espera no eventfd da fila de conclusões (uma vez por volta)
+static void completion_notify() {
+    if (!completion_signal || completion_fd < 0) return;
+    uint64_t one = 1;
+    completion_signal = 0;
+    if (write(completion_fd, &one, sizeof(one)) < 0) perror("eventfd write");
+}
+
+static void complete_async(send_req *req) {
+    if (!req->callback) {
+        mpsc_push(&completion_q, req);
+        completion_signal = 1;
+        return;
+    }
+    PowerUDPCompletion c = { req->handle, req->user_data, req->status, { 0 } };
+    req_stats(req, &c.stats);
+    req->callback(&c);
+    req_release(req);
+}
+
+/*
+ * Pedidos concluídos com fragmentos no lote de envio por escrever (uma retransmissão
+ * ou o fragmento de um irmão postos no lote antes do ACK ou da desistência): o iovec
+ * ainda aponta para o buffer deles, por isso só são devolvidos ao chamador em
+ * complete_flush, depois de o lote da volta ter sido escrito. Os assíncronos passam
+ * sempre por aqui: o callback e quem lê a fila de conclusões podem libertar message.
+ */
+static send_req *done_head = NULL, *done_tail = NULL;
+
+// O lote já não aponta para o pedido: liberta a versão comprimida e devolve-o
+static void complete_finish(send_req *req) {
+    if (req->lz) {
+        pkt_put(req->lz);
+        req->lz = NULL;
+    }
+    if (req->async) complete_async(req);
+    else sem_post(&req->done);
+}
+
+static void complete_flush() {
+    while (done_head) {
+        send_req *req = done_head;
+        done_head = req->next_pending;
+        complete_finish(req);
+    }
+    done_tail = NULL;
+    completion_notify();
+}
+
+static void complete_req(send_req *req, int status) {
+    req->status = status;
+    if (status == 0) {
+        uint64_t delivery_us = now_us() - req->first_sent_us;
+        req->delivery_time = (int)(delivery_us / 1000);
+        metric_add(M_MESSAGES_SENT, 1);
+        metric_record(H_DELIVERY, delivery_us);
+        metric_record(H_RETRIES, req->retransmissions);
+    } else {
+        metric_add(M_MESSAGES_FAILED, 1);
+    }
+    if (!req->async && req->tx_write != tx_writes) {
+        complete_finish(req);
+        return;
+    }
+    req->next_pending = NULL;
+    if (done_tail) done_tail->next_pending = req;
+    else done_head = req;
+    done_tail = req;
+}
+
+static void unlink_pending(peer *p, send_req *req) {
+    send_req **pp = &p->pend_head, *prev = NULL;
+    while (*pp && *pp != req) {
+        prev = *pp;
+        pp = &(*pp)->next_pending;
+    }
+    if (!*pp) return;
+    *pp = req->next_pending;
+    if (p->pend_tail == req) p->pend_tail = prev;
+}
+
+// Envia o salto da mensagem abandonada g (ver PowerUDPSkip)
+static void send_skip(peer *p, const seq_range *g) {
+    PowerUDPSkip *skip = &tx_batch.ctl[tx_batch.count].skip;
+    skip->end = htonl(g->end);
+    send_packet(&p->addr, g->start, 5, 0, (const char *)skip, sizeof(*skip));
+}
+
+/*
+ * O recetor confirma até cum: esquece as mensagens abandonadas que ele já passou e
+ * devolve aquela em que está parado (ou NULL), para lhe reenviar o salto.
+ */
+static const seq_range *gap_at(peer *p, uint32_t cum) {
+    const seq_range *hit = NULL;
+    int n = 0;
+    for (int i = 0; i < p->gap_count; i++) {
+        seq_range *g = &p->gaps[i];
+        if ((int32_t)(cum - g->end) >= 0) continue;
+        p->gaps[n] = *g;
+        if (cum - g->start < g->end - g->start) hit = &p->gaps[n];
+        n++;
+    }
+    p->gap_count = n;
+    return hit;
+}
+
+// Um fragmento esgotou as tentativas: a mensagem inteira falha
+static void fail_req(peer *p, send_req *req) {
+    for (uint32_t seq = p->base; seq != p->next_seq; seq++) {
+        inflight *f = &p->win[seq % WINDOW_MAX];
+        if (f->req != req) continue;
+        f->req = NULL;
+        timer_cancel(&f->timer);
+    }
+    if (!req->fully_queued) unlink_pending(p, req);
+    // Os seq dela nunca vão ser todos entregues: o recetor tem de os poder saltar
+    if (req->offset && config.enable_sequence) {
+        if (p->gap_count == p->gap_cap) {
+            int cap = p->gap_cap ? p->gap_cap * 2 : 8;
+            seq_range *g = realloc(p->gaps, cap * sizeof(*g));
+            if (g) {
+                p->gaps = g;
+                p->gap_cap = cap;
+            }
+        }
+        if (p->gap_count < p->gap_cap) p->gaps[p->gap_count++] = (seq_range){ req->first_seq, req->end_seq };
+    }
+    complete_req(req, -1);
+}
+
+// Passa fragmentos dos pedidos em espera para a janela enquanto houver espaço
+static void fill_window(peer *p) {
+    size_t max_frag = frag_payload();
+    uint64_t now = now_us();
+
+    while (p->pend_head && p->next_seq - p->base < send_window(p)) {
+        if (!pace_ready(p, now)) {
+            if (!timer_armed(&p->pace_timer)) timer_arm(&p->pace_timer, us_to_tick(p->pace_next_us));
+            break;
+        }
+        send_req *req = p->pend_head;
+        size_t frag_len = req->len - req->offset < max_frag ? req->len - req->offset : max_frag;
+        int last = req->offset + frag_len >= req->len;
+
+        uint32_t seq = p->next_seq++;
+        inflight *f = &p->win[seq % WINDOW_MAX];
+        memset(f, 0, sizeof(*f));
+        f->timer.fire = retx_fire;
+        f->peer = p;
+        f->seq = seq;
+        f->req = req;
+        f->data = req->data + req->offset;
+        f->len = (int)frag_len;
+        if (req->offset == 0) req->first_seq = seq;
+        req->end_seq = seq + 1;
+        if (req->len > max_frag)
+            f->flags = POWERUDP_FLAG_FRAG | (last ? POWERUDP_FLAG_LAST : 0) | (req->offset ? 0 : POWERUDP_FLAG_FIRST);
+        if (req->lz) f->flags |= POWERUDP_FLAG_LZ;
+
+        req->offset += frag_len;
+        req->frags_outstanding++;
+        if (last) {
+            req->fully_queued = 1;
+            p->pend_head = req->next_pending;
+            if (!p->pend_head) p->pend_tail = NULL;
+        }
+        // Sem mais nada para enviar até chegar um ACK: pede que não seja atrasado
+        if (!p->pend_head || p->next_seq - p->base >= send_window(p))
+            f->flags |= POWERUDP_FLAG_ACK_NOW;
+        transmit(p, seq);
+        pace_sent(p, now);
+    }
+    // Janela cheia: não chega mais nada para o grupo antes de um ACK
+    if (p->next_seq - p->base >= send_window(p)) coal_flush(p);
+}
+
+static void pace_fire(timer_node *t) {
+    fill_window(container_of(t, peer, pace_timer));
+}
+
+static void advance_base(peer *p) {
+    while (p->base != p->next_seq && p->win[p->base % WINDOW_MAX].req == NULL)
+        p->base++;
+    fill_window(p);
+}
+
+/* ------------------------------- Receção no fio ----------------------------- */
+
+static void ack_one(peer *p, uint32_t seq) {
+    if (seq - p->base >= p->next_seq - p->base) return;    // fora da janela
+    inflight *f = &p->win[seq % WINDOW_MAX];
+    if (!f->req) return;                                    // ACK duplicado
+
+    uint64_t now = now_us();
+    if (f->tries == 1) {
+        rtt_sample(p, now - f->last_sent_us);
+        metric_record(H_RTT, now - f->last_sent_us);
+        f->req->rtt_us = (int)(now - f->last_sent_us);
+    } else if (now - f->last_sent_us < p->min_rtt_us / 2) {
+        // ACK chegou cedo demais para ser da retransmissão: confirmava o original
+        p->spurious_retx++;
+        f->req->spurious++;
+    }
+
+    send_req *req = f->req;
+    f->req = NULL;
+    timer_cancel(&f->timer);
+    peer_cc(p)->on_ack(p, seq);
+    req->retransmissions += f->tries - 1;
+    req->rto_us = (int)peer_rto_us(p);
+    req->cwnd = (int)p->cwnd;
+    if (--req->frags_outstanding == 0 && req->fully_queued) complete_req(req, 0);
+}
+
+static void handle_ack(peer *p, uint32_t seq) {
+    ack_one(p, seq);
+    advance_base(p);
+}
+
+/*
+ * SACK: confirma tudo antes de cum e os seq marcados no mapa. Os buracos (cum e os
+ * seq sem bit) só são reenviados já se houver DUP_THRESH pacotes posteriores
+ * confirmados, uma vez por pacote; os restantes ficam para o temporizador.
+ */
+static void handle_sack(peer *p, uint32_t cum, const PowerUDPSack *sack) {
+    // Parado numa mensagem de que desistimos: o salto perdeu-se ou ainda não chegou
+    const seq_range *g = p->gap_count ? gap_at(p, cum) : NULL;
+    if (g) send_skip(p, g);
+    if (cum - p->base > p->next_seq - p->base) return;     // ACK antigo ou inválido
+    for (uint32_t seq = p->base; seq != cum; seq++) ack_one(p, seq);
+
+    uint64_t mask = 0;
+    for (int i = 0; i < POWERUDP_SACK_BITS; i++)
+        if (sack->bitmap[i / 8] & (1u << (i % 8))) mask |= 1ULL << i;
+    for (int i = 0; i < POWERUDP_SACK_BITS; i++)
+        if (mask >> i & 1) ack_one(p, cum + 1 + i);
+
+    // Buraco h (seq cum + h): os bits i >= h são pacotes posteriores a ele
+    for (int h = 0; h < POWERUDP_SACK_BITS && (mask >> h); h++) {
+        if (h > 0 && (mask >> (h - 1) & 1)) continue;
+        if (__builtin_popcountll(mask >> h) < DUP_THRESH) break;
+        uint32_t seq = cum + h;
+        if (seq - p->base >= p->next_seq - p->base) break;
+        inflight *f = &p->win[seq % WINDOW_MAX];
+        if (f->req && !f->fast_retx && config.enable_retransmission) {
+            f->fast_retx = 1;
+            peer_cc(p)->on_loss(p, seq, 0);
+            transmit(p, seq);
+        }
+    }
+    advance_base(p);
+}
+
+static void handle_nak(peer *p, uint32_t seq) {
+    if (seq - p->base >= p->next_seq - p->base) return;
+    // O recetor descartou seq por estar à espera de um anterior: reenvia o mais antigo
+    inflight *f = &p->win[p->base % WINDOW_MAX];
+    if (f->req && !f->fast_retx) {
+        f->fast_retx = 1;
+        peer_cc(p)->on_loss(p, p->base, 0);
+        transmit(p, p->base);
+    }
+}
+
+static int rx_ring_full() {
+    size_t head = atomic_load_explicit(&rx_ring.head, memory_order_relaxed);
+    return head - atomic_load_explicit(&rx_ring.tail, memory_order_acquire) > rx_ring.mask;
+}
+
+// Passa o datagrama à aplicação tal como foi recebido (mais uma referência, sem cópia)
+static void deliver(peer *p, uint8_t flags, pkt_buf *b) {
+    if (flags & POWERUDP_FLAG_LZ) {
+        if (!(b = lz_unpack(b))) return;
+    } else {
+        pkt_ref(b);
+    }
+    b->src = p->addr;
+    if (spsc_push(&rx_ring, b) < 0) pkt_put(b);
+    else metric_add(M_MESSAGES_RECEIVED, 1);
+}
+
+// Descarta a mensagem em reconstrução: o emissor desistiu dela ou começou outra
+static void reasm_drop(peer *p) {
+    p->reasm_discard = 0;
+    if (!p->reasm) return;
+    pkt_put(p->reasm);
+    p->reasm = NULL;
+    p->reasm_cap = 0;
+}
+
+/*
+ * Junta um fragmento à mensagem em reconstrução; entrega-a no último fragmento.
+ * Uma mensagem que passe de MESSAGE_MAX, ou para a qual falte memória, é
+ * descartada inteira: os fragmentos seguintes dela são ignorados até ao LAST ou
+ * ao FIRST da próxima, para nunca se entregar uma mensagem truncada.
+ */
+static void reassemble(peer *p, uint8_t flags, const char *data, int len) {
+    if (flags & POWERUDP_FLAG_FIRST) reasm_drop(p);
+    if (p->reasm_discard) {
+        if (flags & POWERUDP_FLAG_LAST) p->reasm_discard = 0;
+        return;
+    }
+    size_t have = p->reasm ? p->reasm->len : 0;
+    if (have + len > p->reasm_cap || !p->reasm) {
+        // Começa com o tamanho da mensagem anterior: mensagens iguais não crescem
+        size_t cap = p->reasm_cap ? p->reasm_cap : (size_t)frag_payload() * 4;
+        if (!p->reasm && p->reasm_hint > cap) cap = p->reasm_hint;
+        while (cap < have + len) cap *= 2;
+        if (cap > MESSAGE_MAX) cap = MESSAGE_MAX;
+        pkt_buf *m = have + len <= MESSAGE_MAX ? heap_buf(p->reasm, cap) : NULL;
+        if (!m) {
+            reasm_drop(p);
+            metric_add(M_REASM_DROPPED, 1);
+            p->reasm_discard = !(flags & POWERUDP_FLAG_LAST);
+            return;
+        }
+        p->reasm = m;
+        p->reasm_cap = cap;
+    }
+    memcpy(p->reasm->data + p->reasm->len, data, len);
+    p->reasm->len += len;
+
+    if (flags & POWERUDP_FLAG_LAST) {
+        pkt_buf *m = p->reasm;
+        p->reasm_hint = m->len;
+        p->reasm = NULL;
+        p->reasm_cap = 0;
+        if (flags & POWERUDP_FLAG_LZ) {
+            pkt_buf *full = lz_unpack(m);
+            pkt_put(m);
+            if (!(m = full)) return;
+        }
+        m->src = p->addr;
+        if (spsc_push(&rx_ring, m) < 0) pkt_put(m);
+        else metric_add(M_MESSAGES_RECEIVED, 1);
+    }
+}
+
+// Envia um SACK com o estado atual da receção do peer
+static void send_sack(peer *p) {
+    PowerUDPSack *sack = &tx_batch.ctl[tx_batch.count].sack;
+    memset(sack, 0, sizeof(*sack));
+    for (int i = 0; p->reorder && i < POWERUDP_SACK_BITS; i++) {
+        uint32_t seq = p->expected_seq + 1 + i;
+        rx_slot *slot = &p->reorder[seq & (options.reorder_depth - 1)];
+        if (slot->used && slot->seq == seq) sack->bitmap[i / 8] |= 1u << (i % 8);
+    }
+
+    p->acks_owed = 0;
+    p->last_tx_us = now_us();
+    timer_cancel(&p->ack_timer);
+    send_packet(&p->addr, p->expected_seq, 3, 0, (const char *)sack, sizeof(*sack));
+}
+
+// O ACK do peer não pode esperar: sai no fim da volta, juntando o resto do lote
+static void ack_enqueue(peer *p) {
+    if (p->ack_queued) return;
+    p->ack_queued = 1;
+    p->ack_next = ack_list;
+    ack_list = p;
+}
+
+static void flush_acks() {
+    while (ack_list) {
+        peer *p = ack_list;
+        ack_list = p->ack_next;
+        p->ack_queued = 0;
+        if (p->acks_owed) send_sack(p);
+    }
+}
+
+static void ack_fire(timer_node *t) {
+    peer *p = container_of(t, peer, ack_timer);
+    if (p->acks_owed) send_sack(p);
+}
+
+// Sem tráfego para o peer há keepalive_ms: reenvia o estado da receção
+static void keepalive_fire(timer_node *t) {
+    peer *p = container_of(t, peer, keepalive_timer);
+    uint64_t now = now_us(), period = (uint64_t)options.keepalive_ms * 1000;
+    if (now - p->last_tx_us >= period) {
+        send_sack(p);
+        timer_arm(t, us_to_tick(now + period));
+    } else {
+        timer_arm(t, us_to_tick(p->last_tx_us + period));
+    }
+}
+
+// Entrega o pacote seguinte da sequência; falha se o anel da aplicação estiver cheio
+static int accept_next(peer *p, uint8_t flags, pkt_buf *b) {
+    int completes = !(flags & POWERUDP_FLAG_FRAG) || (flags & POWERUDP_FLAG_LAST);
+    if (completes && rx_ring_full()) return -1;
+    if (flags & POWERUDP_FLAG_FRAG) {
+        reassemble(p, flags, b->data, (int)b->len);
+    } else {
+        reasm_drop(p);
+        deliver(p, flags, b);
+    }
+    p->expected_seq++;
     return 0;
 }
 
-void close_protocol() {
-    printf("[close_protocol] Fechando protocolo.\n");
+// Entrega a série contígua de pacotes guardados que começa em expected_seq
+static void release_run(peer *p) {
+    if (!p->reorder) return;
+    for (;;) {
+        size_t i = p->expected_seq & (options.reorder_depth - 1);
+        rx_slot *slot = &p->reorder[i];
+        if (!slot->used || slot->seq != p->expected_seq) return;
+        if (accept_next(p, slot->flags, slot->buf) < 0) {
+            if (!p->rx_blocked) rx_blocked_count++;
+            p->rx_blocked = 1;
+            return;
+        }
+        pkt_put(slot->buf);
+        slot->buf = NULL;
+        slot->used = 0;
+    }
 }
 
-int request_protocol_config(int enable_retransmission, int enable_backoff, int enable_sequence, uint16_t base_timeout, uint8_t max_retries) {
-    printf("[request_protocol_config] retrans=%d backoff=%d seq=%d timeout=%d retries=%d\n",
-           enable_retransmission, enable_backoff, enable_sequence, base_timeout, max_retries);
+// O anel da aplicação voltou a ter espaço: retoma as entregas paradas e confirma-as
+static void retry_blocked() {
+    for (size_t i = 0; i < peer_cap && rx_blocked_count && !rx_ring_full(); i++) {
+        peer *p = peers[i];
+        if (!p || !p->rx_blocked) continue;
+        p->rx_blocked = 0;
+        rx_blocked_count--;
+        release_run(p);
+        p->acks_owed++;
+        ack_enqueue(p);
+    }
+}
+
+// Guarda uma referência ao datagrama; o lote de receção passa a usar outro buffer
+static int reorder_store(peer *p, uint32_t seq, uint8_t flags, pkt_buf *b) {
+    if (!p->reorder && !(p->reorder = calloc(options.reorder_depth, sizeof(*p->reorder)))) return -1;
+    size_t i = seq & (options.reorder_depth - 1);
+    if (p->reorder[i].buf) pkt_put(p->reorder[i].buf);
+    pkt_ref(b);
+    p->reorder[i] = (rx_slot){ seq, flags, 1, b };
+    metric_add(M_REORDERED, 1);
     return 0;
 }
 
-int send_message(const char *destination, const char *message, int len) {
-    // Simulação de perda
-    int drop = rand() % 100;
-    if (drop < simulated_loss) {
-        printf("[send_message] Mensagem PERDIDA (simulação).\n");
-        last_retransmissions = 1;
-        last_delivery_time = 0;
+/*
+ * Receção FEC: a partir da primeira paridade de um peer guarda-se uma referência a
+ * cada pacote de dados novo dele em fec_rx (indexado por seq), libertada quando
+ * expected_seq passa K_MAX seq à frente: nenhum grupo por resolver começa antes
+ * disso. A paridade fica em fec_groups até o grupo estar completo, ser reconstruído
+ * ou já ter sido todo entregue.
+ */
+static void handle_data(peer *p, uint32_t seq, uint8_t flags, pkt_buf *b);
+
+static rx_slot *fec_slot(peer *p, uint32_t seq) {
+    rx_slot *s = &p->fec_rx[seq & (FEC_RX_RING - 1)];
+    return s->used && s->seq == seq ? s : NULL;
+}
+
+static void fec_group_free(fec_group *g) {
+    for (int r = 0; r < g->rows; r++) pkt_put(g->parity[r]);
+    memset(g, 0, sizeof(*g));
+}
+
+static void fec_trim(peer *p) {
+    uint32_t limit = p->expected_seq - POWERUDP_FEC_K_MAX;
+    for (int n = 0; (int32_t)(limit - p->fec_floor) > 0; n++, p->fec_floor++) {
+        if (n == FEC_RX_RING) {
+            p->fec_floor = limit;
+            break;
+        }
+        rx_slot *s = &p->fec_rx[p->fec_floor & (FEC_RX_RING - 1)];
+        if (s->used && s->seq == p->fec_floor) {
+            pkt_put(s->buf);
+            memset(s, 0, sizeof(*s));
+        }
+    }
+    for (int i = 0; i < FEC_GROUPS; i++) {
+        fec_group *g = &p->fec_groups[i];
+        if (g->used && (int32_t)(p->expected_seq - (g->seq + g->count)) >= 0) fec_group_free(g);
+    }
+}
+
+/*
+ * Com e pacotes em falta e pelo menos e linhas de paridade: tira às linhas a parte
+ * dos pacotes recebidos (ficam só as perdas, multiplicadas pela submatriz dos seus
+ * coeficientes), inverte essa submatriz e reconstrói cada perda como um pacote de
+ * dados acabado de chegar, com POWERUDP_FLAG_ACK_NOW para o emissor parar já.
+ */
+static void fec_try(peer *p, fec_group *g) {
+    uint8_t lost[POWERUDP_FEC_K_MAX];
+    int e = 0, needed = 0;
+    for (int i = 0; i < g->count; i++) {
+        if (fec_slot(p, g->seq + i)) continue;
+        lost[e++] = (uint8_t)i;
+        if ((int32_t)(g->seq + i - p->expected_seq) >= 0) needed = 1;
+    }
+    // Nada em falta, ou só pacotes já entregues antes de fec_rx existir
+    if (!needed) {
+        fec_group_free(g);
+        return;
+    }
+    if (e > g->rows) return;
+
+    uint64_t t0 = now_ns();
+    size_t sym = g->parity[0]->len - sizeof(PowerUDPFecHeader);
+    if (!fec_scratch && !(fec_scratch = malloc((size_t)POWERUDP_FEC_PARITY_MAX * options.mtu))) return;
+    uint8_t a[POWERUDP_FEC_PARITY_MAX][POWERUDP_FEC_PARITY_MAX], inv[POWERUDP_FEC_PARITY_MAX][POWERUDP_FEC_PARITY_MAX];
+    for (int r = 0; r < e; r++) {
+        uint8_t *syn = fec_scratch + (size_t)r * options.mtu;
+        memcpy(syn, g->parity[r]->data + sizeof(PowerUDPFecHeader), sym);
+        for (int c = 0; c < e; c++) a[r][c] = fec_coef[g->index[r]][lost[c]];
+    }
+    for (int i = 0; i < g->count; i++) {
+        rx_slot *s = fec_slot(p, g->seq + i);
+        if (!s) continue;
+        if (FEC_PREFIX + s->buf->len > sym) goto invalid;
+        for (int r = 0; r < e; r++)
+            fec_symbol_madd(fec_scratch + (size_t)r * options.mtu, fec_coef[g->index[r]][i], (int)s->buf->len, s->flags, s->buf->data);
+    }
+    if (gf_invert(a, inv, e) < 0) goto invalid;
+
+    pkt_buf *out[POWERUDP_FEC_PARITY_MAX];
+    int made = 0;
+    for (; made < e; made++) {
+        pkt_buf *b = out[made] = pool_get();
+        if (!b) break;
+        uint8_t *d = (uint8_t *)b->raw;
+        memset(d, 0, sym);
+        for (int r = 0; r < e; r++) fec_madd(d, fec_scratch + (size_t)r * options.mtu, sym, inv[made][r]);
+        size_t len = (size_t)d[0] << 8 | d[1];
+        if (FEC_PREFIX + len > sym || d[3] || (d[2] & (POWERUDP_FLAG_MULTI | POWERUDP_FLAG_VERSION))) {
+            pkt_put(b);
+            break;
+        }
+        b->data = b->raw + FEC_PREFIX;
+        b->len = len;
+    }
+    metric_add(M_FEC_NS, now_ns() - t0);
+    if (made < e) {
+        while (made--) pkt_put(out[made]);
+        goto invalid;
+    }
+
+    uint32_t seq = g->seq;
+    fec_group_free(g);
+    for (int c = 0; c < e; c++) {
+        uint8_t flags = ((uint8_t *)out[c]->raw)[2] | POWERUDP_FLAG_ACK_NOW;
+        if ((int32_t)(seq + lost[c] - p->expected_seq) >= 0) {
+            metric_add(M_FEC_RECOVERED, 1);
+            handle_data(p, seq + lost[c], flags, out[c]);
+        }
+        pkt_put(out[c]);
+    }
+    return;
+
+invalid:
+    metric_add(M_MALFORMED, 1);
+    fec_group_free(g);
+}
+
+// Pacote de dados novo: guarda-o e tenta os grupos com paridade a que pertence
+static void fec_data(peer *p, uint32_t seq, uint8_t flags, pkt_buf *b) {
+    rx_slot *s = &p->fec_rx[seq & (FEC_RX_RING - 1)];
+    if (s->buf) pkt_put(s->buf);
+    pkt_ref(b);
+    *s = (rx_slot){ seq, flags & ~POWERUDP_FLAG_ACK_NOW, 1, b };
+    for (int i = 0; i < FEC_GROUPS; i++) {
+        fec_group *g = &p->fec_groups[i];
+        if (g->used && seq - g->seq < g->count) fec_try(p, g);
+    }
+}
+
+static void handle_parity(peer *p, uint32_t seq, pkt_buf *b) {
+    PowerUDPFecHeader h;
+    if (!config.enable_sequence) return;
+    if (b->len < sizeof(h) + FEC_PREFIX) {
+        metric_add(M_MALFORMED, 1);
+        return;
+    }
+    memcpy(&h, b->data, sizeof(h));
+    if (!h.count || h.count > POWERUDP_FEC_K_MAX || !h.parity || h.parity > POWERUDP_FEC_PARITY_MAX || h.index >= h.parity) {
+        metric_add(M_MALFORMED, 1);
+        return;
+    }
+    if (!p->fec_rx) {
+        if (!(p->fec_rx = calloc(FEC_RX_RING, sizeof(*p->fec_rx)))) return;
+        p->fec_floor = p->expected_seq - POWERUDP_FEC_K_MAX;
+    }
+    if ((int32_t)(p->expected_seq - (seq + h.count)) >= 0) return;     // grupo já todo entregue
+
+    // O grupo deste seq, ou um livre, ou o mais antigo (esse fica para a retransmissão)
+    fec_group *g = NULL, *victim = NULL;
+    for (int i = 0; i < FEC_GROUPS && !g; i++) {
+        fec_group *c = &p->fec_groups[i];
+        if (c->used && c->seq == seq) g = c;
+        else if (!victim || (victim->used && (!c->used || (int32_t)(c->seq - victim->seq) < 0))) victim = c;
+    }
+    if (!g) {
+        g = victim;
+        if (g->used) fec_group_free(g);
+        g->seq = seq;
+        g->count = h.count;
+        g->used = 1;
+    }
+    if (g->count != h.count || (g->rows && g->parity[0]->len != b->len)) return;
+    for (int r = 0; r < g->rows; r++)
+        if (g->index[r] == h.index) return;                                // paridade duplicada
+    pkt_ref(b);
+    g->index[g->rows] = h.index;
+    g->parity[g->rows++] = b;
+    fec_try(p, g);
+}
+
+static void handle_data(peer *p, uint32_t seq, uint8_t flags, pkt_buf *b) {
+    if (!config.enable_sequence) {
+        // Sem sequência não há ordem para reconstruir fragmentos
+        if (flags & POWERUDP_FLAG_FRAG) return;
+        send_packet(&p->addr, seq, 1, 0, NULL, 0);
+        deliver(p, flags, b);
+        return;
+    }
+
+    int32_t diff = (int32_t)(seq - p->expected_seq);
+    rx_slot *slot = p->reorder ? &p->reorder[seq & (options.reorder_depth - 1)] : NULL;
+    int ack_now = 1;
+    int fresh = !(diff < 0 || (slot && slot->used && slot->seq == seq));
+    if (!fresh) {
+        // Duplicado (já entregue ou já guardado): descarta e volta a confirmar
+        metric_add(M_DUPLICATES, 1);
+    } else if (diff > 0) {
+        // Adiantado: guarda-o se couber no anel e avisa já o emissor do buraco.
+        // Fora do anel é descartado; o SACK mostra ao emissor onde estamos.
+        if (diff < options.reorder_depth) reorder_store(p, seq, flags, b);
+    } else {
+        // Anel cheio: não confirma, o emissor volta a tentar mais tarde
+        if (accept_next(p, flags, b) < 0) return;
+        release_run(p);
+        ack_now = (flags & POWERUDP_FLAG_ACK_NOW) || p->acks_owed + 1 >= options.ack_every || options.ack_delay_us == 0;
+    }
+
+    p->acks_owed++;
+    if (ack_now) ack_enqueue(p);
+    else if (!timer_armed(&p->ack_timer)) timer_arm(&p->ack_timer, us_to_tick(now_us() + options.ack_delay_us));
+    if (fresh && p->fec_rx) {
+        fec_data(p, seq, flags, b);
+        fec_trim(p);
+    }
+}
+
+/*
+ * Salto: o emissor desistiu da mensagem em [start, end). Se estamos parados nela,
+ * deita fora a parte reconstruída e os fragmentos guardados e continua em end;
+ * o que já estava guardado a seguir segue pelo caminho normal.
+ */
+static void handle_skip(peer *p, uint32_t start, uint32_t end) {
+    if (!config.enable_sequence) return;
+    uint32_t at = p->expected_seq;
+    if (at - start < end - start) {
+        reasm_drop(p);
+        for (uint32_t seq = at; p->reorder && seq != end && seq - at < (uint32_t)options.reorder_depth; seq++) {
+            rx_slot *slot = &p->reorder[seq & (options.reorder_depth - 1)];
+            if (!slot->used || slot->seq != seq) continue;
+            pkt_put(slot->buf);
+            slot->buf = NULL;
+            slot->used = 0;
+        }
+        metric_add(M_SKIPPED, end - at);
+        p->expected_seq = end;
+        release_run(p);
+        if (p->fec_rx) fec_trim(p);
+    }
+    // Confirma sempre: o SACK mostra ao emissor se ainda estamos parados
+    p->acks_owed++;
+    ack_enqueue(p);
+}
+
+/*
+ * Repõe os buffers do lote de receção que ficaram com outra referência (entregues
+ * ou guardados no anel de reordenação); os restantes são reutilizados tal como estão.
+ */
+static int rx_batch_refill() {
+    int n;
+    for (n = 0; n < options.batch_size; n++) {
+        pkt_buf *b = rx_batch.pkts[n];
+        if (b && atomic_load_explicit(&b->refs, memory_order_acquire) > 1) {
+            pkt_put(b);
+            b = NULL;
+        }
+        if (!b && !(b = pool_get())) break;
+        rx_batch.pkts[n] = b;
+        rx_batch.iov[n].iov_base = b->raw;
+        rx_batch.iov[n].iov_len = options.mtu;
+        rx_batch.msgs[n].msg_hdr.msg_name = &rx_batch.addr[n];
+        rx_batch.msgs[n].msg_hdr.msg_namelen = sizeof(rx_batch.addr[n]);
+        rx_batch.msgs[n].msg_hdr.msg_iov = &rx_batch.iov[n];
+        rx_batch.msgs[n].msg_hdr.msg_iovlen = 1;
+    }
+    return n;
+}
+
+/*
+ * Datagrama com vários registos: cada um passa para um buffer do pool próprio e
+ * segue como um pacote de dados isolado com seq + i, para ser entregue e confirmado
+ * individualmente. Só o último registo herda POWERUDP_FLAG_ACK_NOW.
+ */
+static void handle_records(peer *p, uint32_t seq, uint8_t flags, const char *data, size_t len) {
+    size_t off = 0;
+    while (off + sizeof(uint16_t) <= len) {
+        uint16_t rlen;
+        memcpy(&rlen, data + off, sizeof(rlen));
+        rlen = ntohs(rlen);
+        off += sizeof(rlen);
+        if (rlen > len - off || rlen > (size_t)options.mtu) return;
+        pkt_buf *r = pool_get();
+        if (!r) return;
+        memcpy(r->raw, data + off, rlen);
+        r->len = rlen;
+        off += rlen;
+        handle_data(p, seq++, off + sizeof(uint16_t) > len ? flags & POWERUDP_FLAG_ACK_NOW : 0, r);
+        pkt_put(r);
+    }
+}
+
+// CRC32C de um datagrama v1 (len bytes, sem o MAC) confere com o do cabeçalho
+static int crc_valid(const char *buffer, unsigned int len) {
+    PowerUDPHeaderV1 h;
+    memcpy(&h, buffer, sizeof(h));
+    uint32_t expected = ntohl(h.crc32c);
+    h.crc32c = 0;
+    uint32_t crc = powerudp_crc32c(0, &h, sizeof(h));
+    return powerudp_crc32c(crc, buffer + sizeof(h), len - sizeof(h)) == expected;
+}
+
+// Trata um datagrama recebido em b (buffer aponta para o cabeçalho, dentro de b->raw)
+static void handle_datagram(pkt_buf *b, char *buffer, unsigned int len, const struct sockaddr_in *from) {
+    PowerUDPHeader header;
+    size_t hlen = sizeof(header);
+
+    metric_add(M_BYTES_RECEIVED, len);
+    if (len < sizeof(header)) {
+        metric_add(M_MALFORMED, 1);
+        return;
+    }
+
+    memcpy(&header, buffer, sizeof(header));
+    header.seq_num = ntohl(header.seq_num);
+    header.length = ntohs(header.length);
+    int version = header.flags & POWERUDP_FLAG_VERSION;
+    if (version == POWERUDP_HEADER_V1) hlen = sizeof(PowerUDPHeaderV1);
+    // length tem de bater certo com o que chegou: nem payload cortado nem lixo no fim
+    if ((version != 0 && version != POWERUDP_HEADER_V1) || len < hlen || header.length != len - hlen) {
+        metric_add(M_MALFORMED, 1);
+        return;
+    }
+    if (version == POWERUDP_HEADER_V1 && !crc_valid(buffer, len)) {
+        metric_add(M_CRC_FAILED, 1);
+        return;
+    }
+    header.flags &= ~POWERUDP_FLAG_VERSION;
+
+    peer *p = peer_get(from);
+    if (header.ack == 1) {
+        metric_add(M_ACKS_RECEIVED, 1);
+        handle_ack(p, header.seq_num);
+    } else if (header.ack == 3) {
+        if (header.length < sizeof(PowerUDPSack)) return;
+        metric_add(M_ACKS_RECEIVED, 1);
+        handle_sack(p, header.seq_num, (const PowerUDPSack *)(buffer + hlen));
+    } else if (header.ack == 2) {
+        metric_add(M_NAKS_RECEIVED, 1);
+        handle_nak(p, header.seq_num);
+    } else if (header.ack == 4) {
+        b->data = buffer + hlen;
+        b->len = header.length;
+        handle_parity(p, header.seq_num, b);
+    } else if (header.ack == 5) {
+        PowerUDPSkip skip;
+        if (header.length != sizeof(skip)) {
+            metric_add(M_MALFORMED, 1);
+            return;
+        }
+        memcpy(&skip, buffer + hlen, sizeof(skip));
+        handle_skip(p, header.seq_num, ntohl(skip.end));
+    } else if (header.flags & POWERUDP_FLAG_MULTI) {
+        handle_records(p, header.seq_num, header.flags, buffer + hlen, header.length);
+    }
+    else {
+        b->data = buffer + hlen;
+        b->len = header.length;
+        handle_data(p, header.seq_num, header.flags, b);
+    }
+}
+
+/*
+ * Verifica o lote recebido de uma vez: os datagramas autênticos ficam com msg_len
+ * sem o MAC e os restantes com msg_len = 0 (descartados por quem chama).
+ */
+static void rx_verify(int count) {
+    mac_input in[BATCH_MAX];
+    uint64_t tags[BATCH_MAX];
+    int idx[BATCH_MAX], n = 0;
+
+    for (int i = 0; i < count; i++) {
+        unsigned int len = rx_batch.msgs[i].msg_len;
+        if (len < sizeof(PowerUDPHeader) + POWERUDP_MAC_LEN) {
+            rx_batch.msgs[i].msg_len = 0;
+            metric_add(M_AUTH_FAILED, 1);
+            continue;
+        }
+        len -= POWERUDP_MAC_LEN;
+        in[n].head = (const uint8_t *)rx_batch.pkts[i]->raw;
+        in[n].head_len = sizeof(PowerUDPHeader);
+        in[n].body = in[n].head + sizeof(PowerUDPHeader);
+        in[n].body_len = len - sizeof(PowerUDPHeader);
+        idx[n++] = i;
+    }
+    if (n) mac_inputs(&mac_key, in, n, tags);
+    for (int j = 0; j < n; j++) {
+        struct mmsghdr *m = &rx_batch.msgs[idx[j]];
+        unsigned int len = m->msg_len - POWERUDP_MAC_LEN;
+        if (tags[j] == powerudp_le64((const uint8_t *)rx_batch.pkts[idx[j]]->raw + len)) {
+            m->msg_len = len;
+        } else {
+            m->msg_len = 0;
+            metric_add(M_AUTH_FAILED, 1);
+        }
+    }
+}
+
+static void drain_socket() {
+    for (;;) {
+        int n = rx_batch_refill();
+        if (n == 0) break;
+
+        int count = recvmmsg(udp_fd, rx_batch.msgs, n, MSG_DONTWAIT, NULL);
+        metric_add(M_RX_SYSCALLS, 1);
+        if (count <= 0) break;
+        metric_add(M_PACKETS_RECEIVED, count);
+        if (mac_on) rx_verify(count);
+
+        for (int i = 0; i < count; i++)
+            if (rx_batch.msgs[i].msg_len && !sim_receive(rx_batch.pkts[i], rx_batch.pkts[i]->raw, rx_batch.msgs[i].msg_len, &rx_batch.addr[i]))
+                handle_datagram(rx_batch.pkts[i], rx_batch.pkts[i]->raw, rx_batch.msgs[i].msg_len, &rx_batch.addr[i]);
+        if (count < n) break;
+    }
+}
+
+// O grupo também leva deltas do diretório de peers: só interessam os anúncios de configuração
+static void drain_multicast() {
+    ConfigAnnouncement anuncio;
+    char buf[sizeof(anuncio) + POWERUDP_MAC_LEN];
+    size_t expected = sizeof(anuncio) + (mac_mcast ? POWERUDP_MAC_LEN : 0);
+    ssize_t n;
+    while ((n = recv(mcast_fd, buf, sizeof(buf), MSG_DONTWAIT | MSG_TRUNC)) >= 0) {
+        if ((size_t)n != expected) continue;
+        if (mac_mcast && powerudp_mac_check(&mac_key, buf, n) < 0) {
+            metric_add(M_AUTH_FAILED, 1);
+            continue;
+        }
+        memcpy(&anuncio, buf, sizeof(anuncio));
+        uint32_t epoch = ntohl(anuncio.epoch);
+        if (have_epoch && (int32_t)(epoch - config_epoch) <= 0) {
+            metric_add(M_STALE_CONFIGS, 1);
+            continue;
+        }
+        have_epoch = 1;
+        config_epoch = epoch;
+        anuncio.config.base_timeout = ntohs(anuncio.config.base_timeout);
+        config = anuncio.config;
+    }
+}
+
+/* ------------------------------- Thread de I/O ------------------------------ */
+
+/*
+ * Parar o tick: sem temporizadores armados, sem entregas paradas, pacotes no
+ * simulador ou grupos FEC abertos, a thread de I/O espera só pelos sockets e por
+ * wake_fd. Marca-se em io_parked e depois revê a fila de envios e as alterações
+ * de configuração; os produtores publicam primeiro e só depois olham para
+ * io_parked (como o "waiting" do anel de receção), pelo que um dos dois vê o
+ * outro e nenhum pedido fica à espera de um tick que não vem.
+ */
+static int io_park() {
+    if (wheel_armed || rx_blocked_count || sim[POWERUDP_DIR_TX].count || sim[POWERUDP_DIR_RX].count || fec_list)
+        return 0;
+    atomic_store_explicit(&io_parked, 1, memory_order_seq_cst);
+    if (mpsc_empty(&submit_q) && !atomic_load(&config_dirty) && !atomic_load(&sim_dirty) && atomic_load(&running))
+        return 1;
+    atomic_store(&io_parked, 0);
+    return 0;
+}
+
+static void io_unpark() {
+    atomic_store(&io_parked, 0);
+    wheel_sync(now_us() / options.io_tick_us);
+}
+
+// Produtores, depois de publicarem: só custa uma syscall se a thread estiver parada
+static void io_wake() {
+    atomic_thread_fence(memory_order_seq_cst);
+    if (!atomic_load_explicit(&io_parked, memory_order_relaxed) || !atomic_exchange(&io_parked, 0)) return;
+    uint64_t one = 1;
+    if (write(wake_fd, &one, sizeof(one)) < 0) perror("eventfd write");
+}
+
+// Liga ou desliga o timerfd periódico do backend epoll
+static void io_tick(int on) {
+    if (on == tick_on) return;
+    uint64_t us = on ? (uint64_t)options.io_tick_us : 0;
+    struct itimerspec tick = {
+        { (time_t)(us / 1000000), (long)(us % 1000000) * 1000 },
+        { (time_t)(us / 1000000), (long)(us % 1000000) * 1000 },
+    };
+    if (timerfd_settime(timer_fd, 0, &tick, NULL) < 0) perror("timerfd_settime");
+    tick_on = on;
+}
+
+static void drain_submissions() {
+    send_req *req;
+    while ((req = mpsc_pop(&submit_q))) {
+        peer *p = peer_get(&req->dest);
+        lz_prepare(p, req);
+        if (req->lz) {
+            // Daqui em diante o pedido é a versão comprimida (libertada na conclusão)
+            req->data = req->lz->data;
+            req->len = req->lz->len;
+        }
+        if (!config.enable_sequence && req->len > (size_t)frag_payload()) {
+            complete_req(req, -1);      // fragmentos precisam de sequência no recetor
+            continue;
+        }
+        req->next_pending = NULL;
+        if (p->pend_tail) p->pend_tail->next_pending = req;
+        else p->pend_head = req;
+        p->pend_tail = req;
+        fill_window(p);
+    }
+}
+
+// Temporizador de retransmissão de um pacote em voo
+static void retx_fire(timer_node *t) {
+    inflight *f = (inflight *)t;
+    peer *p = f->peer;
+    if (!f->req) return;
+
+    metric_add(M_TIMEOUTS, 1);
+    if (!config.enable_retransmission || f->tries >= config.max_retries) {
+        fail_req(p, f->req);
+        if (p->gap_count) send_skip(p, &p->gaps[p->gap_count - 1]);
+    } else {
+        peer_cc(p)->on_loss(p, f->seq, 1);
+        transmit(p, f->seq);
+    }
+    advance_base(p);
+}
+
+static void apply_config() {
+    sim_apply_config();
+    if (!atomic_exchange(&config_dirty, 0)) return;
+    pthread_mutex_lock(&config_lock);
+    config = config_pending;
+    pthread_mutex_unlock(&config_lock);
+}
+
+// Fim de cada volta, comum aos dois backends (falta só escrever o lote de envio)
+static void io_round_end() {
+    sim_release();
+    if (rx_blocked_count) retry_blocked();
+    // Depois dos ACKs: apanha os envios de quem acabou de ser desbloqueado
+    drain_submissions();
+    flush_fec();
+    wheel_advance(now_us() / options.io_tick_us);
+    flush_acks();
+}
+
+#if HAVE_URING
+// Datagrama recebido pelo multishot: trata-o e devolve (ou substitui) o buffer do bid
+static void uring_recv(const struct io_uring_cqe *cqe) {
+    if (!(cqe->flags & IORING_CQE_F_MORE)) uring.rx_armed = 0;
+    if (cqe->res < 0) {
+        if (cqe->res != -ENOBUFS) fprintf(stderr, "io_uring recvmsg: %s\n", strerror(-cqe->res));
+        return;
+    }
+    if (!(cqe->flags & IORING_CQE_F_BUFFER)) return;
+
+    unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    pkt_buf *b = uring.bufs[bid];
+    struct io_uring_recvmsg_out *out = (struct io_uring_recvmsg_out *)b->raw;
+    metric_add(M_PACKETS_RECEIVED, 1);
+    if (out->namelen >= sizeof(struct sockaddr_in) && !(out->flags & MSG_TRUNC)) {
+        struct sockaddr_in from;
+        memcpy(&from, out + 1, sizeof(from));
+        char *datagram = (char *)(out + 1) + uring.rx_hdr.msg_namelen + uring.rx_hdr.msg_controllen;
+        int len = mac_on ? mac_verify_one(datagram, out->payloadlen) : (int)out->payloadlen;
+        if (len < 0) metric_add(M_AUTH_FAILED, 1);
+        else if (!sim_receive(b, datagram, len, &from)) handle_datagram(b, datagram, len, &from);
+    }
+
+    // Ficou guardado ou foi entregue: o kernel recebe outro buffer com este bid
+    if (atomic_load_explicit(&b->refs, memory_order_acquire) > 1) {
+        pkt_put(b);
+        uring.bufs[bid] = NULL;
+        if (!(b = pool_get())) return;
+    }
+    uring_provide(bid, b);
+}
+
+/*
+ * Volta do backend io_uring: um io_uring_enter submete os envios da volta anterior
+ * e espera por completions ou pelo próximo tick. Devolve -1 se o kernel recusar o
+ * recvmsg multishot antes do primeiro datagrama (o motor passa para o epoll).
+ */
+static int uring_loop() {
+    int received = 0;
+
+    while (atomic_load_explicit(&running, memory_order_acquire)) {
+        // Parada, espera sem timeout: acorda-a um CQE (datagrama, multicast ou wake_fd)
+        int parked = io_park();
+        uint64_t wait_us = options.io_tick_us - now_us() % options.io_tick_us;
+        struct __kernel_timespec ts = { (long long)(wait_us / 1000000), (long long)(wait_us % 1000000) * 1000 };
+        struct io_uring_getevents_arg arg = { 0, 0, 0, parked ? 0 : (uint64_t)(uintptr_t)&ts };
+        if (uring.to_submit) metric_add(M_TX_SYSCALLS, 1);
+        if (uring_enter(1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg)) < 0
+            && errno != ETIME && errno != EINTR && errno != EBUSY)
+            perror("io_uring_enter");
+        if (parked) io_unpark();
+
+        apply_config();
+
+        int mcast_readable = 0, wake_readable = 0, rx_cqes = 0;
+        unsigned head = *uring.cq_head;
+        unsigned tail = __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            const struct io_uring_cqe *cqe = &uring.cqes[head & *uring.cq_mask];
+            if (cqe->user_data == UD_RECV) {
+                if (cqe->res == -EINVAL && !received) return -1;
+                received |= cqe->res >= 0;
+                rx_cqes++;
+                uring_recv(cqe);
+            } else if (cqe->user_data == UD_SEND) {
+                uring.sends--;
+                if (cqe->res >= 0) {
+                    metric_add(M_PACKETS_SENT, 1);
+                    metric_add(M_BYTES_SENT, cqe->res);
+                }
+            } else if (cqe->user_data == UD_MCAST) {
+                mcast_readable = 1;
+                if (!(cqe->flags & IORING_CQE_F_MORE)) uring.mcast_armed = 0;
+            } else if (cqe->user_data == UD_WAKE) {
+                wake_readable = 1;
+                if (!(cqe->flags & IORING_CQE_F_MORE)) uring.wake_armed = 0;
+            }
+            // Liberta já a entrada: o tratamento pode submeter e gerar mais CQEs
+            __atomic_store_n(uring.cq_head, head + 1, __ATOMIC_RELEASE);
+        }
+
+        // Como o recvmmsg no epoll: conta a espera só se trouxe datagramas
+        if (rx_cqes) metric_add(M_RX_SYSCALLS, 1);
+        if (mcast_readable) drain_multicast();
+        if (wake_readable) {
+            uint64_t v;
+            if (read(wake_fd, &v, sizeof(v)) < 0 && errno != EAGAIN) perror("eventfd read");
+        }
+        if (!uring.rx_armed) uring_arm_recv();
+        if (mcast_fd >= 0 && !uring.mcast_armed) uring_arm_mcast();
+        if (!uring.wake_armed) uring_arm_wake();
+        io_round_end();
+
+        // Os envios seguem no io_uring_enter do início da próxima volta, a não ser que
+        // haja pedidos concluídos à espera de que o lote saia
+        uring_queue_tx();
+        if (done_head) {
+            uring_submit();
+            complete_flush();
+        }
+    }
+    return 0;
+}
+#else
+static int uring_loop() {
+    return -1;
+}
+#endif
+
+static void epoll_loop() {
+    struct epoll_event events[4];
+
+    while (atomic_load_explicit(&running, memory_order_acquire)) {
+        int parked = io_park();
+        io_tick(!parked);
+        int n = epoll_wait(epoll_fd, events, 4, -1);
+        if (parked) io_unpark();
+        int readable = 0, mcast_readable = 0;
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.fd == timer_fd || events[i].data.fd == wake_fd) {
+                uint64_t v;
+                if (read(events[i].data.fd, &v, sizeof(v)) < 0 && errno != EAGAIN) perror("timerfd/eventfd read");
+            } else if (events[i].data.fd == udp_fd) {
+                readable = 1;
+            } else {
+                mcast_readable = 1;
+            }
+        }
+
+        apply_config();
+        if (readable) drain_socket();
+        if (mcast_readable) drain_multicast();
+        io_round_end();
+        flush_tx();
+        complete_flush();
+    }
+}
+
+static void *io_loop(void *arg) {
+    (void)arg;
+    if (uring_active() && uring_loop() < 0) {
+        fprintf(stderr, "[PowerUDP] io_uring sem recvmsg multishot, a usar epoll\n");
+        uring_close();
+        options.io_backend = POWERUDP_IO_EPOLL;
+    }
+    epoll_loop();
+    return NULL;
+}
+
+/* ------------------------------- Inicialização ------------------------------ */
+
+static int handshake(const char *server_ip, int server_port, const char *psk) {
+    struct sockaddr_in addr;
+    char resposta[4] = {0};
+
+    if ((ctrl_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+        perror("socket TCP");
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(server_port);
+    addr.sin_addr.s_addr = inet_addr(server_ip);
+
+    if (connect(ctrl_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("connect TCP");
+        return -1;
+    }
+    if (write(ctrl_fd, psk, strlen(psk)) < 0 || read(ctrl_fd, resposta, 3) != 3 || strcmp(resposta, "ACK") != 0) {
+        fprintf(stderr, "[init_protocol] Falha na autenticação.\n");
         return -1;
     }
 
-    printf("[send_message] Enviando para %s: %s\n", destination, message);
-    last_retransmissions = 0;
-    last_delivery_time = rand() % 100 + 50;  // Simula tempo entre 50-150ms
+    // A seguir ao ACK vem o sal da sessão, de onde sai a chave dos MACs
+    uint8_t salt[POWERUDP_SALT_LEN];
+    size_t got = 0;
+    while (got < sizeof(salt)) {
+        ssize_t r = read(ctrl_fd, salt + got, sizeof(salt) - got);
+        if (r <= 0) {
+            fprintf(stderr, "[init_protocol] Sal da sessão em falta.\n");
+            return -1;
+        }
+        got += r;
+    }
+    powerudp_derive_key(psk, salt, &mac_key);
+    mac_mcast = 1;
     return 0;
 }
 
-int receive_message(char *buffer, int bufsize) {
-    // Aqui implementarias a receção com um socket
+static int open_multicast() {
+    struct sockaddr_in addr;
+    struct ip_mreq mreq;
+    int reuse = 1;
+
+    if ((mcast_fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) return -1;
+    setsockopt(mcast_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(MULTICAST_PORT);
+    if (bind(mcast_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) return -1;
+
+    mreq.imr_multiaddr.s_addr = inet_addr(MULTICAST_GROUP);
+    mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+    return setsockopt(mcast_fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq));
+}
+
+static void close_fds() {
+    if (udp_fd >= 0) close(udp_fd);
+    if (mcast_fd >= 0) close(mcast_fd);
+    if (ctrl_fd >= 0) close(ctrl_fd);
+    if (rx_ring.efd >= 0) close(rx_ring.efd);
+    if (completion_fd >= 0) close(completion_fd);
+    if (epoll_fd >= 0) close(epoll_fd);
+    if (timer_fd >= 0) close(timer_fd);
+    if (wake_fd >= 0) close(wake_fd);
+    udp_fd = mcast_fd = ctrl_fd = rx_ring.efd = completion_fd = epoll_fd = timer_fd = wake_fd = -1;
+    uring_close();
+    batch_free(&tx_batch);
+    batch_free(&rx_batch);
+    pool_destroy();
+}
+
+void init_protocol_options(PowerUDPOptions *opts) {
+    memset(opts, 0, sizeof(*opts));
+    opts->local_port = POWERUDP_PORT;
+    opts->window_size = 32;
+    opts->io_tick_us = 100;
+    opts->rx_queue_size = 1024;
+    opts->batch_size = 32;
+    opts->mtu = MTU_DEFAULT;
+    opts->ack_delay_us = 200;
+    opts->ack_every = 8;
+    opts->reorder_depth = 64;
+    opts->keepalive_ms = 0;
+    opts->io_backend = POWERUDP_IO_EPOLL;
+    opts->auth = 1;
+}
+
+/*
+ * server_ip == NULL arranca o motor sem servidor (sem handshake nem multicast),
+ * útil para testes ponto a ponto.
+ */
+int init_protocol_ex(const char *server_ip, int server_port, const char *psk, const PowerUDPOptions *opts) {
+    struct sockaddr_in addr;
+
+    if (atomic_load(&running)) return -1;
+    options = *opts;
+    if (options.window_size < 1) options.window_size = 1;
+    if (options.window_size > WINDOW_MAX) options.window_size = WINDOW_MAX;
+    if (options.io_tick_us < 1) options.io_tick_us = 100;
+    if (options.batch_size < 1) options.batch_size = 1;
+    if (options.batch_size > BATCH_MAX) options.batch_size = BATCH_MAX;
+    if (options.mtu < MTU_MIN || options.mtu > MTU_MAX) options.mtu = MTU_DEFAULT;
+    if (options.ack_delay_us < 0) options.ack_delay_us = 0;
+    if (options.ack_every < 1) options.ack_every = 1;
+    if (options.coalesce_us < 0) options.coalesce_us = 0;
+    if (options.reorder_depth > REORDER_MAX) options.reorder_depth = REORDER_MAX;
+    int depth = 1;
+    while (depth < options.reorder_depth) depth <<= 1;
+    options.reorder_depth = depth;
+    pool_init(options.mtu + URING_RX_HDR);
+    if (options.io_backend != POWERUDP_IO_URING) options.io_backend = POWERUDP_IO_EPOLL;
+
+    size_t qsize = 2;
+    while (qsize < (size_t)options.rx_queue_size) qsize <<= 1;
+    rx_ring.mask = qsize - 1;
+    rx_ring.slots = calloc(qsize, sizeof(*rx_ring.slots));
+    atomic_store(&rx_ring.head, 0);
+    atomic_store(&rx_ring.tail, 0);
+    atomic_store(&rx_ring.waiting, 0);
+    rx_ring.efd = eventfd(0, EFD_CLOEXEC);
+    mpsc_init(&submit_q);
+    // Conclusões não recolhidas de uma sessão anterior já não interessam
+    send_req *old;
+    while (completion_q.tail && (old = mpsc_pop(&completion_q))) req_release(old);
+    mpsc_init(&completion_q);
+    completion_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    completion_signal = 0;
+    if (batch_alloc(&tx_batch, options.batch_size, 0) < 0 || batch_alloc(&rx_batch, options.batch_size, 1) < 0) {
+        close_fds();
+        return -1;
+    }
+
+    // Sem servidor a chave sai só da PSK (sal a zeros); o handshake troca-a pela da sessão
+    static const uint8_t no_salt[POWERUDP_SALT_LEN];
+    mac_on = psk && options.auth;
+    mac_mcast = 0;
+    if (psk) powerudp_derive_key(psk, no_salt, &mac_key);
+
+    if (server_ip && (handshake(server_ip, server_port, psk) < 0 || open_multicast() < 0)) {
+        close_fds();
+        return -1;
+    }
+
+    if ((udp_fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+        perror("socket UDP");
+        close_fds();
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(options.local_port);
+    if (bind(udp_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("bind UDP");
+        close_fds();
+        return -1;
+    }
+
+    // Um único epoll para o socket, o tick periódico da roda (armado pelo epoll_loop),
+    // o eventfd que acorda a thread parada e o multicast
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    tick_on = 0;
+    atomic_store(&io_parked, 0);
+    int fds[4] = { udp_fd, timer_fd, wake_fd, mcast_fd };
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (timer_fd < 0 || wake_fd < 0 || epoll_fd < 0) {
+        perror("timerfd/eventfd/epoll");
+        close_fds();
+        return -1;
+    }
+    for (int i = 0; i < 4 && fds[i] >= 0; i++) {
+        struct epoll_event ev = { .events = EPOLLIN, .data.fd = fds[i] };
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fds[i], &ev);
+    }
+    if (options.io_backend == POWERUDP_IO_URING && uring_setup() < 0) {
+        perror("[PowerUDP] io_uring indisponível, a usar epoll");
+        options.io_backend = POWERUDP_IO_EPOLL;
+    }
+    memset(wheel, 0, sizeof(wheel));
+    wheel_armed = 0;
+    wheel_now = now_us() / options.io_tick_us;
+    send_spin = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? SEND_SPIN : 0;
+    ack_list = NULL;
+    fec_list = NULL;
+    rx_blocked_count = 0;
+    gf_init();
+    if (fec_impl < 0) set_fec_impl(-1);
+    // O simulador recomeça da semente em cada arranque (calendários repetíveis)
+    atomic_store(&sim_dirty, 1);
+
+    atomic_store(&running, 1);
+    if (pthread_create(&io_thread, NULL, io_loop, NULL) != 0) {
+        atomic_store(&running, 0);
+        close_fds();
+        return -1;
+    }
+    return 0;
+}
+
+int init_protocol(const char *server_ip, int server_port, const char *psk) {
+    PowerUDPOptions opts;
+    init_protocol_options(&opts);
+    return init_protocol_ex(server_ip, server_port, psk, &opts);
+}
+
+void close_protocol() {
+    if (!atomic_exchange(&running, 0)) return;
+    io_wake();
+    pthread_join(io_thread, NULL);
+
+    // Falha tudo o que ainda está pendente, para desbloquear os chamadores
+    send_req *req;
+    while ((req = mpsc_pop(&submit_q))) complete_req(req, -1);
+    for (size_t i = 0; i < peer_cap; i++) {
+        peer *p = peers[i];
+        if (!p) continue;
+        for (uint32_t seq = p->base; seq != p->next_seq; seq++)
+            if (p->win[seq % WINDOW_MAX].req) fail_req(p, p->win[seq % WINDOW_MAX].req);
+        while (p->pend_head) fail_req(p, p->pend_head);
+        for (int i = 0; p->reorder && i < options.reorder_depth; i++)
+            if (p->reorder[i].buf) pkt_put(p->reorder[i].buf);
+        free(p->reorder);
+        if (p->reasm) pkt_put(p->reasm);
+        for (int i = 0; p->fec_rx && i < FEC_RX_RING; i++)
+            if (p->fec_rx[i].buf) pkt_put(p->fec_rx[i].buf);
+        for (int i = 0; i < FEC_GROUPS; i++) fec_group_free(&p->fec_groups[i]);
+        free(p->fec_rx);
+        free(p->fec_rows);
+        free(p->gaps);
+        free(p);
+    }
+    complete_flush();
+    free(peers);
+    peers = NULL;
+    peer_cap = peer_count = 0;
+    free(fec_scratch);
+    fec_scratch = NULL;
+
+    rx_msg *m;
+    while ((m = spsc_pop(&rx_ring))) pkt_put(m);
+    free(rx_ring.slots);
+    rx_ring.slots = NULL;
+    sim_clear();
+    close_fds();
+}
+
+/* ------------------------------- API pública -------------------------------- */
+
+// config->base_timeout em ordem do host; a conversão para o fio é feita aqui
+int request_protocol_config_ex(const ConfigMessage *config) {
+    ConfigMessage cfg = *config;
+
+    pthread_mutex_lock(&config_lock);
+    config_pending = cfg;
+    pthread_mutex_unlock(&config_lock);
+    atomic_store(&config_dirty, 1);
+    io_wake();
+
+    if (ctrl_fd < 0) return 0;
+    cfg.base_timeout = htons(cfg.base_timeout);
+    char wire[1 + sizeof(cfg)];
+    wire[0] = POWERUDP_CTRL_CONFIG;
+    memcpy(wire + 1, &cfg, sizeof(cfg));
+    if (write(ctrl_fd, wire, sizeof(wire)) != sizeof(wire)) {
+        perror("Erro ao enviar configuração");
+        return -1;
+    }
     return 0;
 }
 
+// Mantém o algoritmo de congestionamento, a compressão e o FEC pedidos por último
+int request_protocol_config(int enable_retransmission, int enable_backoff, int enable_sequence, uint16_t base_timeout, uint8_t max_retries) {
+    ConfigMessage cfg;
+    pthread_mutex_lock(&config_lock);
+    cfg.congestion_control = config_pending.congestion_control;
+    cfg.compression = config_pending.compression;
+    cfg.fec_k = config_pending.fec_k;
+    cfg.fec_parity = config_pending.fec_parity;
+    pthread_mutex_unlock(&config_lock);
+
+    cfg.enable_retransmission = enable_retransmission;
+    cfg.enable_backoff = enable_backoff;
+    cfg.enable_sequence = enable_sequence;
+    cfg.base_timeout = base_timeout;
+    cfg.max_retries = max_retries;
+    return request_protocol_config_ex(&cfg);
+}
+
+// destination: "a.b.c.d" ou "a.b.c.d:porta" (porta por omissão POWERUDP_PORT)
+static int parse_destination(const char *destination, struct sockaddr_in *dest) {
+    char ip[INET_ADDRSTRLEN];
+    const char *colon = strchr(destination, ':');
+    size_t iplen = colon ? (size_t)(colon - destination) : strlen(destination);
+    if (iplen >= sizeof(ip)) return -1;
+
+    memcpy(ip, destination, iplen);
+    ip[iplen] = '\0';
+    memset(dest, 0, sizeof(*dest));
+    dest->sin_family = AF_INET;
+    dest->sin_port = htons(colon ? atoi(colon + 1) : POWERUDP_PORT);
+    return inet_pton(AF_INET, ip, &dest->sin_addr) == 1 ? 0 : -1;
+}
+
+int send_message(const char *destination, const char *message, int len) {
+    send_req req;
+
+    if (!atomic_load_explicit(&running, memory_order_acquire)) return -1;
+    memset(&req, 0, sizeof(req));
+    if (len < 0 || len > MESSAGE_MAX || parse_destination(destination, &req.dest) < 0) return -1;
+
+    req.data = message;
+    req.len = len;
+    req.rtt_us = -1;
+    sem_init(&req.done, 0, 0);
+    mpsc_push(&submit_q, &req);
+    io_wake();
+    // A conclusão vem da thread de I/O: roda um pouco antes de dormir no futex
+    int done = 0;
+    for (int i = 0; i < send_spin && !(done = sem_trywait(&req.done) == 0); i++) cpu_relax();
+    if (!done) while (sem_wait(&req.done) < 0 && errno == EINTR);
+    sem_destroy(&req.done);
+
+    last_retransmissions = req.retransmissions;
+    last_delivery_time = req.delivery_time;
+    req_stats(&req, &last_stats);
+    return req.status;
+}
+
+/*
+ * Envio sem esperar: devolve um handle (0 = erro) e a conclusão chega mais tarde.
+ * message tem de se manter válida até lá. Com callback, este é chamado na thread
+ * de I/O depois de o lote de envio da volta ter sido escrito (não pode bloquear;
+ * pode voltar a chamar send_message_async e libertar message); sem ele, a
+ * conclusão fica na fila lida por poll_completions e o eventfd de
+ * get_completion_fd fica legível.
+ */
+uint64_t send_message_async(const char *destination, const char *message, int len, PowerUDPCompletionFn callback, void *user_data) {
+    struct sockaddr_in dest;
+
+    if (!atomic_load_explicit(&running, memory_order_acquire)) return 0;
+    if (len < 0 || len > MESSAGE_MAX || parse_destination(destination, &dest) < 0) return 0;
+    send_req *req = req_alloc();
+    if (!req) return 0;
+
+    req->dest = dest;
+    req->data = message;
+    req->len = len;
+    req->rtt_us = -1;
+    req->async = 1;
+    req->handle = atomic_fetch_add_explicit(&next_handle, 1, memory_order_relaxed);
+    req->callback = callback;
+    req->user_data = user_data;
+    uint64_t handle = req->handle;
+    mpsc_push(&submit_q, req);
+    io_wake();
+    return handle;
+}
+
+int get_completion_fd() {
+    return completion_fd;
+}
+
+// Recolhe até max conclusões sem bloquear; devolve quantas
+int poll_completions(PowerUDPCompletion *completions, int max) {
+    uint64_t v;
+    int n = 0;
+
+    pthread_mutex_lock(&completion_lock);
+    // Limpa o aviso antes de esvaziar: o que chegar depois volta a acordar o eventfd
+    if (completion_fd >= 0 && read(completion_fd, &v, sizeof(v)) < 0 && errno != EAGAIN) perror("eventfd read");
+    send_req *req;
+    while (n < max && completion_q.tail && (req = mpsc_pop(&completion_q))) {
+        PowerUDPCompletion *c = &completions[n++];
+        c->handle = req->handle;
+        c->user_data = req->user_data;
+        c->status = req->status;
+        req_stats(req, &c->stats);
+        req_release(req);
+    }
+    // Pode ter ficado alguma por recolher: o eventfd continua legível
+    if (n == max && completion_fd >= 0) {
+        uint64_t one = 1;
+        if (write(completion_fd, &one, sizeof(one)) < 0) perror("eventfd write");
+    }
+    pthread_mutex_unlock(&completion_lock);
+    return n;
+}
+
+int receive_message(char *buffer, int bufsize) {
+    rx_msg *m;
+
+    while (!(m = spsc_pop(&rx_ring))) {
+        if (!atomic_load(&running)) return -1;
+        atomic_store(&rx_ring.waiting, 1);
+        if (!(m = spsc_pop(&rx_ring))) {
+            uint64_t v;
+            struct pollfd pfd = { .fd = rx_ring.efd, .events = POLLIN };
+            if (poll(&pfd, 1, 100) > 0 && read(rx_ring.efd, &v, sizeof(v)) < 0) perror("eventfd read");
+        }
+        atomic_store(&rx_ring.waiting, 0);
+        if (m) break;
+    }
+
+    int n = m->len < (size_t)bufsize ? (int)m->len : bufsize;
+    memcpy(buffer, m->data, n);
+    pkt_put(m);
+    return n;
+}
+
 int get_last_message_stats(int *retransmissions, int *delivery_time) {
     *retransmissions = last_retransmissions;
     *delivery_time = last_delivery_time;
     return 0;
 }
 
+int get_last_message_stats_ex(PowerUDPMessageStats *stats) {
+    *stats = last_stats;
+    return 0;
+}
+
+static uint64_t metric_total(int id) {
+    uint64_t total = 0;
+    for (metrics_block *m = atomic_load(&metrics_head); m; m = m->next)
+        total += atomic_load_explicit(&m->c[id], memory_order_relaxed);
+    return total;
+}
+
+static void hist_merge(PowerUDPHistogram *out, int id) {
+    memset(out, 0, sizeof(*out));
+    out->min = UINT64_MAX;
+    for (metrics_block *m = atomic_load(&metrics_head); m; m = m->next) {
+        hist_block *h = &m->h[id];
+        uint64_t min = atomic_load_explicit(&h->min, memory_order_relaxed);
+        uint64_t max = atomic_load_explicit(&h->max, memory_order_relaxed);
+        out->count += atomic_load_explicit(&h->count, memory_order_relaxed);
+        out->sum += atomic_load_explicit(&h->sum, memory_order_relaxed);
+        if (min < out->min) out->min = min;
+        if (max > out->max) out->max = max;
+        for (int i = 0; i < POWERUDP_HIST_BUCKETS; i++)
+            out->buckets[i] += atomic_load_explicit(&h->buckets[i], memory_order_relaxed);
+    }
+    if (!out->count) out->min = 0;
+}
+
+/*
+ * Soma os blocos de todas as threads. Não bloqueia quem escreve: o resultado é uma
+ * fotografia aproximada (cada contador é lido atomicamente, mas não todos ao mesmo tempo).
+ */
+int get_protocol_metrics(PowerUDPMetrics *m) {
+    m->packets_sent = metric_total(M_PACKETS_SENT);
+    m->packets_received = metric_total(M_PACKETS_RECEIVED);
+    m->bytes_sent = metric_total(M_BYTES_SENT);
+    m->bytes_received = metric_total(M_BYTES_RECEIVED);
+    m->acks_sent = metric_total(M_ACKS_SENT);
+    m->acks_received = metric_total(M_ACKS_RECEIVED);
+    m->naks_sent = metric_total(M_NAKS_SENT);
+    m->naks_received = metric_total(M_NAKS_RECEIVED);
+    m->timeouts = metric_total(M_TIMEOUTS);
+    m->duplicates = metric_total(M_DUPLICATES);
+    m->retransmissions = metric_total(M_RETRANSMISSIONS);
+    m->messages_sent = metric_total(M_MESSAGES_SENT);
+    m->messages_failed = metric_total(M_MESSAGES_FAILED);
+    m->messages_received = metric_total(M_MESSAGES_RECEIVED);
+    m->stale_configs = metric_total(M_STALE_CONFIGS);
+    m->reordered = metric_total(M_REORDERED);
+    m->congestion_events = metric_total(M_CC_EVENTS);
+    m->coalesced = metric_total(M_COALESCED);
+    m->sim_dropped = metric_total(M_SIM_DROPS);
+    m->sim_duplicated = metric_total(M_SIM_DUPS);
+    m->sim_delayed = metric_total(M_SIM_DELAYED);
+    m->auth_failed = metric_total(M_AUTH_FAILED);
+    m->crc_failed = metric_total(M_CRC_FAILED);
+    m->malformed = metric_total(M_MALFORMED);
+    m->compressed = metric_total(M_LZ_MESSAGES);
+    m->compression_saved = metric_total(M_LZ_SAVED);
+    m->compression_skipped = metric_total(M_LZ_SKIPPED);
+    m->compression_ns = metric_total(M_LZ_NS);
+    m->compression_errors = metric_total(M_LZ_ERRORS);
+    m->fec_parity_sent = metric_total(M_FEC_PARITY);
+    m->fec_recovered = metric_total(M_FEC_RECOVERED);
+    m->fec_ns = metric_total(M_FEC_NS);
+    m->skipped = metric_total(M_SKIPPED);
+    m->reassembly_dropped = metric_total(M_REASM_DROPPED);
+    hist_merge(&m->delivery_time_us, H_DELIVERY);
+    hist_merge(&m->rtt_us, H_RTT);
+    hist_merge(&m->retries, H_RETRIES);
+    return 0;
+}
+
+uint64_t histogram_percentile(const PowerUDPHistogram *h, double p) {
+    if (!h->count) return 0;
+    uint64_t rank = (uint64_t)(p / 100.0 * h->count + 0.5), seen = 0;
+    if (rank < 1) rank = 1;
+    for (int i = 0; i < POWERUDP_HIST_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= rank) {
+            uint64_t v = hist_bucket_value(i);
+            return v < h->min ? h->min : v > h->max ? h->max : v;
+        }
+    }
+    return h->max;
+}
+
+int get_io_stats(PowerUDPIOStats *stats) {
+    stats->tx_packets = metric_total(M_PACKETS_SENT);
+    stats->tx_syscalls = metric_total(M_TX_SYSCALLS);
+    stats->rx_packets = metric_total(M_PACKETS_RECEIVED);
+    stats->rx_syscalls = metric_total(M_RX_SYSCALLS);
+    stats->backend = options.io_backend;
+    return 0;
+}
+
+int get_pool_stats(PowerUDPPoolStats *stats) {
+    pthread_mutex_lock(&pool.lock);
+    stats->buffers_total = pool.total;
+    pthread_mutex_unlock(&pool.lock);
+    stats->buffers_in_use = metric_total(M_POOL_GETS) - metric_total(M_POOL_PUTS);
+    stats->buffer_size = options.mtu;
+    stats->slab_allocations = metric_total(M_POOL_SLABS);
+    stats->heap_allocations = metric_total(M_HEAP_ALLOCS);
+    return 0;
+}
+
+int set_impairment(int direction, const PowerUDPImpairment *imp) {
+    if (direction != POWERUDP_DIR_TX && direction != POWERUDP_DIR_RX) return -1;
+    PowerUDPImpairment cfg = *imp;
+    if (cfg.rate_kbps < 0) cfg.rate_kbps = 0;
+    if (cfg.queue_bytes < 0) cfg.queue_bytes = 0;
+
+    pthread_mutex_lock(&config_lock);
+    sim_pending[direction] = cfg;
+    pthread_mutex_unlock(&config_lock);
+    // Aplicada pela thread de I/O no início da próxima volta
+    atomic_store(&sim_dirty, 1);
+    io_wake();
+    return 0;
+}
+
+int get_impairment(int direction, PowerUDPImpairment *imp) {
+    if (direction != POWERUDP_DIR_TX && direction != POWERUDP_DIR_RX) return -1;
+    pthread_mutex_lock(&config_lock);
+    *imp = sim_pending[direction];
+    pthread_mutex_unlock(&config_lock);
+    return 0;
+}
+
+// Perda e reordenação simuladas no envio, só nos pacotes de dados (o resto mantém-se)
 void inject_packet_loss(int probability) {
-    simulated_loss = probability;
-    printf("[inject_packet_loss] Perda simulada: %d%%\n", simulated_loss);
+    PowerUDPImpairment imp;
+    get_impairment(POWERUDP_DIR_TX, &imp);
+    imp.data_only = 1;
+    imp.loss_pct = probability;
+    set_impairment(POWERUDP_DIR_TX, &imp);
+    printf("[inject_packet_loss] Perda simulada: %d%%\n", probability);
+}
+
+void inject_packet_reorder(int probability) {
+    PowerUDPImpairment imp;
+    get_impairment(POWERUDP_DIR_TX, &imp);
+    imp.data_only = 1;
+    imp.reorder_pct = probability;
+    set_impairment(POWERUDP_DIR_TX, &imp);
+    printf("[inject_packet_reorder] Reordenação simulada: %d%%\n", probability);
+}
+
+/*
+ * Escolhe a implementação do MAC em lote (POWERUDP_MAC_*, -1 = a mais rápida que o
+ * processador suporta) e devolve a que ficou. Serve sobretudo para o benchmark.
+ */
+int set_mac_impl(int impl) {
+#if defined(__x86_64__) || defined(__i386__)
+    int avx2 = __builtin_cpu_supports("avx2");
+#else
+    int avx2 = 0;
+#endif
+    if (impl < 0 || impl > POWERUDP_MAC_AVX2) impl = avx2 ? POWERUDP_MAC_AVX2 : POWERUDP_MAC_VECTOR;
+    if (impl == POWERUDP_MAC_AVX2 && !avx2) impl = POWERUDP_MAC_VECTOR;
+    mac_impl = impl;
+    return impl;
+}
+
+// tags[i] = MAC dos lens[i] (>= 8) bytes de datagrams[i], tal como o motor os calcula
+void mac_batch(const PowerUDPKey *key, const void *const *datagrams, const unsigned int *lens, int n, uint64_t *tags) {
+    mac_input in[BATCH_MAX];
+    for (int i = 0; i < n; i += BATCH_MAX) {
+        int k = n - i < BATCH_MAX ? n - i : BATCH_MAX;
+        for (int j = 0; j < k; j++) {
+            in[j].head = datagrams[i + j];
+            in[j].head_len = sizeof(PowerUDPHeader);
+            in[j].body = (const uint8_t *)datagrams[i + j] + sizeof(PowerUDPHeader);
+            in[j].body_len = lens[i + j] - sizeof(PowerUDPHeader);
+        }
+        mac_inputs(key, in, k, tags + i);
+    }
+}
+
+/*
+ * Escolhe a implementação da multiplicação-acumulação do FEC (POWERUDP_FEC_*, -1 =
+ * a mais rápida que o processador suporta) e devolve a que ficou.
+ */
+int set_fec_impl(int impl) {
+#if defined(__x86_64__) || defined(__i386__)
+    int ssse3 = __builtin_cpu_supports("ssse3"), avx2 = __builtin_cpu_supports("avx2");
+#else
+    int ssse3 = 0, avx2 = 0;
+#endif
+    if (impl < 0 || impl > POWERUDP_FEC_AVX2) impl = avx2 ? POWERUDP_FEC_AVX2 : ssse3 ? POWERUDP_FEC_SSSE3 : POWERUDP_FEC_SCALAR;
+    if (impl == POWERUDP_FEC_AVX2 && !avx2) impl = POWERUDP_FEC_SSSE3;
+    if (impl == POWERUDP_FEC_SSSE3 && !ssse3) impl = POWERUDP_FEC_SCALAR;
+    fec_impl = impl;
+    return impl;
+}
+
+// dst[i] ^= c * src[i] em GF(2^8), com a implementação que o motor usa na paridade
+void fec_mul_add(uint8_t *dst, const uint8_t *src, size_t len, uint8_t c) {
+    gf_init();
+    if (fec_impl < 0) set_fec_impl(-1);
+    fec_madd(dst, src, len, c);
 }
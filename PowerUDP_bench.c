@@ -0,0 +1,743 @@
+/*
+ * Benchmark do PowerUDP sobre loopback.
+ *
+ *   gcc -O2 -o PowerUDP_bench PowerUDP_bench.c PowerUDP.c -lpthread
+ *   ./PowerUDP_bench [opções] > resultados.jsonl
+ *
+ * Cada cenário arranca um recetor num processo filho (o motor é um por processo)
+ * e envia a partir do pai com a API de POWERUDP_H.h. Percorre todas as combinações
+ * das listas indicadas e escreve uma linha JSON por cenário no stdout; o resto do
+ * output (mensagens do motor) vai para o stderr.
+ *
+ * O recetor valida cada mensagem: tamanho, conteúdo e, quando cabem, um id de
+ * emissor e um contador nos primeiros 8 bytes. Uma mensagem repetida ou fora de
+ * ordem de um mesmo emissor conta em rx_order_errors, o resto em rx_corrupt; com
+ * --reorder isto serve de teste ao anel de reordenação.
+ *
+ * As alocações (slabs do pool mais buffers fora dele) são contadas no recetor a
+ * partir de 10% das mensagens, em regime estável, e no emissor durante o cenário;
+ * com mensagens de um só datagrama devem ser zero.
+ *
+ * Opções (listas separadas por vírgulas):
+ *   --sizes 64,1024,65536     tamanho das mensagens (bytes)
+ *   --loss 0,1,5              perda simulada (%)
+ *   --reorder 0               pacotes de dados reordenados pelo emissor (%)
+ *   --reorder-depth 64        pacotes adiantados guardados pelo recetor
+ *   --configs 111             retransmissão/backoff/sequência, um dígito cada
+ *   --senders 1,4             threads emissoras em simultâneo
+ *   --windows 32              pacotes em voo por peer
+ *   --ack-delays 0,200        atraso máximo dos ACKs no recetor (µs)
+ *   --ack-every 8             pacotes de dados cobertos por um ACK atrasado
+ *   --cc 1                    controlo de congestionamento (0 = nenhum, 1 = NewReno)
+ *   --backends 0              backend de I/O do motor (0 = epoll, 1 = io_uring)
+ *   --coalesce 0,200          agrupamento de mensagens pequenas (µs, 0 = desligado)
+ *   --async 0,1024            mensagens em voo por thread com send_message_async e a
+ *                             fila de conclusões (0 = send_message síncrono)
+ *   --auth 0,1                MAC em cada datagrama (chave derivada da PSK)
+ *   --checksum 0,1            cabeçalho v1 com CRC32C em cada datagrama
+ *   --compress 0,1            compressão LZ das mensagens grandes (ConfigMessage.compression)
+ *   --random 0,1              payload aleatório (incompressível) em vez de texto repetitivo
+ *   --fec 0,8:1,8:2           FEC: K pacotes de dados por grupo e M de paridade (K:M,
+ *                             M = 1 por omissão; 0 = só retransmissão)
+ *   --giveup 0,8              apagão: o emissor 0 perde tudo em N mensagens seguidas a 1/4
+ *                             do cenário, que esgotam as tentativas; as enviadas depois
+ *                             têm de continuar a chegar (failed_after_giveup)
+ *
+ * Simulador de rede (PowerUDPImpairment), aplicado ao envio dos dois processos:
+ * a perda (--loss) e a reordenação (--reorder) só aos dados do emissor, o resto
+ * também aos ACKs do recetor.
+ *   --seed 1                  semente (o recetor usa seed + 1)
+ *   --delay 0                 atraso fixo em cada sentido (µs)
+ *   --jitter 0                jitter uniforme (µs)
+ *   --dup 0                   pacotes duplicados (%)
+ *   --burst 0,0,0             perda em rajadas: bom->mau %, mau->bom %, perda no estado mau %
+ *   --rate 0                  largura de banda em cada sentido (kbit/s, 0 = ilimitada)
+ *   --queue 0                 fila do limitador de débito (bytes, 0 = ilimitada)
+ *   --messages 1000           mensagens por cenário (limitado por --bytes)
+ *   --bytes 67108864          orçamento de bytes por cenário
+ *   --timeout 50              base_timeout (ms)
+ *   --retries 10              max_retries
+ *   --port 20000              primeira porta UDP a usar
+ *
+ * --mac-bench 64,512,1400 não corre cenários: mede o custo por datagrama do MAC em
+ * lotes de 32, com cada implementação (escalar, vetorial, AVX2), para cada tamanho.
+ * --crc-bench 64,1400,65536 faz o mesmo para o CRC32C (tabela e SSE4.2), em GB/s.
+ * --fec-bench 1400,65536 mede a multiplicação-acumulação em GF(2^8) da paridade FEC
+ * (escalar, SSSE3, AVX2), também em GB/s.
+ */
+#define _GNU_SOURCE
+#include "POWERUDP_H.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+
+#define MAX_LIST 16
+
+typedef struct {
+    int v[MAX_LIST];
+    int n;
+} int_list;
+
+typedef struct {
+    int size;
+    int loss;
+    int reorder;
+    int retrans, backoff, seq;
+    int senders;
+    int window;
+    int ack_delay;
+    int cc;
+    int backend;
+    int coalesce;
+    int async;
+    int auth;
+    int checksum;
+    int compress;
+    int random;
+    int fec_k, fec_parity;
+    int giveup;
+    int messages;
+} scenario;
+
+// Resultado da validação feita pelo recetor (memória partilhada com o pai)
+typedef struct {
+    long delivered;
+    long order_errors;
+    long corrupt;
+    long steady;                // mensagens depois do aquecimento
+    long allocs;                // slabs + buffers fora do pool nesse período
+    long fec_recovered;         // pacotes reconstruídos pelo FEC no recetor
+    long skipped;               // seq abandonados pelo emissor que o recetor saltou
+} rx_check;
+
+typedef struct {
+    const scenario *sc;
+    int id;
+    int first, count;
+    char dest[32];
+    uint64_t *latency_us;       // uma entrada por mensagem
+    int delivered;
+    long retransmissions;
+    int failed_after;           // falhas de mensagens enviadas depois do apagão (--giveup)
+    atomic_int outstanding;     // envios assíncronos por concluir
+} sender_arg;
+
+// Contexto de um envio assíncrono (user_data da conclusão)
+typedef struct {
+    sender_arg *owner;
+    uint64_t t0;
+    int after;                  // enviada depois do apagão
+} async_ctx;
+
+static int_list sizes = { { 64, 1024, 65536 }, 3 };
+static int_list losses = { { 0, 1, 5 }, 3 };
+static int_list reorders = { { 0 }, 1 };
+static int_list configs = { { 111 }, 1 };
+static int_list senders = { { 1, 4 }, 2 };
+static int_list windows = { { 32 }, 1 };
+static int_list ack_delays = { { 200 }, 1 };
+static int_list ccs = { { POWERUDP_CC_NEWRENO }, 1 };
+static int_list backends = { { POWERUDP_IO_EPOLL }, 1 };
+static int_list coalesces = { { 0 }, 1 };
+static int_list asyncs = { { 0 }, 1 };
+static int_list auths = { { 0 }, 1 };
+static int_list checksums = { { 0 }, 1 };
+static int_list compresses = { { 0 }, 1 };
+static int_list randoms = { { 0 }, 1 };
+static int_list fecs = { { 0 }, 1 };         // K << 8 | M
+static int_list giveups = { { 0 }, 1 };
+static int_list mac_sizes = { { 0 }, 0 };
+static int_list crc_sizes = { { 0 }, 0 };
+static int_list gf_sizes = { { 0 }, 0 };
+static pthread_mutex_t reap_lock = PTHREAD_MUTEX_INITIALIZER;
+static int ack_every = 8;
+static int reorder_depth = 64;
+static int messages = 1000;
+static long byte_budget = 64L << 20;
+static int base_timeout = 50;
+static int max_retries = 10;
+static int next_port = 20000;
+static PowerUDPImpairment path = { .seed = 1 };     // imperfeições comuns aos dois sentidos
+static atomic_int giveup_over;                      // o apagão do cenário já acabou
+static FILE *out;
+
+static uint64_t now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void parse_list(const char *s, int_list *l) {
+    l->n = 0;
+    while (*s && l->n < MAX_LIST) {
+        l->v[l->n++] = atoi(s);
+        s = strchr(s, ',');
+        if (!s) break;
+        s++;
+    }
+}
+
+// "K:M,K,..." (M = 1 por omissão) para K << 8 | M
+static void parse_fec(const char *s, int_list *l) {
+    l->n = 0;
+    while (*s && l->n < MAX_LIST) {
+        char *end;
+        int k = (int)strtol(s, &end, 10), m = 1;
+        if (*end == ':') m = (int)strtol(end + 1, &end, 10);
+        l->v[l->n++] = k << 8 | (m & 0xff);
+        s = strchr(s, ',');
+        if (!s) break;
+        s++;
+    }
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static uint64_t percentile(const uint64_t *sorted, int n, double p) {
+    if (n == 0) return 0;
+    int i = (int)(p * (n - 1) + 0.5);
+    return sorted[i];
+}
+
+// Imperfeições do envio no emissor: a reordenação do cenário e a perda dada
+static void sender_impairment(const scenario *sc, int loss) {
+    PowerUDPImpairment imp = path;
+    imp.loss_pct = loss;
+    imp.reorder_pct = sc->reorder;
+    set_impairment(POWERUDP_DIR_TX, &imp);
+}
+
+/*
+ * --giveup: o emissor 0 começa o apagão antes da mensagem i = count / 4 e acaba-o
+ * depois de sc->giveup mensagens. Devolve 1 se a mensagem i é posterior ao apagão.
+ */
+static int giveup_step(sender_arg *a, int i, int after_send) {
+    int start = a->count / 4;
+    if (a->sc->giveup && a->id == 0) {
+        if (!after_send && i == start) sender_impairment(a->sc, 100);
+        if (after_send && i == start + a->sc->giveup - 1) {
+            sender_impairment(a->sc, a->sc->loss);
+            atomic_store(&giveup_over, 1);
+        }
+    }
+    return atomic_load(&giveup_over);
+}
+
+static void configure(const scenario *sc, int port, int sender) {
+    PowerUDPOptions opts;
+    init_protocol_options(&opts);
+    opts.local_port = port;
+    opts.window_size = sc->window;
+    opts.ack_delay_us = sc->ack_delay;
+    opts.ack_every = ack_every;
+    opts.reorder_depth = reorder_depth;
+    opts.io_backend = sc->backend;
+    opts.coalesce_us = sc->coalesce;
+    opts.auth = sc->auth;
+    opts.checksum = sc->checksum;
+    if (init_protocol_ex(NULL, 0, sc->auth ? POWERUDP_PSK : NULL, &opts) < 0) {
+        fprintf(stderr, "init_protocol_ex falhou na porta %d\n", port);
+        exit(1);
+    }
+    ConfigMessage cfg = {
+        .enable_retransmission = sc->retrans,
+        .enable_backoff = sc->backoff,
+        .enable_sequence = sc->seq,
+        .base_timeout = base_timeout,
+        .max_retries = max_retries,
+        .congestion_control = sc->cc,
+        .compression = sc->compress,
+        .fec_k = sc->fec_k,
+        .fec_parity = sc->fec_parity
+    };
+    request_protocol_config_ex(&cfg);
+
+    PowerUDPImpairment imp = path;
+    if (sender) {
+        sender_impairment(sc, sc->loss);
+        return;
+    }
+    imp.seed++;
+    set_impairment(POWERUDP_DIR_TX, &imp);
+}
+
+static void fill_payload(const scenario *sc, char *payload, int size, uint32_t id, uint32_t counter) {
+    if (sc->random) {
+        uint32_t x = 2463534242u;       // o mesmo em todas as mensagens: o recetor regenera-o
+        for (int i = 0; i < size; i++) {
+            x ^= x << 13;
+            x ^= x >> 17;
+            x ^= x << 5;
+            payload[i] = (char)x;
+        }
+    } else {
+        for (int i = 0; i < size; i++) payload[i] = (char)('a' + i % 26);
+    }
+    if (size >= 8) {
+        memcpy(payload, &id, 4);
+        memcpy(payload + 4, &counter, 4);
+    }
+}
+
+static void run_receiver(const scenario *sc, int port, rx_check *check) {
+    char *buffer = malloc(sc->size > 0 ? sc->size : 1);
+    char *expected = malloc(sc->size > 0 ? sc->size : 1);
+    long last[64];
+    for (int i = 0; i < 64; i++) last[i] = -1;
+    long warmup = sc->messages / 10 > 0 ? sc->messages / 10 : 1;
+    PowerUDPPoolStats p0, p1;
+    static PowerUDPMetrics m;
+
+    configure(sc, port, 0);
+    for (;;) {
+        int n = receive_message(buffer, sc->size);
+        if (n < 0) break;
+
+        uint32_t id = 0, counter = 0;
+        if (sc->size >= 8) {
+            memcpy(&id, buffer, 4);
+            memcpy(&counter, buffer + 4, 4);
+        }
+        fill_payload(sc, expected, sc->size, id, counter);
+        if (n != sc->size || id >= 64 || memcmp(buffer, expected, n) != 0) check->corrupt++;
+        else if (sc->size >= 8 && (long)counter <= last[id]) check->order_errors++;
+        else last[id] = counter;
+        check->delivered++;
+
+        if (check->delivered == warmup) get_pool_stats(&p0);
+        else if (check->delivered > warmup && ((check->delivered & 63) == 0 || check->delivered == sc->messages)) {
+            get_pool_stats(&p1);
+            check->steady = check->delivered - warmup;
+            check->allocs = (p1.slab_allocations - p0.slab_allocations) + (p1.heap_allocations - p0.heap_allocations);
+            get_protocol_metrics(&m);
+            check->fec_recovered = m.fec_recovered;
+            check->skipped = m.skipped;
+        }
+    }
+    close_protocol();
+    free(expected);
+    free(buffer);
+}
+
+/*
+ * Recolhe as conclusões pendentes, sejam de que emissor forem (a fila é do
+ * processo), e regista cada uma no emissor que a submeteu.
+ */
+static int async_reap() {
+    PowerUDPCompletion done[256];
+    pthread_mutex_lock(&reap_lock);
+    int n = poll_completions(done, 256);
+    uint64_t t1 = now_us();
+    for (int i = 0; i < n; i++) {
+        async_ctx *ctx = done[i].user_data;
+        sender_arg *a = ctx->owner;
+        a->retransmissions += done[i].stats.retransmissions;
+        if (done[i].status == 0) a->latency_us[a->first + a->delivered++] = t1 - ctx->t0;
+        else if (ctx->after) a->failed_after++;
+        atomic_fetch_sub(&a->outstanding, 1);
+    }
+    pthread_mutex_unlock(&reap_lock);
+    return n;
+}
+
+static void async_wait(sender_arg *a, int limit) {
+    while (atomic_load(&a->outstanding) > limit) {
+        if (async_reap() > 0) continue;
+        struct pollfd pfd = { .fd = get_completion_fd(), .events = POLLIN };
+        poll(&pfd, 1, 1);
+    }
+}
+
+// Até sc->async mensagens em voo; cada uma tem o seu payload até à conclusão
+static void run_sender_async(sender_arg *a) {
+    size_t size = a->sc->size > 0 ? a->sc->size : 1;
+    char *payloads = malloc(size * a->count);
+    async_ctx *ctx = calloc(a->count, sizeof(*ctx));
+
+    for (int i = 0; i < a->count; i++) {
+        // O apagão só apanha as suas mensagens: espera pelas que estão em voo antes e depois
+        int edge = a->sc->giveup && a->id == 0 && (i == a->count / 4 || i == a->count / 4 + a->sc->giveup);
+        async_wait(a, edge ? 0 : a->sc->async - 1);
+        if (edge && i > a->count / 4) giveup_step(a, i - 1, 1);
+        char *payload = payloads + size * i;
+        fill_payload(a->sc, payload, a->sc->size, a->id, i);
+        ctx[i].owner = a;
+        ctx[i].after = giveup_step(a, i, 0);
+        ctx[i].t0 = now_us();
+        atomic_fetch_add(&a->outstanding, 1);
+        if (!send_message_async(a->dest, payload, a->sc->size, NULL, &ctx[i])) atomic_fetch_sub(&a->outstanding, 1);
+    }
+    async_wait(a, 0);
+    free(ctx);
+    free(payloads);
+}
+
+static void *run_sender(void *arg) {
+    sender_arg *a = arg;
+    PowerUDPMessageStats st;
+    if (a->sc->async > 0) {
+        run_sender_async(a);
+        return NULL;
+    }
+    char *payload = malloc(a->sc->size > 0 ? a->sc->size : 1);
+
+    for (int i = 0; i < a->count; i++) {
+        fill_payload(a->sc, payload, a->sc->size, a->id, i);
+        int after = giveup_step(a, i, 0);
+        uint64_t t0 = now_us();
+        int r = send_message(a->dest, payload, a->sc->size);
+        uint64_t t1 = now_us();
+        giveup_step(a, i, 1);
+
+        get_last_message_stats_ex(&st);
+        a->retransmissions += st.retransmissions;
+        if (r == 0) a->latency_us[a->first + a->delivered++] = t1 - t0;
+        else if (after) a->failed_after++;
+    }
+    free(payload);
+    return NULL;
+}
+
+static void run_scenario(const scenario *sc) {
+    int rx_port = next_port++, tx_port = next_port++;
+    rx_check *check = mmap(NULL, sizeof(*check), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    memset(check, 0, sizeof(*check));
+    pid_t pid = fork();
+    if (pid == 0) {
+        run_receiver(sc, rx_port, check);
+        _exit(0);
+    }
+
+    configure(sc, tx_port, 1);
+    usleep(50000);      // dá tempo ao recetor para fazer bind
+
+    uint64_t *latency = calloc(sc->messages, sizeof(*latency));
+    sender_arg args[64];
+    pthread_t tids[64];
+    PowerUDPIOStats io0, io1;
+    static PowerUDPMetrics m0, m1;
+    PowerUDPPoolStats pool0, pool1;
+    get_io_stats(&io0);
+    get_protocol_metrics(&m0);
+    get_pool_stats(&pool0);
+
+    int per = sc->messages / sc->senders, first = 0;
+    atomic_store(&giveup_over, 0);
+    uint64_t t0 = now_us();
+    for (int i = 0; i < sc->senders; i++) {
+        sender_arg *a = &args[i];
+        memset(a, 0, sizeof(*a));
+        a->sc = sc;
+        a->id = i;
+        a->first = first;
+        a->count = i == sc->senders - 1 ? sc->messages - first : per;
+        a->latency_us = latency;
+        snprintf(a->dest, sizeof(a->dest), "127.0.0.1:%d", rx_port);
+        first += a->count;
+        pthread_create(&tids[i], NULL, run_sender, a);
+    }
+
+    int delivered = 0, failed_after = 0;
+    long retransmissions = 0;
+    for (int i = 0; i < sc->senders; i++) {
+        pthread_join(tids[i], NULL);
+        retransmissions += args[i].retransmissions;
+        failed_after += args[i].failed_after;
+    }
+    double elapsed = (now_us() - t0) / 1e6;
+    get_io_stats(&io1);
+    get_protocol_metrics(&m1);
+    get_pool_stats(&pool1);
+
+    // Junta as latências das várias threads no início do vetor
+    for (int i = 0; i < sc->senders; i++) {
+        memmove(latency + delivered, latency + args[i].first, args[i].delivered * sizeof(*latency));
+        delivered += args[i].delivered;
+    }
+    qsort(latency, delivered, sizeof(*latency), cmp_u64);
+
+    usleep(20000);      // deixa o recetor consumir as últimas mensagens
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    close_protocol();
+
+    uint64_t tx_pkts = io1.tx_packets - io0.tx_packets, tx_calls = io1.tx_syscalls - io0.tx_syscalls;
+    uint64_t rx_pkts = io1.rx_packets - io0.rx_packets, rx_calls = io1.rx_syscalls - io0.rx_syscalls;
+    // Do lado emissor: ACKs recebidos por pacote de dados enviado
+    uint64_t data_pkts = (m1.packets_sent - m0.packets_sent) - (m1.acks_sent - m0.acks_sent);
+    uint64_t acks = m1.acks_received - m0.acks_received;
+    fprintf(out,
+            "{\"size\":%d,\"loss\":%d,\"reorder\":%d,\"retransmission\":%d,\"backoff\":%d,\"sequence\":%d,"
+            "\"senders\":%d,\"window\":%d,\"ack_delay_us\":%d,\"cc\":%d,\"backend\":%d,\"coalesce_us\":%d,\"async\":%d,\"auth\":%d,\"checksum\":%d,\"compress\":%d,\"random\":%d,\"fec_k\":%d,\"fec_parity\":%d,\"giveup\":%d,\"messages\":%d,\"delivered\":%d,\"failed\":%d,\"failed_after_giveup\":%d,"
+            "\"elapsed_s\":%.6f,\"msgs_per_s\":%.1f,\"goodput_mbps\":%.3f,"
+            "\"p50_us\":%llu,\"p99_us\":%llu,\"p999_us\":%llu,\"retx_per_msg\":%.4f,"
+            "\"acks_per_data_pkt\":%.4f,\"cc_events\":%llu,\"coalesced\":%llu,\"sim_dropped\":%llu,\"sim_duplicated\":%llu,\"auth_failed\":%llu,\"crc_failed\":%llu,\"malformed\":%llu,\"compressed\":%llu,\"compression_saved\":%llu,\"compression_skipped\":%llu,\"compression_ns_per_msg\":%.1f,\"compression_errors\":%llu,\"fec_parity_sent\":%llu,\"fec_recovered\":%ld,\"fec_ns_per_msg\":%.1f,\"data_pkts_per_msg\":%.4f,\"rx_delivered\":%ld,\"rx_order_errors\":%ld,\"rx_corrupt\":%ld,\"rx_skipped\":%ld,\"rx_allocs_per_msg\":%.4f,\"tx_allocs\":%llu,"
+            "\"tx_pkts_per_syscall\":%.2f,\"rx_pkts_per_syscall\":%.2f}\n",
+            sc->size, sc->loss, sc->reorder, sc->retrans, sc->backoff, sc->seq,
+            sc->senders, sc->window, sc->ack_delay, sc->cc, io1.backend, sc->coalesce, sc->async, sc->auth, sc->checksum, sc->compress, sc->random, sc->fec_k, sc->fec_parity, sc->giveup, sc->messages, delivered, sc->messages - delivered, failed_after,
+            elapsed, delivered / elapsed, delivered * (double)sc->size * 8 / elapsed / 1e6,
+            (unsigned long long)percentile(latency, delivered, 0.50),
+            (unsigned long long)percentile(latency, delivered, 0.99),
+            (unsigned long long)percentile(latency, delivered, 0.999),
+            (double)retransmissions / sc->messages, data_pkts ? (double)acks / data_pkts : 0,
+            (unsigned long long)(m1.congestion_events - m0.congestion_events),
+            (unsigned long long)(m1.coalesced - m0.coalesced),
+            (unsigned long long)(m1.sim_dropped - m0.sim_dropped), (unsigned long long)(m1.sim_duplicated - m0.sim_duplicated),
+            (unsigned long long)(m1.auth_failed - m0.auth_failed),
+            (unsigned long long)(m1.crc_failed - m0.crc_failed),
+            (unsigned long long)(m1.malformed - m0.malformed),
+            (unsigned long long)(m1.compressed - m0.compressed),
+            (unsigned long long)(m1.compression_saved - m0.compression_saved),
+            (unsigned long long)(m1.compression_skipped - m0.compression_skipped),
+            delivered ? (double)(m1.compression_ns - m0.compression_ns) / delivered : 0.0,
+            (unsigned long long)(m1.compression_errors - m0.compression_errors),
+            (unsigned long long)(m1.fec_parity_sent - m0.fec_parity_sent), check->fec_recovered,
+            delivered ? (double)(m1.fec_ns - m0.fec_ns) / delivered : 0.0,
+            (double)data_pkts / sc->messages,
+            check->delivered, check->order_errors, check->corrupt, check->skipped,
+            check->steady ? (double)check->allocs / check->steady : 0,
+            (unsigned long long)((pool1.slab_allocations - pool0.slab_allocations) + (pool1.heap_allocations - pool0.heap_allocations)),
+            tx_calls ? (double)tx_pkts / tx_calls : 0, rx_calls ? (double)rx_pkts / rx_calls : 0);
+    fflush(out);
+
+    munmap(check, sizeof(*check));
+    free(latency);
+}
+
+/*
+ * Custo do MAC por datagrama: lotes de 32 datagramas de cada tamanho, assinados com
+ * mac_batch durante ~200 ms por implementação. Antes confirma que todas dão o mesmo
+ * resultado que o SipHash de referência de POWERUDP_H.h.
+ */
+static int run_mac_bench() {
+    static const char *names[] = { "scalar", "vector", "avx2" };
+    enum { BATCH = 32 };
+    PowerUDPKey key;
+    uint8_t salt[POWERUDP_SALT_LEN] = { 0 };
+    powerudp_derive_key(POWERUDP_PSK, salt, &key);
+
+    for (int s = 0; s < mac_sizes.n; s++) {
+        unsigned int size = mac_sizes.v[s] < 8 ? 8 : mac_sizes.v[s];
+        unsigned int lens[BATCH];
+        const void *dgrams[BATCH];
+        uint64_t tags[BATCH];
+        char *buf = malloc((size_t)BATCH * size);
+        for (size_t i = 0; i < (size_t)BATCH * size; i++) buf[i] = (char)(i * 131 + 7);
+        for (int i = 0; i < BATCH; i++) {
+            dgrams[i] = buf + (size_t)i * size;
+            lens[i] = size - (i & 7);       // comprimentos mistos, como num lote real
+            if (lens[i] < 8) lens[i] = 8;
+        }
+
+        for (int impl = POWERUDP_MAC_SCALAR; impl <= POWERUDP_MAC_AVX2; impl++) {
+            if (set_mac_impl(impl) != impl) continue;
+            mac_batch(&key, dgrams, lens, BATCH, tags);
+            for (int i = 0; i < BATCH; i++) {
+                if (tags[i] != powerudp_siphash(&key, dgrams[i], lens[i])) {
+                    fprintf(stderr, "MAC %s errado no datagrama %d (%u bytes)\n", names[impl], i, lens[i]);
+                    return 1;
+                }
+            }
+
+            uint64_t batches = 0, t0 = now_us(), t;
+            do {
+                for (int r = 0; r < 64; r++) mac_batch(&key, dgrams, lens, BATCH, tags);
+                batches += 64;
+                t = now_us();
+            } while (t - t0 < 200000);
+            double ns = (t - t0) * 1e3 / (batches * BATCH);
+            fprintf(out, "{\"mac_impl\":\"%s\",\"size\":%u,\"batch\":%d,\"ns_per_pkt\":%.1f,\"mpps\":%.2f,\"gbps\":%.2f}\n",
+                    names[impl], size, BATCH, ns, 1e3 / ns, size * 8 / ns);
+            fflush(out);
+        }
+        free(buf);
+    }
+    set_mac_impl(-1);
+    return 0;
+}
+
+/*
+ * Débito do CRC32C sobre um buffer de cada tamanho, ~200 ms por implementação,
+ * depois de confirmar as duas contra o valor de verificação ("123456789").
+ */
+static int run_crc_bench() {
+    static const char *names[] = { "table", "sse42" };
+    uint32_t (*impls[])(uint32_t, const void *, size_t) = { powerudp_crc32c_table, powerudp_crc32c_sse42 };
+    int nimpls = POWERUDP_CRC_HW() ? 2 : 1;
+
+    for (int k = 0; k < nimpls; k++) {
+        if (impls[k](0, "123456789", 9) != 0xe3069283u) {
+            fprintf(stderr, "CRC32C %s errado\n", names[k]);
+            return 1;
+        }
+    }
+    for (int s = 0; s < crc_sizes.n; s++) {
+        size_t size = crc_sizes.v[s] < 1 ? 1 : (size_t)crc_sizes.v[s];
+        char *buf = malloc(size);
+        for (size_t i = 0; i < size; i++) buf[i] = (char)(i * 131 + 7);
+
+        for (int k = 0; k < nimpls; k++) {
+            volatile uint32_t crc = 0;
+            uint64_t bytes = 0, t0 = now_us(), t;
+            do {
+                for (int r = 0; r < 64; r++) crc = impls[k](crc, buf, size);
+                bytes += 64 * size;
+                t = now_us();
+            } while (t - t0 < 200000);
+            double ns = (t - t0) * 1e3 * size / bytes;
+            fprintf(out, "{\"crc_impl\":\"%s\",\"size\":%zu,\"ns_per_buf\":%.1f,\"gbytes_per_s\":%.2f}\n",
+                    names[k], size, ns, size / ns);
+            fflush(out);
+        }
+        free(buf);
+    }
+    return 0;
+}
+
+/*
+ * Débito de fec_mul_add (dst ^= c * src) por implementação, ~200 ms cada, depois de
+ * confirmar que todas dão o mesmo que a escalar.
+ */
+static int run_gf_bench() {
+    static const char *names[] = { "scalar", "ssse3", "avx2" };
+    for (int s = 0; s < gf_sizes.n; s++) {
+        size_t size = gf_sizes.v[s] < 1 ? 1 : (size_t)gf_sizes.v[s];
+        uint8_t *src = malloc(size), *dst = calloc(size, 1), *ref = calloc(size, 1);
+        for (size_t i = 0; i < size; i++) src[i] = (uint8_t)(i * 131 + 7);
+        set_fec_impl(POWERUDP_FEC_SCALAR);
+        for (int c = 2; c < 256; c += 37) fec_mul_add(ref, src, size, (uint8_t)c);
+
+        for (int impl = POWERUDP_FEC_SCALAR; impl <= POWERUDP_FEC_AVX2; impl++) {
+            if (set_fec_impl(impl) != impl) continue;
+            memset(dst, 0, size);
+            for (int c = 2; c < 256; c += 37) fec_mul_add(dst, src, size, (uint8_t)c);
+            if (memcmp(dst, ref, size) != 0) {
+                fprintf(stderr, "GF(2^8) %s errado (%zu bytes)\n", names[impl], size);
+                return 1;
+            }
+
+            uint64_t bytes = 0, t0 = now_us(), t;
+            do {
+                for (int r = 0; r < 64; r++) fec_mul_add(dst, src, size, (uint8_t)(0x53 + r));
+                bytes += 64 * size;
+                t = now_us();
+            } while (t - t0 < 200000);
+            double ns = (t - t0) * 1e3 * size / bytes;
+            fprintf(out, "{\"gf_impl\":\"%s\",\"size\":%zu,\"ns_per_buf\":%.1f,\"gbytes_per_s\":%.2f}\n",
+                    names[impl], size, ns, size / ns);
+            fflush(out);
+        }
+        free(ref);
+        free(dst);
+        free(src);
+    }
+    set_fec_impl(-1);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    for (int i = 1; i + 1 < argc; i += 2) {
+        if (!strcmp(argv[i], "--sizes")) parse_list(argv[i + 1], &sizes);
+        else if (!strcmp(argv[i], "--loss")) parse_list(argv[i + 1], &losses);
+        else if (!strcmp(argv[i], "--reorder")) parse_list(argv[i + 1], &reorders);
+        else if (!strcmp(argv[i], "--reorder-depth")) reorder_depth = atoi(argv[i + 1]);
+        else if (!strcmp(argv[i], "--configs")) parse_list(argv[i + 1], &configs);
+        else if (!strcmp(argv[i], "--senders")) parse_list(argv[i + 1], &senders);
+        else if (!strcmp(argv[i], "--windows")) parse_list(argv[i + 1], &windows);
+        else if (!strcmp(argv[i], "--ack-delays")) parse_list(argv[i + 1], &ack_delays);
+        else if (!strcmp(argv[i], "--ack-every")) ack_every = atoi(argv[i + 1]);
+        else if (!strcmp(argv[i], "--cc")) parse_list(argv[i + 1], &ccs);
+        else if (!strcmp(argv[i], "--backends")) parse_list(argv[i + 1], &backends);
+        else if (!strcmp(argv[i], "--coalesce")) parse_list(argv[i + 1], &coalesces);
+        else if (!strcmp(argv[i], "--async")) parse_list(argv[i + 1], &asyncs);
+        else if (!strcmp(argv[i], "--auth")) parse_list(argv[i + 1], &auths);
+        else if (!strcmp(argv[i], "--checksum")) parse_list(argv[i + 1], &checksums);
+        else if (!strcmp(argv[i], "--compress")) parse_list(argv[i + 1], &compresses);
+        else if (!strcmp(argv[i], "--random")) parse_list(argv[i + 1], &randoms);
+        else if (!strcmp(argv[i], "--fec")) parse_fec(argv[i + 1], &fecs);
+        else if (!strcmp(argv[i], "--giveup")) parse_list(argv[i + 1], &giveups);
+        else if (!strcmp(argv[i], "--mac-bench")) parse_list(argv[i + 1], &mac_sizes);
+        else if (!strcmp(argv[i], "--crc-bench")) parse_list(argv[i + 1], &crc_sizes);
+        else if (!strcmp(argv[i], "--fec-bench")) parse_list(argv[i + 1], &gf_sizes);
+        else if (!strcmp(argv[i], "--seed")) path.seed = strtoull(argv[i + 1], NULL, 10);
+        else if (!strcmp(argv[i], "--delay")) path.delay_us = atoi(argv[i + 1]);
+        else if (!strcmp(argv[i], "--jitter")) path.jitter_us = atoi(argv[i + 1]);
+        else if (!strcmp(argv[i], "--dup")) path.duplicate_pct = atof(argv[i + 1]);
+        else if (!strcmp(argv[i], "--burst"))
+            sscanf(argv[i + 1], "%lf,%lf,%lf", &path.good_to_bad_pct, &path.bad_to_good_pct, &path.burst_loss_pct);
+        else if (!strcmp(argv[i], "--rate")) path.rate_kbps = atoi(argv[i + 1]);
+        else if (!strcmp(argv[i], "--queue")) path.queue_bytes = atoi(argv[i + 1]);
+        else if (!strcmp(argv[i], "--messages")) messages = atoi(argv[i + 1]);
+        else if (!strcmp(argv[i], "--bytes")) byte_budget = atol(argv[i + 1]);
+        else if (!strcmp(argv[i], "--timeout")) base_timeout = atoi(argv[i + 1]);
+        else if (!strcmp(argv[i], "--retries")) max_retries = atoi(argv[i + 1]);
+        else if (!strcmp(argv[i], "--port")) next_port = atoi(argv[i + 1]);
+        else {
+            fprintf(stderr, "Opção desconhecida: %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    // Os resultados saem pelo stdout original; o motor escreve para o stderr
+    out = fdopen(dup(STDOUT_FILENO), "w");
+    dup2(STDERR_FILENO, STDOUT_FILENO);
+    if (mac_sizes.n) return run_mac_bench();
+    if (crc_sizes.n) return run_crc_bench();
+    if (gf_sizes.n) return run_gf_bench();
+
+    for (int a = 0; a < sizes.n; a++)
+    for (int b = 0; b < losses.n; b++)
+    for (int c = 0; c < configs.n; c++)
+    for (int d = 0; d < senders.n; d++)
+    for (int e = 0; e < windows.n; e++)
+    for (int f = 0; f < ack_delays.n; f++)
+    for (int g = 0; g < reorders.n; g++)
+    for (int h = 0; h < ccs.n; h++)
+    for (int k = 0; k < backends.n; k++)
+    for (int l = 0; l < coalesces.n; l++)
+    for (int m = 0; m < asyncs.n; m++)
+    for (int o = 0; o < auths.n; o++)
+    for (int q = 0; q < checksums.n; q++)
+    for (int r = 0; r < compresses.n; r++)
+    for (int t = 0; t < randoms.n; t++)
+    for (int u = 0; u < fecs.n; u++)
+    for (int w = 0; w < giveups.n; w++) {
+        scenario sc;
+        sc.size = sizes.v[a];
+        sc.loss = losses.v[b];
+        sc.reorder = reorders.v[g];
+        sc.retrans = configs.v[c] / 100 % 10;
+        sc.backoff = configs.v[c] / 10 % 10;
+        sc.seq = configs.v[c] % 10;
+        sc.senders = senders.v[d] < 1 ? 1 : senders.v[d] > 64 ? 64 : senders.v[d];
+        sc.window = windows.v[e];
+        sc.ack_delay = ack_delays.v[f];
+        sc.cc = ccs.v[h];
+        sc.backend = backends.v[k];
+        sc.coalesce = coalesces.v[l];
+        sc.async = asyncs.v[m];
+        sc.auth = auths.v[o];
+        sc.checksum = checksums.v[q];
+        sc.compress = compresses.v[r];
+        sc.random = randoms.v[t];
+        sc.fec_k = fecs.v[u] >> 8;
+        sc.fec_parity = fecs.v[u] & 0xff;
+        sc.giveup = giveups.v[w];
+        sc.messages = messages;
+        if (sc.size > 0 && (long)sc.messages * sc.size > byte_budget)
+            sc.messages = byte_budget / sc.size > sc.senders ? byte_budget / sc.size : sc.senders;
+        run_scenario(&sc);
+    }
+    return 0;
+}
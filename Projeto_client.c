@@ -1,41 +1,170 @@
-#define _DEFAULT_SOURCE
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <arpa/inet.h>
 #include <string.h>
 #include <unistd.h>
 #include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
 #include "POWERUDP_H.h"
 
-#define PORT 1048
+#define PORT POWERUDP_PORT
 #define BUFLEN 512
 #define TMIN 500
-
+#define JANELA_MAX 256      // número máximo de pacotes em voo
+#define JANELA_PADRAO 32
+#define CWND_INICIAL 10     // janela de congestionamento inicial (pacotes)
+#define ACK_CADA 8          // pacotes de dados cobertos no máximo por um ACK
+#define ACK_ATRASO_MS 1     // atraso máximo de um ACK
+#define RTO_MIN_MS 2        // RTO mínimo: um tick do relógio em ms mais o ACK atrasado
+#define ACK_DUPLICADOS 3    // pacotes posteriores confirmados para reenviar um buraco
+#define REORDENACAO 64      // pacotes adiantados guardados na receção (potência de 2)
+#define PEERS_SHARD 64      // capacidade inicial da tabela de peers de cada shard (potência de 2)
+#define PEER_INATIVO_MS 30000   // peers sem pacotes há mais do que isto são esquecidos
+#define MAX_WORKERS 64
+#define GERADORES 8         // emissores do --bench-shards
+
+#define CABECALHO_CRC 1     // envia cabeçalhos v1, com CRC32C (a receção aceita as duas versões)
+#define CABECALHO_LEN (CABECALHO_CRC ? sizeof(PowerUDPHeaderV1) : sizeof(PowerUDPHeader))
+#define PAYLOAD_MAX (BUFLEN - CABECALHO_LEN - POWERUDP_MAC_LEN)
 #define MULTICAST_GROUP "239.0.0.1"
 #define MULTICAST_PORT 9876
 
 int multicast_sock;
 
+// Época da última configuração aceite; as mais antigas ou repetidas são ignoradas
+uint32_t epoca_config = 0;
+int epoca_conhecida = 0;
+unsigned long configs_obsoletas = 0;
+
+/*
+ * Chave dos MACs: derivada da PSK com o sal que o servidor manda a seguir ao "ACK".
+ * Todos os datagramas UDP entre clientes e os multicasts do servidor terminam num
+ * MAC de POWERUDP_MAC_LEN bytes; os que não conferem são descartados e contados.
+ */
+PowerUDPKey chave_sessao;
+atomic_ulong macs_invalidos;
+
+// Datagramas descartados por CRC32C errado, ou por versão/length que não batem com o recebido
+atomic_ulong crcs_invalidos;
+atomic_ulong datagramas_malformados;
+
+// Última configuração conhecida (atualizada pelo multicast do servidor)
+ConfigMessage config_atual = {
+    .enable_retransmission = 1,
+    .enable_backoff = 1,
+    .enable_sequence = 1,
+    .base_timeout = TMIN,
+    .max_retries = 5,
+    .congestion_control = POWERUDP_CC_NEWRENO,
+    .compression = 0,
+    .fec_k = 0,
+    .fec_parity = 1
+};
+
+// Anel de reordenação: o pacote seq fica no slot seq % REORDENACAO até ser a sua vez
 typedef struct {
-    uint32_t seq_num;    
-    uint8_t ack;         
-    uint8_t flags;      
-    uint16_t length;    
-} PowerUDPHeader;
-
-typedef struct 
-{
-    uint8_t enable_retransmission;  
-    uint8_t enable_backoff;         
-    uint8_t enable_sequence;     
-    uint16_t base_timeout;         
-    uint8_t max_retries;      
-} ConfigMessage;
+    char dados[BUFLEN];
+    size_t len;
+    uint32_t seq_num;
+    int ocupado;
+} SlotReordenacao;
+
+// Receção de um peer: um SACK cumulativo atrasado cobre vários pacotes de dados
+typedef struct {
+    struct sockaddr_in origem;
+    uint32_t rx_esperado;
+    int acks_em_divida;
+    long long prazo_ack_ms;
+    long long ultimo_pacote_ms;
+    SlotReordenacao reordenacao[REORDENACAO];
+} PeerRececao;
+
+/*
+ * Shard de receção: um socket e os peers que lhe chegam. No modo multi-core há um
+ * por worker, todos em SO_REUSEPORT na mesma porta; o kernel escolhe o socket pelo
+ * hash de (origem, destino), pelo que cada peer fica sempre no mesmo shard e o seu
+ * estado de sequência só é tocado por uma thread, sem locks. A tabela de peers
+ * cresce quando passa 3/4 de ocupação, e os peers inativos há PEER_INATIVO_MS
+ * são removidos (antes de crescer e numa varredura periódica).
+ */
+typedef struct {
+    int sockfd;
+    int cpu;                            // core do worker (-1 = thread principal)
+    pthread_t thread;
+    PeerRececao **peers;                // hash com sondagem linear, cap entradas
+    int cap, num_peers;
+    long long proxima_limpeza_ms;
+    unsigned long pacotes;              // pacotes de dados tratados
+    unsigned long entregues;
+    unsigned long sem_estado;           // pacotes descartados por falta de memória para o peer
+    unsigned long peers_expirados;
+} ShardRececao;
+
+atomic_int parar_workers;
+int rececao_verbosa = 1;    // o --bench-shards desliga as mensagens por pacote
+
+typedef struct {
+    char dados[BUFLEN];
+    size_t len;
+    uint32_t seq_num;
+    int tentativas;
+    int ocupado;
+    int confirmado;
+    int reenvio_rapido;
+    long long prazo_ms;     // instante (CLOCK_MONOTONIC) do próximo reenvio
+    long long enviado_us;   // última transmissão, para a amostra de RTT
+} SlotJanela;
+
+typedef struct {
+    int sockfd;
+    struct sockaddr_in dest;
+    int tamanho;            // pacotes em voo permitidos (<= JANELA_MAX)
+    uint32_t cwnd;          // janela de congestionamento (AIMD), limita tamanho
+    uint32_t cwnd_acc;
+    uint32_t ssthresh;
+    uint32_t recuperacao;   // perdas antes deste seq já reduziram a janela
+    long long srtt_us;      // RTT suavizado (0 = ainda sem amostras)
+    long long rttvar_us;
+    uint32_t base;          // seq mais antigo ainda por confirmar
+    uint32_t proximo_seq;   // seq a atribuir ao próximo pacote
+    int salto_pendente;     // o recetor ainda pode estar parado em [salto_inicio, salto_fim)
+    uint32_t salto_inicio, salto_fim;
+    SlotJanela slots[JANELA_MAX];
+} JanelaEnvio;
 
 struct RegisterMessage {
     char psk[64]; // Chave pré-definida para autenticação
 };
 
+/*
+ * Cache local do diretório de peers do servidor: tabela de hash por nome (FNV-1a)
+ * com sondagem linear e remoção por deslocamento para trás, pelo que resolver um
+ * nome antes de cada envio é O(1). Começa com o snapshot recebido por TCP no
+ * registo e segue os deltas do multicast; um salto de versão pede outro snapshot.
+ */
+#define DIRETORIO_CAP_INICIAL 64
+
+typedef struct {
+    PeerEntry peer;             // peer.name[0] == '\0' = slot livre
+    JanelaEnvio *janela;        // envio direto para o peer, criada no primeiro envio
+} EntradaDiretorio;
+
+typedef struct {
+    EntradaDiretorio *slots;
+    size_t cap, count;
+    uint32_t versao;
+    int sincronizado;           // já recebeu um snapshot
+    int snapshot_pedido;        // pediu um snapshot depois de um salto de versão
+    unsigned long deltas, lacunas;
+} DiretorioPeers;
+
+DiretorioPeers diretorio;
+
 void configurar_socket_multicast() {
     struct sockaddr_in addr;
     struct ip_mreq mreq;
@@ -72,170 +201,735 @@ void configurar_socket_multicast() {
     printf("[INFO] Socket multicast configurado.\n");
 }
 
-int ler_header(int sockfd, char *buffer, struct sockaddr_in *src, socklen_t *addrlen, PowerUDPHeader *header) {
-    ssize_t len = recvfrom(sockfd, buffer, 1024, 0, (struct sockaddr *)src, addrlen);
-    if (len < sizeof(PowerUDPHeader)) return -1;
-    
+/*
+ * Valida um datagrama recebido (len bytes, com o MAC): MAC, versão do cabeçalho,
+ * length igual ao que sobra e, na versão 1, o CRC32C. Devolve o deslocamento do
+ * payload, com header em host byte order, ou -1.
+ */
+int valida_datagrama(const char *buffer, ssize_t len, PowerUDPHeader *header) {
+    if (len < (ssize_t)(sizeof(PowerUDPHeader) + POWERUDP_MAC_LEN)) {
+        datagramas_malformados++;
+        return -1;
+    }
+    if ((len = powerudp_mac_check(&chave_sessao, buffer, len)) < 0) {
+        macs_invalidos++;
+        return -1;
+    }
+
     memcpy(header, buffer, sizeof(PowerUDPHeader));
     header->seq_num = ntohl(header->seq_num);
     header->length = ntohs(header->length);
-    return len;
+    int versao = header->flags & POWERUDP_FLAG_VERSION;
+    ssize_t cab = versao == POWERUDP_HEADER_V1 ? (ssize_t)sizeof(PowerUDPHeaderV1) : (ssize_t)sizeof(PowerUDPHeader);
+    if ((versao != 0 && versao != POWERUDP_HEADER_V1) || len < cab || header->length != len - cab) {
+        datagramas_malformados++;
+        return -1;
+    }
+    if (versao == POWERUDP_HEADER_V1) {
+        PowerUDPHeaderV1 v1;
+        memcpy(&v1, buffer, sizeof(v1));
+        uint32_t esperado = ntohl(v1.crc32c);
+        v1.crc32c = 0;
+        uint32_t crc = powerudp_crc32c(0, &v1, sizeof(v1));
+        if (powerudp_crc32c(crc, buffer + cab, header->length) != esperado) {
+            crcs_invalidos++;
+            return -1;
+        }
+    }
+    header->flags &= ~POWERUDP_FLAG_VERSION;
+    return cab;
 }
 
-void envia_powerudp(int sockfd, struct sockaddr_in *dest, const char *dados, uint32_t seq_num) {
-    PowerUDPHeader header;
-    header.seq_num = htonl(seq_num);
-    header.ack = 0;
-    header.flags = 0;
-    header.length = htons(strlen(dados));
+// Devolve o deslocamento do payload em buffer, ou -1 (datagrama inválido)
+int ler_header(int sockfd, char *buffer, struct sockaddr_in *src, socklen_t *addrlen, PowerUDPHeader *header) {
+    ssize_t len = recvfrom(sockfd, buffer, BUFLEN, 0, (struct sockaddr *)src, addrlen);
+    return valida_datagrama(buffer, len, header);
+}
+
+// Cabeçalho, payload e MAC em buffer (com espaço para tudo); devolve o tamanho do datagrama
+size_t monta_datagrama(char *buffer, uint32_t seq_num, uint8_t ack, uint8_t flags, const void *dados, size_t dados_len) {
+    PowerUDPHeaderV1 header;
+    header.base.seq_num = htonl(seq_num);
+    header.base.ack = ack;
+    header.base.flags = flags | (CABECALHO_CRC ? POWERUDP_HEADER_V1 : 0);
+    header.base.length = htons(dados_len);
+    header.crc32c = 0;
+    header.reserved = 0;
+    if (CABECALHO_CRC) {
+        uint32_t crc = powerudp_crc32c(0, &header, sizeof(header));
+        header.crc32c = htonl(powerudp_crc32c(crc, dados, dados_len));
+    }
 
+    memcpy(buffer, &header, CABECALHO_LEN);
+    if (dados_len > 0) memcpy(buffer + CABECALHO_LEN, dados, dados_len);
+    powerudp_mac_put(&chave_sessao, buffer, CABECALHO_LEN + dados_len);
+    return CABECALHO_LEN + dados_len + POWERUDP_MAC_LEN;
+}
+
+void envia_powerudp_binario(int sockfd, struct sockaddr_in *dest, const void *dados, size_t dados_len, uint32_t seq_num, uint8_t flags) {
     char buffer[BUFLEN];
-    memcpy(buffer, &header, sizeof(header));
-    memcpy(buffer + sizeof(header), dados, strlen(dados));
+    size_t len = monta_datagrama(buffer, seq_num, 0, flags, dados, dados_len);
+    sendto(sockfd, buffer, len, 0, (struct sockaddr *)dest, sizeof(*dest));
+}
+
+void envia_powerudp(int sockfd, struct sockaddr_in *dest, const char *dados, uint32_t seq_num) {
+    envia_powerudp_binario(sockfd, dest, dados, strlen(dados), seq_num, 0);
+}
 
-    sendto(sockfd, buffer, sizeof(header) + strlen(dados), 0, (struct sockaddr *)dest, sizeof(*dest));
+/*
+ * Janela deslizante (selective repeat).
+ * Cada pacote ocupa o slot seq_num % JANELA_MAX e tem o seu próprio temporizador;
+ * só os pacotes expirados são reenviados. A base avança quando o pacote mais antigo
+ * é confirmado, libertando espaço para novos envios.
+ */
+void janela_init(JanelaEnvio *janela, int sockfd, struct sockaddr_in *dest, int tamanho, uint32_t seq_inicial) {
+    memset(janela, 0, sizeof(*janela));
+    if (tamanho < 1) tamanho = 1;
+    if (tamanho > JANELA_MAX) tamanho = JANELA_MAX;
+
+    janela->sockfd = sockfd;
+    janela->dest = *dest;
+    janela->tamanho = tamanho;
+    janela->cwnd = CWND_INICIAL;
+    janela->ssthresh = JANELA_MAX;
+    janela->recuperacao = seq_inicial;
+    janela->base = seq_inicial;
+    janela->proximo_seq = seq_inicial;
 }
 
-void envia_powerudp_confiavel(int sockfd, struct sockaddr_in *dest, const char *dados, uint32_t seq_num) {
-    int tentativas = 0;
-    int ack_recebido = 0;
-    socklen_t addrlen = sizeof(*dest);
-    ConfigMessage config;
+// Pacotes em voo permitidos agora: min(tamanho, cwnd) com controlo de congestionamento
+static uint32_t janela_efetiva(JanelaEnvio *janela) {
+    if (config_atual.congestion_control == POWERUDP_CC_NONE || janela->cwnd >= (uint32_t)janela->tamanho)
+        return janela->tamanho;
+    return janela->cwnd;
+}
 
-    struct timeval timeout;
+// Slow start até ssthresh, depois um pacote a mais por janela confirmada
+static void janela_cresce(JanelaEnvio *janela) {
+    if (janela->cwnd < janela->ssthresh) janela->cwnd++;
+    else if (++janela->cwnd_acc >= janela->cwnd) {
+        janela->cwnd++;
+        janela->cwnd_acc = 0;
+    }
+    if (janela->cwnd > JANELA_MAX) janela->cwnd = JANELA_MAX;
+}
 
-    while (tentativas < config.max_retries && !ack_recebido) {
-        envia_powerudp(sockfd, dest, dados, seq_num);
+// Reduz uma vez por janela de perdas; um timeout recomeça de um pacote
+static void janela_perda(JanelaEnvio *janela, uint32_t seq, int timeout) {
+    if (!timeout && (int32_t)(seq - janela->recuperacao) < 0) return;
+    janela->ssthresh = janela->cwnd / 2 < 2 ? 2 : janela->cwnd / 2;
+    janela->cwnd = timeout ? 1 : janela->ssthresh;
+    janela->cwnd_acc = 0;
+    janela->recuperacao = janela->proximo_seq;
+}
 
-        timeout.tv_sec = 0;
-        timeout.tv_usec = TMIN * 1000 * (1 << tentativas);
-        setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+static long long agora_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-        char buffer[1024];
-        struct sockaddr_in src;
-        PowerUDPHeader header;
+static long long agora_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
 
-        ssize_t len = ler_header(sockfd, buffer, &src, &addrlen, &header);
+/*
+ * RTO da janela (RFC 6298): SRTT + 4 * RTTVAR, com amostras só de pacotes que não
+ * foram retransmitidos (regra de Karn). Enquanto não há amostras usa-se o
+ * base_timeout da configuração; tal como no motor, o RTO nunca excede
+ * base_timeout * max_retries, nem com backoff.
+ */
+static long long janela_rto_max_ms() {
+    long long base = config_atual.base_timeout ? config_atual.base_timeout : TMIN;
+    return base * (config_atual.max_retries ? config_atual.max_retries : 1);
+}
 
-        if (len > 0) {
-            if (header.ack == 1 && header.seq_num == seq_num) {
-                printf("ACK recebido para seq=%u\n", seq_num);
-                ack_recebido = 1;
-            } else if (header.ack == 2) {
-                printf("NAK recebido! Reenviando...\n");
-            }
-        } else {
-            printf("Timeout: tentativa %d\n", tentativas + 1);
+static long long janela_rto_ms(JanelaEnvio *janela) {
+    if (!janela->srtt_us) return config_atual.base_timeout ? config_atual.base_timeout : TMIN;
+
+    long long rto = (janela->srtt_us + 4 * janela->rttvar_us + 999) / 1000;
+    if (rto < RTO_MIN_MS) rto = RTO_MIN_MS;
+    if (rto > janela_rto_max_ms()) rto = janela_rto_max_ms();
+    return rto;
+}
+
+static void janela_amostra_rtt(JanelaEnvio *janela, long long rtt) {
+    if (rtt < 1) rtt = 1;
+    if (!janela->srtt_us) {
+        janela->srtt_us = rtt;
+        janela->rttvar_us = rtt / 2;
+        return;
+    }
+    long long err = rtt > janela->srtt_us ? rtt - janela->srtt_us : janela->srtt_us - rtt;
+    janela->rttvar_us = (3 * janela->rttvar_us + err) / 4;
+    janela->srtt_us = (7 * janela->srtt_us + rtt) / 8;
+}
+
+static long long janela_timeout_ms(JanelaEnvio *janela, int tentativas) {
+    long long rto = janela_rto_ms(janela);
+    if (!config_atual.enable_backoff) return rto;
+    rto <<= (tentativas < 10 ? tentativas : 10);
+    return rto < janela_rto_max_ms() ? rto : janela_rto_max_ms();
+}
+
+static void janela_confirma(JanelaEnvio *janela, SlotJanela *slot) {
+    if (slot->confirmado) return;
+    slot->confirmado = 1;
+    if (slot->tentativas == 1) janela_amostra_rtt(janela, agora_us() - slot->enviado_us);
+}
+
+static void janela_transmite(JanelaEnvio *janela, SlotJanela *slot) {
+    // Retransmissões e o pacote que enche a janela pedem ACK imediato ao recetor
+    uint8_t flags = 0;
+    if (slot->tentativas > 0 || janela->proximo_seq - janela->base >= janela_efetiva(janela))
+        flags = POWERUDP_FLAG_ACK_NOW;
+    slot->enviado_us = agora_us();
+    envia_powerudp_binario(janela->sockfd, &janela->dest, slot->dados, slot->len, slot->seq_num, flags);
+    slot->tentativas++;
+    slot->prazo_ms = slot->enviado_us / 1000 + janela_timeout_ms(janela, slot->tentativas - 1);
+}
+
+void envia_salto(int sockfd, struct sockaddr_in *dest, uint32_t inicio, uint32_t fim);
+
+static void janela_envia_salto(JanelaEnvio *janela) {
+    envia_salto(janela->sockfd, &janela->dest, janela->salto_inicio, janela->salto_fim);
+}
+
+/*
+ * Um pacote esgotou as tentativas: a janela desiste de tudo o que tem em voo e
+ * recomeça em proximo_seq, e o recetor recebe um salto (ack == 5) para deixar de
+ * esperar por esses seq. Enquanto os SACKs o mostrarem parado antes de salto_fim o
+ * salto é repetido; uma nova desistência antes disso estende o mesmo intervalo.
+ */
+static void janela_desiste(JanelaEnvio *janela) {
+    if (!janela->salto_pendente) janela->salto_inicio = janela->base;
+    janela->salto_fim = janela->proximo_seq;
+    janela->salto_pendente = 1;
+    for (uint32_t seq = janela->base; seq != janela->proximo_seq; seq++)
+        janela->slots[seq % JANELA_MAX].ocupado = 0;
+    janela->base = janela->proximo_seq;
+    janela->recuperacao = janela->proximo_seq;
+    janela_envia_salto(janela);
+}
+
+static void janela_avanca_base(JanelaEnvio *janela) {
+    while (janela->base != janela->proximo_seq) {
+        SlotJanela *slot = &janela->slots[janela->base % JANELA_MAX];
+        if (!slot->confirmado) break;
+        slot->ocupado = 0;
+        janela->base++;
+        janela_cresce(janela);
+    }
+}
+
+static int sack_bit(const PowerUDPSack *sack, int i) {
+    return sack->bitmap[i / 8] >> (i % 8) & 1;
+}
+
+/*
+ * SACK: tudo antes de cumulativo chegou, mais os seq marcados no mapa. Um buraco
+ * só é reenviado já quando há ACK_DUPLICADOS pacotes posteriores confirmados;
+ * os outros ficam para o temporizador.
+ */
+static void janela_trata_sack(JanelaEnvio *janela, uint32_t cumulativo, const PowerUDPSack *sack) {
+    uint32_t em_voo = janela->proximo_seq - janela->base;
+    if (janela->salto_pendente) {
+        if ((int32_t)(cumulativo - janela->salto_fim) >= 0) {
+            janela->salto_pendente = 0;
+        } else if ((int32_t)(cumulativo - janela->salto_inicio) >= 0) {
+            janela_envia_salto(janela);     // o recetor não viu o salto: repete-o
+            return;
+        }
+    }
+    if (cumulativo - janela->base > em_voo) return;     // SACK antigo
+
+    for (uint32_t seq = janela->base; seq != cumulativo; seq++)
+        janela_confirma(janela, &janela->slots[seq % JANELA_MAX]);
+
+    int posteriores = 0;
+    for (int i = 0; i < POWERUDP_SACK_BITS; i++) {
+        uint32_t seq = cumulativo + 1 + i;
+        if (seq - janela->base >= em_voo) break;
+        if (sack_bit(sack, i)) {
+            janela_confirma(janela, &janela->slots[seq % JANELA_MAX]);
+            posteriores++;
+        }
+    }
+
+    for (uint32_t seq = cumulativo; posteriores >= ACK_DUPLICADOS && seq != janela->proximo_seq; seq++) {
+        SlotJanela *slot = &janela->slots[seq % JANELA_MAX];
+        if (seq != cumulativo && sack_bit(sack, seq - cumulativo - 1)) {
+            posteriores--;
+            continue;
+        }
+        if (!slot->confirmado && !slot->reenvio_rapido && config_atual.enable_retransmission) {
+            printf("SACK: buraco em seq=%u, a reenviar...\n", seq);
+            slot->reenvio_rapido = 1;
+            janela_perda(janela, seq, 0);
+            janela_transmite(janela, slot);
+        }
+    }
+    janela_avanca_base(janela);
+}
+
+static void janela_trata_header(JanelaEnvio *janela, PowerUDPHeader *header, const char *payload) {
+    uint32_t em_voo = janela->proximo_seq - janela->base;
+
+    if (header->ack == 3) {
+        if (header->length >= sizeof(PowerUDPSack))
+            janela_trata_sack(janela, header->seq_num, (const PowerUDPSack *)payload);
+        return;
+    }
+    if (header->seq_num - janela->base >= em_voo) return;   // fora da janela (duplicado/antigo)
+    SlotJanela *slot = &janela->slots[header->seq_num % JANELA_MAX];
+
+    if (header->ack == 1) {
+        janela_confirma(janela, slot);
+        janela_avanca_base(janela);
+    } else if (header->ack == 2) {
+        // O recetor descartou este pacote por estar à espera de um anterior:
+        // reenvia de imediato o mais antigo por confirmar (uma vez por slot).
+        SlotJanela *mais_antigo = &janela->slots[janela->base % JANELA_MAX];
+        if (!mais_antigo->confirmado && !mais_antigo->reenvio_rapido) {
+            printf("NAK recebido para seq=%u! Reenviando seq=%u...\n", header->seq_num, mais_antigo->seq_num);
+            mais_antigo->reenvio_rapido = 1;
+            janela_perda(janela, mais_antigo->seq_num, 0);
+            janela_transmite(janela, mais_antigo);
+        }
+    }
+}
+
+/*
+ * Espera até timeout_ms por ACKs/NAKs, processa todos os que estiverem disponíveis
+ * e reenvia os pacotes cujo temporizador expirou.
+ * Devolve -1 se algum pacote esgotou as tentativas (a janela desiste deles e
+ * continua utilizável para os envios seguintes).
+ */
+int janela_processa(JanelaEnvio *janela, int timeout_ms) {
+    struct pollfd pfd = { .fd = janela->sockfd, .events = POLLIN };
+    char buffer[BUFLEN];
+    struct sockaddr_in src;
+    socklen_t addrlen;
+    PowerUDPHeader header;
+
+    while (poll(&pfd, 1, timeout_ms) > 0) {
+        addrlen = sizeof(src);
+        int payload = ler_header(janela->sockfd, buffer, &src, &addrlen, &header);
+        if (payload > 0)
+            janela_trata_header(janela, &header, buffer + payload);
+        timeout_ms = 0;     // drena o que já chegou sem voltar a bloquear
+    }
+
+    long long agora = agora_ms();
+    for (uint32_t seq = janela->base; seq != janela->proximo_seq; seq++) {
+        SlotJanela *slot = &janela->slots[seq % JANELA_MAX];
+        if (slot->confirmado || slot->prazo_ms > agora) continue;
+
+        if (!config_atual.enable_retransmission || slot->tentativas >= config_atual.max_retries) {
+            printf("Erro: não foi possível confirmar entrega de seq=%u após %d tentativas\n",
+                   seq, slot->tentativas);
+            janela_desiste(janela);
+            return -1;
         }
+        printf("Timeout: seq=%u tentativa %d\n", seq, slot->tentativas + 1);
+        janela_perda(janela, seq, 1);
+        janela_transmite(janela, slot);
+    }
+    return 0;
+}
 
-        tentativas++;
+static int janela_proximo_prazo_ms(JanelaEnvio *janela) {
+    long long prazo = -1;
+    for (uint32_t seq = janela->base; seq != janela->proximo_seq; seq++) {
+        SlotJanela *slot = &janela->slots[seq % JANELA_MAX];
+        if (!slot->confirmado && (prazo < 0 || slot->prazo_ms < prazo)) prazo = slot->prazo_ms;
     }
+    if (prazo < 0) return 0;
+    long long espera = prazo - agora_ms();
+    return espera > 0 ? (int)espera : 0;
+}
 
-    if (!ack_recebido) {
-        printf("Erro: não foi possível confirmar entrega após %d tentativas\n", config.max_retries);
+/*
+ * Coloca um pacote em voo. Só bloqueia (a processar ACKs) quando a janela está cheia.
+ */
+int envia_powerudp_confiavel_binario(JanelaEnvio *janela, const void *dados, size_t dados_len) {
+    if (dados_len > PAYLOAD_MAX) {
+        fprintf(stderr, "Erro: mensagem demasiado grande (%zu bytes)\n", dados_len);
+        return -1;
     }
+
+    while (janela->proximo_seq - janela->base >= janela_efetiva(janela)) {
+        if (janela_processa(janela, janela_proximo_prazo_ms(janela)) < 0) return -1;
+    }
+
+    SlotJanela *slot = &janela->slots[janela->proximo_seq % JANELA_MAX];
+    memcpy(slot->dados, dados, dados_len);
+    slot->len = dados_len;
+    slot->seq_num = janela->proximo_seq++;
+    slot->tentativas = 0;
+    slot->ocupado = 1;
+    slot->confirmado = 0;
+    slot->reenvio_rapido = 0;
+    janela_transmite(janela, slot);
+
+    // Aproveita ACKs que já tenham chegado sem bloquear
+    return janela_processa(janela, 0);
+}
+
+int envia_powerudp_confiavel(JanelaEnvio *janela, const char *dados) {
+    return envia_powerudp_confiavel_binario(janela, dados, strlen(dados));
 }
 
+/*
+ * Bloqueia até todos os pacotes em voo estarem confirmados.
+ */
+int janela_flush(JanelaEnvio *janela) {
+    while (janela->base != janela->proximo_seq) {
+        if (janela_processa(janela, janela_proximo_prazo_ms(janela)) < 0) return -1;
+    }
+    return 0;
+}
 
 void envia_acknak(int sockfd, struct sockaddr_in *dest, uint32_t seq_num, uint8_t tipo);
+void envia_sack(int sockfd, struct sockaddr_in *dest, uint32_t cumulativo, const PowerUDPSack *sack);
+
+static unsigned int peer_hash(const struct sockaddr_in *addr, int cap) {
+    uint32_t h = addr->sin_addr.s_addr * 2654435761u ^ addr->sin_port * 40503u;
+    return (h ^ h >> 16) & (cap - 1);
+}
+
+static unsigned int peer_slot(ShardRececao *shard, const struct sockaddr_in *src) {
+    unsigned int mask = shard->cap - 1, i = peer_hash(src, shard->cap);
+    while (shard->peers[i] && (shard->peers[i]->origem.sin_addr.s_addr != src->sin_addr.s_addr ||
+                               shard->peers[i]->origem.sin_port != src->sin_port))
+        i = (i + 1) & mask;
+    return i;
+}
+
+static int shard_crescer(ShardRececao *shard) {
+    PeerRececao **antigos = shard->peers;
+    int cap_antiga = shard->cap;
+    int cap = cap_antiga ? cap_antiga * 2 : PEERS_SHARD;
+
+    PeerRececao **novos = calloc(cap, sizeof(*novos));
+    if (!novos) return -1;
+    shard->peers = novos;
+    shard->cap = cap;
+    for (int i = 0; i < cap_antiga; i++) {
+        if (antigos[i]) shard->peers[peer_slot(shard, &antigos[i]->origem)] = antigos[i];
+    }
+    free(antigos);
+    return 0;
+}
+
+// Liberta o peer do slot i e desloca para trás os seguintes da mesma sequência de sondagem
+static void shard_remover(ShardRececao *shard, unsigned int i) {
+    unsigned int mask = shard->cap - 1;
+
+    free(shard->peers[i]);
+    for (unsigned int j = (i + 1) & mask; shard->peers[j]; j = (j + 1) & mask) {
+        unsigned int casa = peer_hash(&shard->peers[j]->origem, shard->cap);
+        if (((j - casa) & mask) >= ((j - i) & mask)) {
+            shard->peers[i] = shard->peers[j];
+            i = j;
+        }
+    }
+    shard->peers[i] = NULL;
+    shard->num_peers--;
+}
+
+// Esquece os peers sem pacotes há PEER_INATIVO_MS e sem ACK em dívida
+static void shard_expirar(ShardRececao *shard, long long agora) {
+    for (int i = 0; i < shard->cap; i++) {
+        // A remoção pode trazer para o slot i um peer ainda por ver: volta a olhar para ele
+        while (shard->peers[i] && !shard->peers[i]->acks_em_divida &&
+               agora - shard->peers[i]->ultimo_pacote_ms > PEER_INATIVO_MS) {
+            shard_remover(shard, i);
+            shard->peers_expirados++;
+        }
+    }
+    shard->proxima_limpeza_ms = agora + PEER_INATIVO_MS / 4;
+}
+
+// Estado de receção do peer (criado na primeira vez); NULL só sem memória
+static PeerRececao *shard_peer(ShardRececao *shard, const struct sockaddr_in *src) {
+    if (shard->cap) {
+        PeerRececao *peer = shard->peers[peer_slot(shard, src)];
+        if (peer) return peer;
+    }
 
+    if ((shard->num_peers + 1) * 4 > shard->cap * 3) {
+        shard_expirar(shard, agora_ms());
+        if ((shard->num_peers + 1) * 4 > shard->cap * 3 && shard_crescer(shard) < 0 &&
+            shard->num_peers + 1 >= shard->cap)
+            return NULL;
+    }
+    PeerRececao *peer = calloc(1, sizeof(*peer));
+    if (!peer) return NULL;
+    peer->origem = *src;
+    shard->peers[peer_slot(shard, src)] = peer;
+    shard->num_peers++;
+    return peer;
+}
+
+// Envia o SACK em dívida: ACK cumulativo mais o mapa dos pacotes já guardados no anel
+void recebe_envia_ack(int sockfd, PeerRececao *peer) {
+    PowerUDPSack sack;
+
+    if (!peer->acks_em_divida) return;
+    memset(&sack, 0, sizeof(sack));
+    for (int i = 0; i < POWERUDP_SACK_BITS; i++) {
+        uint32_t seq = peer->rx_esperado + 1 + i;
+        SlotReordenacao *slot = &peer->reordenacao[seq % REORDENACAO];
+        if (slot->ocupado && slot->seq_num == seq) sack.bitmap[i / 8] |= 1u << (i % 8);
+    }
+    envia_sack(sockfd, &peer->origem, peer->rx_esperado, &sack);
+    peer->acks_em_divida = 0;
+}
+
+// Tempo até o primeiro ACK atrasado do shard ter de sair (-1 = nenhum em dívida)
+int recebe_espera_ack_ms(ShardRececao *shard) {
+    long long prazo = -1;
+    for (int i = 0; i < shard->cap; i++) {
+        PeerRececao *peer = shard->peers[i];
+        if (peer && peer->acks_em_divida && (prazo < 0 || peer->prazo_ack_ms < prazo)) prazo = peer->prazo_ack_ms;
+    }
+    if (prazo < 0) return -1;
+    long long espera = prazo - agora_ms();
+    return espera > 0 ? (int)espera : 0;
+}
 
-void recebe_powerudp_com_ack(int sockfd) {
-    char buffer[BUFLEN], dados[BUFLEN];;
+void recebe_envia_acks_vencidos(ShardRececao *shard) {
+    long long agora = agora_ms();
+    for (int i = 0; i < shard->cap; i++) {
+        PeerRececao *peer = shard->peers[i];
+        if (peer && peer->acks_em_divida && peer->prazo_ack_ms <= agora) recebe_envia_ack(shard->sockfd, peer);
+    }
+    if (agora >= shard->proxima_limpeza_ms) shard_expirar(shard, agora);
+}
+
+static void recebe_entrega(ShardRececao *shard, uint32_t seq_num, const char *dados, size_t len) {
+    shard->entregues++;
+    if (!rececao_verbosa) return;
+
+    char texto[BUFLEN];
+    memcpy(texto, dados, len);
+    texto[len] = '\0';
+    printf("Recebido seq=%u: %s\n", seq_num, texto);
+}
+
+// Liberta a série contígua que estava à espera de rx_esperado
+static void recebe_liberta_serie(ShardRececao *shard, PeerRececao *peer) {
+    for (;;) {
+        SlotReordenacao *slot = &peer->reordenacao[peer->rx_esperado % REORDENACAO];
+        if (!slot->ocupado || slot->seq_num != peer->rx_esperado) break;
+        recebe_entrega(shard, slot->seq_num, slot->dados, slot->len);
+        slot->ocupado = 0;
+        peer->rx_esperado++;
+    }
+}
+
+/*
+ * Salto [inicio, fim): o emissor desistiu destes seq. Se a receção está parada no
+ * intervalo passa para fim; o que já estava guardado no anel dentro dele foi
+ * confirmado por SACK e é entregue pela ordem em vez de descartado. Confirma
+ * sempre, para o emissor deixar de repetir o salto.
+ */
+static void recebe_salto(ShardRececao *shard, const struct sockaddr_in *src, uint32_t inicio, uint32_t fim) {
+    PeerRececao *peer = shard_peer(shard, src);
+    if (!peer) return;
+    peer->ultimo_pacote_ms = agora_ms();
+
+    if ((int32_t)(peer->rx_esperado - inicio) >= 0 && (int32_t)(fim - peer->rx_esperado) > 0) {
+        if (rececao_verbosa) printf("Salto: o emissor desistiu de seq=%u..%u\n", peer->rx_esperado, fim - 1);
+        uint32_t n = fim - peer->rx_esperado < REORDENACAO ? fim - peer->rx_esperado : REORDENACAO;
+        for (uint32_t i = 0; i < n; i++) {
+            SlotReordenacao *slot = &peer->reordenacao[(peer->rx_esperado + i) % REORDENACAO];
+            if (!slot->ocupado || slot->seq_num - peer->rx_esperado >= fim - peer->rx_esperado) continue;
+            recebe_entrega(shard, slot->seq_num, slot->dados, slot->len);
+            slot->ocupado = 0;
+        }
+        peer->rx_esperado = fim;
+        recebe_liberta_serie(shard, peer);
+    }
+    peer->acks_em_divida = 1;
+    recebe_envia_ack(shard->sockfd, peer);
+}
+
+/*
+ * Os pacotes que chegam adiantados ficam no anel de reordenação do peer e são
+ * entregues pela ordem de seq logo que o buraco à frente deles é preenchido.
+ * Duplicados (já entregues ou já guardados) são descartados e voltam a ser confirmados.
+ */
+void recebe_powerudp_com_ack(ShardRececao *shard) {
+    char buffer[BUFLEN];
     struct sockaddr_in src;
     PowerUDPHeader header;
     socklen_t srclen = sizeof(src);
-    static uint32_t expected_seq = 0;
+    int sockfd = shard->sockfd;
 
     ssize_t len = recvfrom(sockfd, buffer, sizeof(buffer), 0, (struct sockaddr *)&src, &srclen);
-
-    memcpy(&header, buffer, sizeof(header));
-    header.seq_num = ntohl(header.seq_num);
-    header.length = ntohs(header.length);
-
-    if (header.seq_num != expected_seq) {
-        printf("Fora de ordem. Esperado: %u, recebido: %u\n", expected_seq, header.seq_num);
-        envia_acknak(sockfd, &src, header.seq_num, 2); 
+    int payload = valida_datagrama(buffer, len, &header);
+    if (payload < 0) return;
+    if (header.ack == 5 && header.length == sizeof(PowerUDPSkip)) {
+        PowerUDPSkip salto;
+        memcpy(&salto, buffer + payload, sizeof(salto));
+        recebe_salto(shard, &src, header.seq_num, ntohl(salto.end));
         return;
     }
+    if (header.ack != 0) return;
+    const char *dados = buffer + payload;
+
+    PeerRececao *peer = shard_peer(shard, &src);
+    if (!peer) {
+        // Sem estado não há ACK: o emissor reenvia e acaba por desistir
+        if (shard->sem_estado++ == 0) fprintf(stderr, "Sem memória para o peer %s:%u\n",
+                                              inet_ntoa(src.sin_addr), ntohs(src.sin_port));
+        return;
+    }
+    shard->pacotes++;
+    peer->ultimo_pacote_ms = agora_ms();
+    if (peer->acks_em_divida++ == 0) peer->prazo_ack_ms = peer->ultimo_pacote_ms + ACK_ATRASO_MS;
+
+    int32_t diff = (int32_t)(header.seq_num - peer->rx_esperado);
+    SlotReordenacao *slot = &peer->reordenacao[header.seq_num % REORDENACAO];
+    if (diff < 0 || (slot->ocupado && slot->seq_num == header.seq_num)) {
+        if (rececao_verbosa) printf("Duplicado seq=%u ignorado\n", header.seq_num);
+        recebe_envia_ack(sockfd, peer);
+        return;
+    }
+    if (diff > 0) {
+        if (diff < REORDENACAO) {
+            if (rececao_verbosa)
+                printf("Fora de ordem: seq=%u guardado (à espera de %u)\n", header.seq_num, peer->rx_esperado);
+            memcpy(slot->dados, dados, header.length);
+            slot->len = header.length;
+            slot->seq_num = header.seq_num;
+            slot->ocupado = 1;
+        } else if (rececao_verbosa) {
+            printf("Fora de ordem: seq=%u além do anel, descartado\n", header.seq_num);
+        }
+        recebe_envia_ack(sockfd, peer);
+        return;
+    }
+
+    recebe_entrega(shard, header.seq_num, dados, header.length);
+    peer->rx_esperado++;
+    recebe_liberta_serie(shard, peer);
+
+    if ((header.flags & POWERUDP_FLAG_ACK_NOW) || peer->acks_em_divida >= ACK_CADA)
+        recebe_envia_ack(sockfd, peer);
+}
 
-    envia_acknak(sockfd, &src, header.seq_num, 1);
+// Socket UDP em SO_REUSEPORT: todos os do grupo partilham a porta e o kernel reparte os peers
+int criar_socket_shard(int porta) {
+    struct sockaddr_in addr;
+    int sockfd, reuse = 1;
 
-    memcpy(dados, buffer + sizeof(header), header.length);
-    dados[header.length] = '\0';
+    if ((sockfd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) return -1;
+    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) < 0) {
+        close(sockfd);
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(porta);
+    if (bind(sockfd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(sockfd);
+        return -1;
+    }
+    return sockfd;
+}
 
-    printf("Recebido seq=%u: %s\n", header.seq_num, dados);
-    expected_seq++;
+static void *worker_rececao(void *arg) {
+    ShardRececao *shard = arg;
+    cpu_set_t cpus;
+
+    CPU_ZERO(&cpus);
+    CPU_SET(shard->cpu, &cpus);
+    int err = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    if (err) fprintf(stderr, "pthread_setaffinity_np (core %d): %s\n", shard->cpu, strerror(err));
+
+    struct pollfd pfd = { .fd = shard->sockfd, .events = POLLIN };
+    while (!atomic_load(&parar_workers)) {
+        // Acorda a tempo dos ACKs atrasados e, no máximo a cada 100 ms, para ver se deve parar
+        int espera_ms = recebe_espera_ack_ms(shard);
+        if (espera_ms < 0 || espera_ms > 100) espera_ms = 100;
+        if (poll(&pfd, 1, espera_ms) > 0) recebe_powerudp_com_ack(shard);
+        recebe_envia_acks_vencidos(shard);
+    }
+    return NULL;
 }
 
-void envia_acknak(int sockfd, struct sockaddr_in *dest, uint32_t seq_num, uint8_t tipo) {
-    PowerUDPHeader header;
-    header.seq_num = htonl(seq_num);
-    header.ack = tipo; 
-    header.flags = 0;
-    header.length = 0;
-
-    sendto(sockfd, &header, sizeof(header), 0, (struct sockaddr *)dest, sizeof(*dest));
-}
-
-void envia_powerudp_confiavel_binario(int sockfd, struct sockaddr_in *dest, const void *dados, size_t dados_len, uint32_t seq_num) {
-    int tentativas = 0;
-    int ack_recebido = 0;
-    socklen_t addrlen = sizeof(*dest);
-    ConfigMessage config;
-
-    struct timeval timeout;
-
-    while (tentativas < config.max_retries && !ack_recebido) {
-        PowerUDPHeader header;
-        header.seq_num = htonl(seq_num);
-        header.ack = 0;
-        header.flags = 0;
-        header.length = htons(dados_len);
-
-        char buffer[BUFLEN];
-        memcpy(buffer, &header, sizeof(header));
-        memcpy(buffer + sizeof(header), dados, dados_len);
-
-        ssize_t enviados = sendto(sockfd, buffer, sizeof(header) + dados_len, 0, (struct sockaddr *)dest, addrlen);
-        if (enviados != (ssize_t)(sizeof(header) + dados_len)) {
-            perror("Erro ao enviar configuração");
-        } else {
-            printf("[CLIENTE] Novas configurações enviadas ao servidor.\n");
+/*
+ * Abre n sockets SO_REUSEPORT na porta (0 = efémera, partilhada pelos n) e arranca
+ * um worker por socket, preso ao core i % número de cores. Devolve a porta usada.
+ */
+int iniciar_shards(ShardRececao *shards, int n, int porta) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cores < 1) cores = 1;
+
+    atomic_store(&parar_workers, 0);
+    for (int i = 0; i < n; i++) {
+        memset(&shards[i], 0, sizeof(shards[i]));
+        if ((shards[i].sockfd = criar_socket_shard(porta)) < 0) {
+            perror("socket de receção SO_REUSEPORT");
+            return -1;
         }
-        
-        timeout.tv_sec = 0;
-        timeout.tv_usec = TMIN * 1000 * (1 << tentativas);
-        setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
-
-        char recv_buffer[1024];
-        struct sockaddr_in src;
-        PowerUDPHeader recv_header;
-
-        ssize_t len = ler_header(sockfd, recv_buffer, &src, &addrlen, &recv_header);
-
-        if (len > 0) {
-            if (recv_header.ack == 1 && recv_header.seq_num == seq_num) {
-                printf("ACK recebido para seq=%u\n", seq_num);
-                ack_recebido = 1;
-            } else if (recv_header.ack == 2) {
-                printf("NAK recebido! Reenviando...\n");
-            }
-        } else {
-            printf("Timeout: tentativa %d\n", tentativas + 1);
+        if (porta == 0) {
+            struct sockaddr_in addr;
+            socklen_t addrlen = sizeof(addr);
+            getsockname(shards[i].sockfd, (struct sockaddr *)&addr, &addrlen);
+            porta = ntohs(addr.sin_port);
+        }
+        shards[i].cpu = i % cores;
+        if (pthread_create(&shards[i].thread, NULL, worker_rececao, &shards[i]) != 0) {
+            perror("pthread_create");
+            return -1;
         }
-
-        tentativas++;
     }
+    return porta;
+}
 
-    if (!ack_recebido) {
-        printf("Erro: não foi possível confirmar entrega após %d tentativas\n", config.max_retries);
+void parar_shards(ShardRececao *shards, int n) {
+    atomic_store(&parar_workers, 1);
+    for (int i = 0; i < n; i++) {
+        pthread_join(shards[i].thread, NULL);
+        close(shards[i].sockfd);
+        for (int j = 0; j < shards[i].cap; j++) free(shards[i].peers[j]);
+        free(shards[i].peers);
     }
 }
 
+void envia_sack(int sockfd, struct sockaddr_in *dest, uint32_t cumulativo, const PowerUDPSack *sack) {
+    char buffer[sizeof(PowerUDPHeaderV1) + sizeof(PowerUDPSack) + POWERUDP_MAC_LEN];
+    size_t len = monta_datagrama(buffer, cumulativo, 3, 0, sack, sizeof(*sack));
+    sendto(sockfd, buffer, len, 0, (struct sockaddr *)dest, sizeof(*dest));
+}
+
+void envia_salto(int sockfd, struct sockaddr_in *dest, uint32_t inicio, uint32_t fim) {
+    char buffer[sizeof(PowerUDPHeaderV1) + sizeof(PowerUDPSkip) + POWERUDP_MAC_LEN];
+    PowerUDPSkip salto = { htonl(fim) };
+    size_t len = monta_datagrama(buffer, inicio, 5, 0, &salto, sizeof(salto));
+    sendto(sockfd, buffer, len, 0, (struct sockaddr *)dest, sizeof(*dest));
+}
+
+void envia_acknak(int sockfd, struct sockaddr_in *dest, uint32_t seq_num, uint8_t tipo) {
+    char buffer[sizeof(PowerUDPHeaderV1) + POWERUDP_MAC_LEN];
+    size_t len = monta_datagrama(buffer, seq_num, tipo, 0, NULL, 0);
+    sendto(sockfd, buffer, len, 0, (struct sockaddr *)dest, sizeof(*dest));
+}
+
 void envia_configuracao_tcp(int sockfd, ConfigMessage *config) {
-    ssize_t enviados = write(sockfd, config, sizeof(*config));
-    if (enviados != sizeof(*config)) {
+    char pedido[1 + sizeof(*config)];
+    pedido[0] = POWERUDP_CTRL_CONFIG;
+    memcpy(pedido + 1, config, sizeof(*config));
+
+    ssize_t enviados = write(sockfd, pedido, sizeof(pedido));
+    if (enviados != sizeof(pedido)) {
         perror("Erro ao enviar configuração");
     } else {
         printf("[CLIENTE] Novas configurações enviadas ao servidor.\n");
@@ -247,6 +941,255 @@ void erro(char *s) {
     exit(1);
 }
 
+/*
+**************************************************************************************
+*******************************         DIRETÓRIO DE PEERS           *********************************************
+***************************************************************************************
+*/
+
+static uint64_t hash_nome(const char *nome) {
+    uint64_t h = 0xcbf29ce484222325ULL;     // FNV-1a
+    while (*nome) {
+        h ^= (unsigned char)*nome++;
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+// Começa com espaço para previstos peers sem crescer
+void diretorio_init(DiretorioPeers *d, size_t previstos) {
+    memset(d, 0, sizeof(*d));
+    d->cap = DIRETORIO_CAP_INICIAL;
+    while ((previstos + 1) * 10 > d->cap * 7)
+        d->cap *= 2;
+    d->slots = calloc(d->cap, sizeof(EntradaDiretorio));
+    if (!d->slots) erro("calloc diretorio");
+}
+
+// Índice do peer ou, se não existir, do slot livre onde ficaria
+static size_t diretorio_slot(const DiretorioPeers *d, const char *nome) {
+    size_t mask = d->cap - 1;
+    size_t i = hash_nome(nome) & mask;
+    while (d->slots[i].peer.name[0] && strcmp(d->slots[i].peer.name, nome) != 0)
+        i = (i + 1) & mask;
+    return i;
+}
+
+static void diretorio_crescer(DiretorioPeers *d) {
+    EntradaDiretorio *antigos = d->slots;
+    size_t cap_antiga = d->cap;
+
+    d->slots = calloc(cap_antiga * 2, sizeof(EntradaDiretorio));
+    if (!d->slots) erro("calloc diretorio");
+    d->cap = cap_antiga * 2;
+    for (size_t i = 0; i < cap_antiga; i++) {
+        if (antigos[i].peer.name[0])
+            d->slots[diretorio_slot(d, antigos[i].peer.name)] = antigos[i];
+    }
+    free(antigos);
+}
+
+EntradaDiretorio *diretorio_procurar(DiretorioPeers *d, const char *nome) {
+    EntradaDiretorio *e = &d->slots[diretorio_slot(d, nome)];
+    return e->peer.name[0] ? e : NULL;
+}
+
+// Insere ou atualiza; se o endereço mudou, a janela antiga (e a sua sequência) deixa de servir
+void diretorio_atualizar(DiretorioPeers *d, const PeerEntry *peer) {
+    char nome[POWERUDP_PEER_NAME_MAX];
+    memcpy(nome, peer->name, sizeof(nome));
+    nome[sizeof(nome) - 1] = '\0';
+    if (!nome[0]) return;
+
+    if ((d->count + 1) * 10 > d->cap * 7)
+        diretorio_crescer(d);
+    EntradaDiretorio *e = &d->slots[diretorio_slot(d, nome)];
+    if (!e->peer.name[0]) {
+        d->count++;
+    } else if (e->peer.ip != peer->ip || e->peer.udp_port != peer->udp_port) {
+        free(e->janela);
+        e->janela = NULL;
+    }
+    e->peer = *peer;
+    memcpy(e->peer.name, nome, sizeof(nome));
+}
+
+void diretorio_remover(DiretorioPeers *d, const char *nome) {
+    size_t mask = d->cap - 1;
+    size_t i = diretorio_slot(d, nome);
+    if (!d->slots[i].peer.name[0]) return;
+    free(d->slots[i].janela);
+
+    // Desloca para trás os elementos seguintes da mesma sequência de sondagem
+    for (size_t j = (i + 1) & mask; d->slots[j].peer.name[0]; j = (j + 1) & mask) {
+        size_t casa = hash_nome(d->slots[j].peer.name) & mask;
+        if (((j - casa) & mask) >= ((j - i) & mask)) {
+            d->slots[i] = d->slots[j];
+            i = j;
+        }
+    }
+    memset(&d->slots[i], 0, sizeof(d->slots[i]));
+    d->count--;
+}
+
+void diretorio_libertar(DiretorioPeers *d) {
+    for (size_t i = 0; i < d->cap; i++)
+        free(d->slots[i].janela);
+    free(d->slots);
+    d->slots = NULL;
+    d->cap = d->count = 0;
+}
+
+/*
+ * Substitui o conteúdo pelo snapshot (versão + n entradas). As janelas de envio dos
+ * peers que mantêm o endereço passam para a tabela nova, para a sequência continuar.
+ */
+void diretorio_aplicar_snapshot(DiretorioPeers *d, uint32_t versao, const PeerEntry *entradas, size_t n) {
+    DiretorioPeers novo;
+    diretorio_init(&novo, n);
+    for (size_t i = 0; i < n; i++) {
+        char nome[POWERUDP_PEER_NAME_MAX];
+        memcpy(nome, entradas[i].name, sizeof(nome));
+        nome[sizeof(nome) - 1] = '\0';
+        diretorio_atualizar(&novo, &entradas[i]);
+
+        EntradaDiretorio *antigo = d->slots ? diretorio_procurar(d, nome) : NULL;
+        if (antigo && antigo->janela && antigo->peer.ip == entradas[i].ip && antigo->peer.udp_port == entradas[i].udp_port) {
+            diretorio_procurar(&novo, nome)->janela = antigo->janela;
+            antigo->janela = NULL;
+        }
+    }
+    novo.versao = versao;
+    novo.sincronizado = 1;
+    novo.deltas = d->deltas;
+    novo.lacunas = d->lacunas;
+    if (d->slots) diretorio_libertar(d);
+    *d = novo;
+}
+
+/*
+ * Aplica um delta recebido por multicast. As entradas já cobertas pela versão local
+ * são saltadas. Devolve 1 se faltam deltas anteriores (é preciso um snapshot),
+ * -1 se o datagrama não é um delta válido e 0 nos restantes casos.
+ */
+int diretorio_aplicar_delta(DiretorioPeers *d, const void *datagrama, size_t len) {
+    const PeerDirectoryHeader *h = datagrama;
+    if (len < sizeof(*h) || ntohl(h->magic) != POWERUDP_DIR_MAGIC) return -1;
+
+    uint32_t base = ntohl(h->base_version), versao = ntohl(h->version), n = ntohl(h->count);
+    if (n > (len - sizeof(*h)) / sizeof(PeerEntry) || len != sizeof(*h) + n * sizeof(PeerEntry) || versao - base != n)
+        return -1;
+    if (!d->sincronizado) return 0;     // o snapshot do registo já trará esta versão
+    if ((int32_t)(base - d->versao) > 0) {
+        d->lacunas++;
+        return 1;
+    }
+
+    const PeerEntry *e = (const PeerEntry *)(h + 1);
+    for (uint32_t i = 0; i < n; i++) {
+        if ((int32_t)(base + i + 1 - d->versao) <= 0) continue;
+        if (e[i].op == POWERUDP_PEER_ADD) {
+            diretorio_atualizar(d, &e[i]);
+        } else if (e[i].op == POWERUDP_PEER_REMOVE) {
+            char nome[POWERUDP_PEER_NAME_MAX];
+            memcpy(nome, e[i].name, sizeof(nome));
+            nome[sizeof(nome) - 1] = '\0';
+            diretorio_remover(d, nome);
+        }
+    }
+    if ((int32_t)(versao - d->versao) > 0) {
+        d->versao = versao;
+        d->deltas++;
+    }
+    return 0;
+}
+
+// read() até len bytes (a ligação TCP é bloqueante); -1 se fechou ou falhou
+static int ler_exato(int fd, void *buf, size_t len) {
+    for (size_t lidos = 0; lidos < len; ) {
+        ssize_t r = read(fd, (char *)buf + lidos, len - lidos);
+        if (r <= 0) return -1;
+        lidos += r;
+    }
+    return 0;
+}
+
+// Lê um snapshot (PeerDirectoryHeader + entradas) da ligação de controlo e aplica-o
+int ler_snapshot(int tcp_sockfd, DiretorioPeers *d) {
+    PeerDirectoryHeader h;
+    if (ler_exato(tcp_sockfd, &h, sizeof(h)) < 0) return -1;
+    if (ntohl(h.magic) != POWERUDP_DIR_MAGIC) {
+        fprintf(stderr, "[CLIENTE] Resposta inesperada do servidor.\n");
+        return -1;
+    }
+
+    size_t n = ntohl(h.count);
+    PeerEntry *entradas = malloc(n ? n * sizeof(PeerEntry) : 1);
+    if (!entradas || ler_exato(tcp_sockfd, entradas, n * sizeof(PeerEntry)) < 0) {
+        free(entradas);
+        return -1;
+    }
+    diretorio_aplicar_snapshot(d, ntohl(h.version), entradas, n);
+    d->snapshot_pedido = 0;
+    free(entradas);
+    return 0;
+}
+
+void pedir_snapshot(int tcp_sockfd, DiretorioPeers *d) {
+    uint8_t tipo = POWERUDP_CTRL_SNAPSHOT;
+    if (d->snapshot_pedido) return;
+    if (write(tcp_sockfd, &tipo, 1) != 1) {
+        perror("Erro ao pedir o diretório");
+        return;
+    }
+    d->snapshot_pedido = 1;
+}
+
+// Anuncia o nome e a porta UDP onde este cliente recebe; o servidor responde com um snapshot
+int registar_no_diretorio(int tcp_sockfd, const char *nome, uint16_t porta) {
+    char pedido[1 + sizeof(PeerRegister)];
+    PeerRegister reg;
+
+    memset(&reg, 0, sizeof(reg));
+    strncpy(reg.name, nome, sizeof(reg.name) - 1);
+    reg.udp_port = htons(porta);
+    pedido[0] = POWERUDP_CTRL_REGISTER;
+    memcpy(pedido + 1, &reg, sizeof(reg));
+    if (write(tcp_sockfd, pedido, sizeof(pedido)) != sizeof(pedido)) {
+        perror("Erro ao registar no diretório");
+        return -1;
+    }
+    return ler_snapshot(tcp_sockfd, &diretorio);
+}
+
+/*
+ * Envia uma mensagem diretamente ao peer (sem passar pelo servidor), pela janela
+ * deslizante que o cliente mantém para ele, e espera a confirmação.
+ */
+int envia_para_peer(int sockfd, const char *nome, const char *texto) {
+    EntradaDiretorio *e = diretorio_procurar(&diretorio, nome);
+    if (!e) {
+        printf("[CLIENTE] Cliente \"%s\" desconhecido (%zu no diretório).\n", nome, diretorio.count);
+        return -1;
+    }
+    if (!e->janela) {
+        struct sockaddr_in dest;
+        memset(&dest, 0, sizeof(dest));
+        dest.sin_family = AF_INET;
+        dest.sin_addr.s_addr = e->peer.ip;
+        dest.sin_port = e->peer.udp_port;
+        if (!(e->janela = malloc(sizeof(JanelaEnvio)))) return -1;
+        janela_init(e->janela, sockfd, &dest, JANELA_PADRAO, 0);
+    }
+    if (envia_powerudp_confiavel(e->janela, texto) < 0 || janela_flush(e->janela) < 0) {
+        printf("[CLIENTE] Falha ao enviar para \"%s\".\n", nome);
+        return -1;
+    }
+    printf("[CLIENTE] Mensagem entregue a \"%s\" (%s:%u).\n", nome,
+           inet_ntoa(e->janela->dest.sin_addr), ntohs(e->janela->dest.sin_port));
+    return 0;
+}
+
 void show_menu() {
     printf("\nMENU:\n");
     printf("1. Enviar novas configurações ao servidor\n");
@@ -254,12 +1197,249 @@ void show_menu() {
     printf("Escolha uma opção: ");
 }
 
-int main() {
-    int tcp_sockfd, udp_sockfd;
-    struct sockaddr_in server_addr, udp_dest;
+typedef struct {
+    struct sockaddr_in dest;
+    int janela;             // tamanho da janela deslizante do gerador
+    pthread_t thread;
+} GeradorBench;
+
+atomic_int parar_geradores;
+
+// Envia mensagens de 64 bytes pela janela deslizante até parar_geradores
+static void *gerador_bench(void *arg) {
+    GeradorBench *gerador = arg;
+    JanelaEnvio *janela = malloc(sizeof(*janela));
+    int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    char dados[64];
+
+    memset(dados, 'x', sizeof(dados));
+    janela_init(janela, sockfd, &gerador->dest, gerador->janela, 0);
+    while (!atomic_load(&parar_geradores))
+        if (envia_powerudp_confiavel_binario(janela, dados, sizeof(dados)) < 0) break;
+    close(sockfd);
+    free(janela);
+    return NULL;
+}
+
+static void bench_shards_uma(int workers, int segundos) {
+    static ShardRececao shards[MAX_WORKERS];
+    GeradorBench geradores[GERADORES];
+    struct timespec t0, t1;
+
+    int porta = iniciar_shards(shards, workers, 0);
+    if (porta < 0) exit(1);
+
+    atomic_store(&parar_geradores, 0);
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (int i = 0; i < GERADORES; i++) {
+        memset(&geradores[i].dest, 0, sizeof(geradores[i].dest));
+        geradores[i].dest.sin_family = AF_INET;
+        geradores[i].dest.sin_port = htons(porta);
+        geradores[i].dest.sin_addr.s_addr = inet_addr("127.0.0.1");
+        geradores[i].janela = JANELA_PADRAO;
+        pthread_create(&geradores[i].thread, NULL, gerador_bench, &geradores[i]);
+    }
+    sleep(segundos);
+    atomic_store(&parar_geradores, 1);
+    for (int i = 0; i < GERADORES; i++)
+        pthread_join(geradores[i].thread, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    parar_shards(shards, workers);
+
+    unsigned long pacotes = 0, sem_estado = 0;
+    int peers_min = shards[0].num_peers, peers_max = 0;
+    for (int i = 0; i < workers; i++) {
+        pacotes += shards[i].pacotes;
+        sem_estado += shards[i].sem_estado;
+        if (shards[i].num_peers < peers_min) peers_min = shards[i].num_peers;
+        if (shards[i].num_peers > peers_max) peers_max = shards[i].num_peers;
+    }
+    double tempo = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    printf("%d,%d,%lu,%.3f,%.0f,%d,%d,%lu\n", workers, GERADORES, pacotes, tempo, pacotes / tempo, peers_min, peers_max,
+           sem_estado);
+    fflush(stdout);
+}
+
+/*
+ * --bench-shards [segundos] [workers]: pacotes/s agregados da receção em loopback
+ * com 1, 2, 4... workers, até workers (por omissão o número de cores). GERADORES
+ * emissores, cada um com o seu socket (logo a sua origem), enviam pela janela
+ * deslizante e o peers_min/peers_max mostra como o kernel os repartiu; sem_estado
+ * conta os pacotes que ficaram sem ACK por não haver memória para o seu peer.
+ */
+int bench_shards(int segundos, int max_workers) {
+    if (segundos < 1) segundos = 1;
+    if (max_workers < 1) max_workers = 1;
+    if (max_workers > MAX_WORKERS) max_workers = MAX_WORKERS;
+
+    rececao_verbosa = 0;
+    printf("workers,geradores,pacotes,segundos,pacotes_por_s,peers_min,peers_max,sem_estado\n");
+    for (int n = 1; n < max_workers; n *= 2)
+        bench_shards_uma(n, segundos);
+    bench_shards_uma(max_workers, segundos);
+    return 0;
+}
+
+/*
+ * --bench-janela [segundos]: débito em loopback de um só emissor para um recetor
+ * (um shard) com a janela deslizante de 1, 4, 16, 64 e JANELA_MAX pacotes. Com
+ * janela 1 cada pacote espera pelo seu ACK (stop-and-wait); com mais pacotes em voo
+ * o emissor deixa de ficar parado um RTT por pacote.
+ */
+int bench_janela(int segundos) {
+    int tamanhos[] = { 1, 4, 16, 64, JANELA_MAX };
+    static ShardRececao shard;
+    GeradorBench gerador;
+    struct timespec t0, t1;
+
+    if (segundos < 1) segundos = 1;
+    rececao_verbosa = 0;
+    printf("janela,pacotes,segundos,pacotes_por_s\n");
+    for (size_t t = 0; t < sizeof(tamanhos) / sizeof(tamanhos[0]); t++) {
+        int porta = iniciar_shards(&shard, 1, 0);
+        if (porta < 0) exit(1);
+
+        memset(&gerador.dest, 0, sizeof(gerador.dest));
+        gerador.dest.sin_family = AF_INET;
+        gerador.dest.sin_port = htons(porta);
+        gerador.dest.sin_addr.s_addr = inet_addr("127.0.0.1");
+        gerador.janela = tamanhos[t];
+        atomic_store(&parar_geradores, 0);
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        pthread_create(&gerador.thread, NULL, gerador_bench, &gerador);
+        sleep(segundos);
+        atomic_store(&parar_geradores, 1);
+        pthread_join(gerador.thread, NULL);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        parar_shards(&shard, 1);
+
+        double tempo = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+        printf("%d,%lu,%.3f,%.0f\n", tamanhos[t], shard.entregues, tempo, shard.entregues / tempo);
+        fflush(stdout);
+    }
+    return 0;
+}
+
+// Monta em datagrama um delta com n alterações sobre a versão base
+static size_t bench_delta(uint32_t *datagrama, uint32_t base, const PeerEntry *alteracoes, size_t n) {
+    PeerDirectoryHeader *h = (PeerDirectoryHeader *)datagrama;
+    h->magic = htonl(POWERUDP_DIR_MAGIC);
+    h->base_version = htonl(base);
+    h->version = htonl(base + n);
+    h->count = htonl(n);
+    memcpy(h + 1, alteracoes, n * sizeof(PeerEntry));
+    return sizeof(*h) + n * sizeof(PeerEntry);
+}
+
+static double bench_segundos(struct timespec *t0) {
+    struct timespec t1;
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    return (t1.tv_sec - t0->tv_sec) + (t1.tv_nsec - t0->tv_nsec) / 1e9;
+}
+
+/*
+ * --bench-diretorio [N]: custo da cache do diretório com 1k, 10k e N peers. Mede a
+ * aplicação do snapshot do registo, a resolução de um nome antes de um envio (que
+ * existe e que não existe) e a aplicação de deltas de 40 entradas com peers a
+ * entrar e a sair (o trabalho de cada cliente por cada atualização difundida).
+ */
+int bench_diretorio(int max_peers) {
+    int tamanhos[] = { 1000, 10000, max_peers };
+    int total = (max_peers > 10000 ? max_peers : 10000) * 2;
+    PeerEntry *entradas = calloc(total, sizeof(PeerEntry));
+    uint32_t datagrama[(sizeof(PeerDirectoryHeader) + 40 * sizeof(PeerEntry)) / 4];
+    struct timespec t0;
+    unsigned long encontrados = 0;
+
+    if (max_peers < 1 || !entradas) erro("bench_diretorio");
+    for (int i = 0; i < total; i++) {
+        snprintf(entradas[i].name, sizeof(entradas[i].name), "peer-%d", i);
+        entradas[i].ip = htonl(0x0A000000 | (i >> 4));
+        entradas[i].udp_port = htons(40000 + (i & 15));
+        entradas[i].op = POWERUDP_PEER_ADD;
+    }
+
+    printf("peers,snapshot_us,procura_ns,procura_falhada_ns,delta_ns_por_entrada\n");
+    for (int t = 0; t < 3; t++) {
+        int n = tamanhos[t];
+        DiretorioPeers d;
+        diretorio_init(&d, 0);
+        encontrados = 0;
+
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        diretorio_aplicar_snapshot(&d, 0, entradas, n);
+        double snap = bench_segundos(&t0);
+
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        for (int i = 0; i < n; i++)
+            encontrados += diretorio_procurar(&d, entradas[(i * 7919) % n].name) != NULL;
+        double proc = bench_segundos(&t0);
+
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        for (int i = 0; i < n; i++)
+            encontrados += diretorio_procurar(&d, entradas[n + i].name) != NULL;
+        double falha = bench_segundos(&t0);
+
+        // n novos peers entram e os n originais saem, 40 alterações por delta
+        PeerEntry *alteracoes = malloc(2 * n * sizeof(PeerEntry));
+        if (!alteracoes) erro("malloc");
+        for (int i = 0; i < n; i++) {
+            alteracoes[2 * i] = entradas[n + i];
+            alteracoes[2 * i + 1] = entradas[i];
+            alteracoes[2 * i + 1].op = POWERUDP_PEER_REMOVE;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        for (int i = 0; i < 2 * n; i += 40) {
+            int k = 2 * n - i < 40 ? 2 * n - i : 40;
+            size_t len = bench_delta(datagrama, d.versao, alteracoes + i, k);
+            if (diretorio_aplicar_delta(&d, datagrama, len) != 0) erro("delta rejeitado");
+        }
+        double delta = bench_segundos(&t0);
+        free(alteracoes);
+
+        if (d.count != (size_t)n || d.versao != 2u * n || encontrados != (unsigned long)n)
+            erro("cache do diretório inconsistente");
+        printf("%d,%.1f,%.1f,%.1f,%.1f\n", n, snap * 1e6, proc * 1e9 / n, falha * 1e9 / n, delta * 1e9 / (2 * n));
+        diretorio_libertar(&d);
+    }
+    free(entradas);
+    return 0;
+}
+
+/*
+ * Projeto_client [workers] [nome]: com workers > 0 a receção UDP passa para workers
+ * threads, cada uma com o seu socket SO_REUSEPORT numa porta efémera partilhada só
+ * por elas (outro cliente na mesma máquina tem a sua) e presa a um core; o
+ * ciclo principal fica só com o stdin, o TCP e o multicast. O cliente regista-se no
+ * diretório de peers com nome (por omissão cliente-<pid>) e a porta onde recebe.
+ */
+int main(int argc, char *argv[]) {
+    // Sem servidor (benchmarks) o sal é zero; o do servidor chega com o ACK
+    uint8_t sal[POWERUDP_SALT_LEN] = { 0 };
+    powerudp_derive_key(POWERUDP_PSK, sal, &chave_sessao);
+
+    if (argc > 1 && strcmp(argv[1], "--bench-shards") == 0)
+        return bench_shards(argc > 2 ? atoi(argv[2]) : 2,
+                            argc > 3 ? atoi(argv[3]) : (int)sysconf(_SC_NPROCESSORS_ONLN));
+    if (argc > 1 && strcmp(argv[1], "--bench-diretorio") == 0)
+        return bench_diretorio(argc > 2 ? atoi(argv[2]) : 10000);
+    if (argc > 1 && strcmp(argv[1], "--bench-janela") == 0)
+        return bench_janela(argc > 2 ? atoi(argv[2]) : 2);
+
+    int num_workers = argc > 1 ? atoi(argv[1]) : 0;
+    if (num_workers < 0) num_workers = 0;
+    if (num_workers > MAX_WORKERS) num_workers = MAX_WORKERS;
+
+    char nome_local[POWERUDP_PEER_NAME_MAX];
+    if (argc > 2)
+        snprintf(nome_local, sizeof(nome_local), "%s", argv[2]);
+    else
+        snprintf(nome_local, sizeof(nome_local), "cliente-%d", (int)getpid());
+
+    int tcp_sockfd, udp_sockfd, envio_sockfd;
+    struct sockaddr_in server_addr, udp_addr;
+    socklen_t udp_addr_len = sizeof(udp_addr);
     struct RegisterMessage msg;
-    char buffer[BUFLEN];
-    uint32_t seq_num = 0;
 
     if ((tcp_sockfd = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
         perror("socket TCP");
@@ -281,11 +1461,11 @@ int main() {
     msg.psk[sizeof(msg.psk) - 1] = '\0';
     write(tcp_sockfd, msg.psk, strlen(msg.psk));
 
-    char resposta[4];
-    read(tcp_sockfd, resposta, sizeof(resposta));
-    resposta[3] = '\0';
-
-    if (strcmp(resposta, "ACK") == 0) {
+    // "ACK" e o sal da chave de sessão, ou "NAK"
+    char resposta[4] = { 0 };
+    if (ler_exato(tcp_sockfd, resposta, 3) == 0 && strcmp(resposta, "ACK") == 0 &&
+        ler_exato(tcp_sockfd, sal, sizeof(sal)) == 0) {
+        powerudp_derive_key(POWERUDP_PSK, sal, &chave_sessao);
         printf("Autenticado! Iniciando comunicação...\n");
 
         struct sigaction sa;
@@ -297,55 +1477,95 @@ int main() {
             exit(1);
         }
 
-        // === Socket UDP para comunicação com outros clientes ===
-        if ((udp_sockfd = socket(AF_INET, SOCK_DGRAM, 0)) == -1) {
+        // === Sockets UDP para comunicação com outros clientes ===
+        // udp_sockfd recebe (porta efémera; com workers são os shards, noutra) e
+        // envio_sockfd envia as mensagens diretas e recebe os respetivos ACKs
+        if ((udp_sockfd = socket(AF_INET, SOCK_DGRAM, 0)) == -1 ||
+            (envio_sockfd = socket(AF_INET, SOCK_DGRAM, 0)) == -1) {
             perror("socket UDP");
             exit(1);
         }
+        memset(&udp_addr, 0, sizeof(udp_addr));
+        udp_addr.sin_family = AF_INET;
+        udp_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        if (num_workers == 0 &&
+            (bind(udp_sockfd, (struct sockaddr *)&udp_addr, sizeof(udp_addr)) < 0 ||
+             getsockname(udp_sockfd, (struct sockaddr *)&udp_addr, &udp_addr_len) < 0)) {
+            perror("bind UDP");
+            exit(1);
+        }
+        uint16_t porta_udp = ntohs(udp_addr.sin_port);
+
+        static ShardRececao shards[MAX_WORKERS];
+        static ShardRececao shard_principal;
+        shard_principal.sockfd = udp_sockfd;
+        shard_principal.cpu = -1;
+        if (num_workers > 0) {
+            int porta = iniciar_shards(shards, num_workers, 0);
+            if (porta < 0) exit(1);
+            porta_udp = porta;
+            printf("[INFO] Receção UDP em %d workers na porta %d.\n", num_workers, porta);
+        }
 
-        memset(&udp_dest, 0, sizeof(udp_dest));
-        udp_dest.sin_family = AF_INET;
-        udp_dest.sin_port = htons(PORT);
-        udp_dest.sin_addr.s_addr = inet_addr("127.0.0.1"); // Pode ser modificado para endereço real do peer
-
+        // O multicast fica à escuta antes do registo para não perder deltas posteriores ao snapshot
         configurar_socket_multicast();
 
+        if (registar_no_diretorio(tcp_sockfd, nome_local, porta_udp) < 0) {
+            printf("[CLIENTE] Falha no registo no diretório de peers.\n");
+            exit(1);
+        }
+        printf("[CLIENTE] Registado como \"%s\" (UDP %u); %zu peers no diretório (versão %u).\n",
+               nome_local, porta_udp, diretorio.count, diretorio.versao);
+
         fd_set readfds;
         int maxfd = udp_sockfd > multicast_sock ? udp_sockfd : multicast_sock;
         if (tcp_sockfd > maxfd) maxfd = tcp_sockfd;
 
+        int stdin_aberto = 1;
         show_menu();
 
         while (1) 
         {
             FD_ZERO(&readfds);
-            FD_SET(0, &readfds); // stdin
-            FD_SET(udp_sockfd, &readfds); // UDP
+            if (stdin_aberto) FD_SET(0, &readfds); // stdin
+            if (num_workers == 0) FD_SET(udp_sockfd, &readfds); // UDP
             FD_SET(multicast_sock, &readfds); // multicast
             FD_SET(tcp_sockfd, &readfds);
 
-            if (select(maxfd + 1, &readfds, NULL, NULL, NULL) < 0) {
+            // Acorda a tempo de enviar o ACK atrasado
+            int espera_ms = recebe_espera_ack_ms(&shard_principal);
+            struct timeval tv = { espera_ms / 1000, (espera_ms % 1000) * 1000 };
+            int prontos = select(maxfd + 1, &readfds, NULL, NULL, espera_ms >= 0 ? &tv : NULL);
+            if (prontos < 0) {
                 perror("select");
                 continue;
             }
+            recebe_envia_acks_vencidos(&shard_principal);
 
+            // Pela ligação de controlo só chegam os snapshots pedidos depois de um salto de versão
             if (FD_ISSET(tcp_sockfd, &readfds)) 
             {
-                    char buffer[64];
-                    ssize_t len = read(tcp_sockfd, buffer, sizeof(buffer) - 1);
-                    if (len == 0) {
+                    if (ler_snapshot(tcp_sockfd, &diretorio) < 0) {
                         printf("[CLIENTE] Conexão TCP encerrada pelo servidor.\n");
+                        printf("[CLIENTE] Datagramas descartados: %lu MAC, %lu CRC32C, %lu malformados.\n",
+                               (unsigned long)macs_invalidos, (unsigned long)crcs_invalidos,
+                               (unsigned long)datagramas_malformados);
                         close(tcp_sockfd);
                         close(udp_sockfd);
+                        close(envio_sockfd);
                         close(multicast_sock);
                         exit(0);
                     }
+                    printf("[Diretório] Snapshot recebido: %zu peers (versão %u).\n", diretorio.count, diretorio.versao);
             }
 
             // Envio de mensagens PowerUDP (entrada do utilizador)
             if (FD_ISSET(0, &readfds)) {
                 char opcao;
-                scanf(" %c", &opcao);
+                if (scanf(" %c", &opcao) != 1) {
+                    stdin_aberto = 0;   // EOF: o cliente continua só a receber
+                    continue;
+                }
 
                 if (opcao == '1') 
                 {
@@ -365,6 +1585,18 @@ int main() {
                     printf("Máximo de tentativas: ");
                     scanf("%hhu", &config.max_retries);
 
+                    printf("Controlo de congestionamento (0 = nenhum, 1 = NewReno): ");
+                    scanf("%hhu", &config.congestion_control);
+
+                    printf("Compressão das mensagens grandes (0 ou 1): ");
+                    scanf("%hhu", &config.compression);
+
+                    printf("FEC: pacotes de dados por grupo (0 = desligado, máx. %d): ", POWERUDP_FEC_K_MAX);
+                    scanf("%hhu", &config.fec_k);
+
+                    printf("FEC: pacotes de paridade por grupo (1 = XOR, máx. %d): ", POWERUDP_FEC_PARITY_MAX);
+                    scanf("%hhu", &config.fec_parity);
+
                     printf("[CLIENTE] A enviar as novas configurações ao servidor...\n");
 
                     config.base_timeout = htons(config.base_timeout);
@@ -372,8 +1604,18 @@ int main() {
 
                     show_menu();
                 } else if (opcao == '2') {
-                    printf("[CLIENTE] Diga o cliente:\n");
-                    //printf("Mensagem atual: %s\n", mensagem);
+                    char nome[POWERUDP_PEER_NAME_MAX];
+                    char texto[PAYLOAD_MAX + 1];
+
+                    printf("[CLIENTE] Diga o cliente: ");
+                    scanf("%23s", nome);
+                    printf("Mensagem: ");
+                    scanf(" %487[^\n]", texto);
+
+                    if (strcmp(nome, nome_local) == 0)
+                        printf("[CLIENTE] \"%s\" é este cliente.\n", nome);
+                    else
+                        envia_para_peer(envio_sockfd, nome, texto);
                     show_menu();
                 } else {
                     printf("[CLIENTE] Opção inválida!\n");
@@ -381,24 +1623,58 @@ int main() {
             }
 
             if (FD_ISSET(udp_sockfd, &readfds)) {
-                recebe_powerudp_com_ack(udp_sockfd);
+                recebe_powerudp_com_ack(&shard_principal);
             }
 
+            // O grupo multicast leva a configuração e os deltas do diretório de peers
             if (FD_ISSET(multicast_sock, &readfds)) {
+                uint32_t datagrama[2048 / sizeof(uint32_t)];
+                ConfigAnnouncement anuncio;
                 ConfigMessage cfg;
-                ssize_t len = recvfrom(multicast_sock, &cfg, sizeof(cfg), 0, NULL, NULL);
-                if (len == sizeof(cfg)) {
-                    printf("[Multicast] Nova configuração recebida:\n");
+                ssize_t len = recvfrom(multicast_sock, datagrama, sizeof(datagrama), 0, NULL, NULL);
+                if (len < 0) continue;
+                if ((len = powerudp_mac_check(&chave_sessao, datagrama, len)) < 0) {
+                    printf("[Multicast] Datagrama com MAC inválido descartado (%lu).\n", ++macs_invalidos);
+                    continue;
+                }
+                memcpy(&anuncio, datagrama, sizeof(anuncio));
+                uint32_t epoca = ntohl(anuncio.epoch);
+                cfg = anuncio.config;
+                if (len >= (ssize_t)sizeof(PeerDirectoryHeader) && ntohl(datagrama[0]) == POWERUDP_DIR_MAGIC) {
+                    uint32_t versao = diretorio.versao;
+                    int r = diretorio_aplicar_delta(&diretorio, datagrama, len);
+                    if (r == 1) {
+                        printf("[Diretório] Delta %u -> %u perdido; a pedir snapshot.\n", versao, ntohl(datagrama[1]));
+                        pedir_snapshot(tcp_sockfd, &diretorio);
+                    } else if (r == 0 && diretorio.versao != versao) {
+                        printf("[Diretório] Versão %u: %zu peers.\n", diretorio.versao, diretorio.count);
+                    }
+                } else if (len == sizeof(anuncio) && epoca_conhecida && (int32_t)(epoca - epoca_config) <= 0) {
+                    configs_obsoletas++;
+                    printf("[Multicast] Época %u obsoleta ignorada (atual %u, %lu ignoradas).\n",
+                           epoca, epoca_config, configs_obsoletas);
+                } else if (len == sizeof(anuncio)) {
+                    epoca_config = epoca;
+                    epoca_conhecida = 1;
+                    printf("[Multicast] Nova configuração recebida (época %u):\n", epoca);
                     printf("  Retransmissão: %d\n", cfg.enable_retransmission);
                     printf("  Backoff: %d\n", cfg.enable_backoff);
                     printf("  Sequência: %d\n", cfg.enable_sequence);
                     printf("  Timeout base: %d\n", ntohs(cfg.base_timeout));
                     printf("  Retries máx: %d\n", cfg.max_retries);
+                    printf("  Congestionamento: %s\n", cfg.congestion_control == POWERUDP_CC_NEWRENO ? "NewReno" : "nenhum");
+                    printf("  Compressão: %d\n", cfg.compression);
+                    if (cfg.fec_k) printf("  FEC: %d + %d paridade\n", cfg.fec_k, cfg.fec_parity);
+                    else printf("  FEC: desligado\n");
+
+                    config_atual = cfg;
+                    config_atual.base_timeout = ntohs(cfg.base_timeout);
             
                 }
             }
         }
         close(multicast_sock);
+        close(envio_sockfd);
         close(udp_sockfd);
         close(tcp_sockfd);
     
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <netinet/in.h>
@@ -9,209 +10,1175 @@
 #include <arpa/inet.h>
 #include <signal.h>
 #include <pthread.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <time.h>
+#include <sys/random.h>
+#include "POWERUDP_H.h"
 
 
 #define SERVER_PORT     1048
 #define BUF_SIZE        1024
+#define MAX_EVENTS      256
+#define MAX_LOOPS       64
+#define COALESCE_MS     50      // janela para juntar atualizações num só multicast
 
-pthread_mutex_t config_mutex = PTHREAD_MUTEX_INITIALIZER;
+const char *valid_psk = "my_secret_key";
 
-struct ConfigMessage {
-    uint8_t enable_retransmission;
-    uint8_t enable_backoff;
-    uint8_t enable_sequence;
-    uint16_t base_timeout;  
-    uint8_t max_retries;
-};
+/*
+ * Chave dos MACs desta execução do servidor: derivada da PSK com um sal aleatório,
+ * enviado a cada cliente logo a seguir ao "ACK". Assina os multicasts (configuração
+ * e deltas do diretório) e é a que os clientes usam entre si nos datagramas UDP.
+ */
+uint8_t sal_sessao[POWERUDP_SALT_LEN];
+PowerUDPKey chave_sessao;
+
+pthread_mutex_t config_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t config_cond = PTHREAD_COND_INITIALIZER;
 
-struct ConfigMessage configuracao_ativa = {
+ConfigMessage configuracao_ativa = {
     .enable_retransmission = 1,
     .enable_backoff = 1,
     .enable_sequence = 1,
     .base_timeout = 0,
-    .max_retries = 5
+    .max_retries = 5,
+    .congestion_control = POWERUDP_CC_NEWRENO,
+    .compression = 0,
+    .fec_k = 0,
+    .fec_parity = 1
 };
 
+// Protegidos por config_mutex
+uint32_t config_epoca;                  // cresce a cada atualização recebida
+int config_pendente = 0;                // há uma época por difundir
+unsigned long atualizacoes_recebidas = 0;
+unsigned long multicasts_enviados = 0;
+int diretorio_pendente = 0;             // há alterações do diretório por difundir
+
+/*
+ * Diretório de peers: nome -> endereço UDP de cada cliente que se registou, numa
+ * tabela de hash por nome (FNV-1a, sondagem linear, slot livre = nome vazio). Cada
+ * alteração incrementa diretorio_versao e fica em alteracoes[] até o publicador a
+ * difundir como delta por multicast; quem se regista, ou perdeu um delta, recebe
+ * um snapshot completo pela sua ligação TCP.
+ */
+#define DIRETORIO_CAP_INICIAL   64
+#define DELTA_MAX_ENTRADAS      40      // entradas por datagrama de delta (cabe num MTU de 1500)
+
+pthread_mutex_t diretorio_mutex = PTHREAD_MUTEX_INITIALIZER;
+PeerEntry *diretorio;
+size_t diretorio_cap, diretorio_count;
+uint32_t diretorio_versao;              // versão depois da última alteração
+uint32_t versao_publicada;              // versão até onde os deltas já foram difundidos
+PeerEntry *alteracoes;                  // alterações ainda por difundir, por ordem
+size_t num_alteracoes, cap_alteracoes;
+unsigned long deltas_enviados = 0;
+unsigned long snapshots_enviados = 0;
+
+/*
+ * Registo de clientes: tabela de hash com endereçamento aberto (sondagem linear),
+ * indexada por (IP, porta) e dividida em REGISTO_SHARDS fatias, cada uma com o seu
+ * mutex. As threads de eventos só disputam o lock quando caem na mesma fatia, e
+ * procura, inserção e remoção são O(1) em média (remoção por deslocamento para
+ * trás, sem lápides).
+ */
+#define REGISTO_SHARDS      64
+#define REGISTO_CAP_INICIAL 16
+
 struct ClienteInfo {
     struct in_addr ip;
+    uint16_t porta;                 // network byte order
+    int ocupado;
+    int fd;                         // ligação TCP de controlo
+    time_t ultimo_contacto;
+    uint32_t epoca_config;          // época gerada pela última configuração deste cliente
+    unsigned long configs_recebidas;
+    unsigned long bytes_recebidos;
 };
 
+struct ShardRegisto {
+    pthread_mutex_t mutex;
+    struct ClienteInfo *slots;
+    size_t cap, count;
+} __attribute__((aligned(64)));
 
-struct ClienteInfo clientes[3];
-pid_t pids[3];
-int num_clientes = 0;
-int client_fd_global;
+struct ShardRegisto registo[REGISTO_SHARDS];
+volatile int num_clientes = 0;
 
-struct ThreadArgs {
-    int client_fd;
-    struct sockaddr_in client_addr;
+// Estado de cada ligação TCP: primeiro a PSK, depois pedidos de um byte de tipo e um corpo
+enum EstadoLigacao { LER_PSK, LER_TIPO, LER_CORPO };
+
+struct Ligacao {
+    int fd;
+    struct sockaddr_in addr;
+    enum EstadoLigacao estado;
+    char psk[64];
+    size_t psk_len;
+    uint8_t tipo;
+    union {
+        ConfigMessage config;
+        PeerRegister registo;
+    } req;
+    size_t req_len, req_total;
+    char nome[POWERUDP_PEER_NAME_MAX];  // nome no diretório ("" = não registado)
+    uint16_t porta_udp;                 // network byte order
+    char *saida;                        // snapshot por escrever (EPOLLOUT)
+    size_t saida_len, saida_enviada;
+    struct Ligacao *proxima_livre;
 };
 
-void process_client(int client_fd, struct sockaddr_in *client_addr);
-void enviar_config_multicast();
-void adicionar_cliente(struct in_addr ip);
+// Cada event loop recicla as ligações que fecha: sem malloc por ligação em regime estável
+static _Thread_local struct Ligacao *ligacoes_livres = NULL;
+// Desligado pelo --bench-ligacoes: uma linha por fecho pesaria mais do que a própria ligação
+static int registar_fechos = 1;
+
+int criar_socket_escuta();
+void *event_loop(void *arg);
+void tratar_ligacao(int epfd, struct Ligacao *lig);
+void fechar_ligacao(int epfd, struct Ligacao *lig);
+struct Ligacao *nova_ligacao();
+void libertar_ligacao(struct Ligacao *lig);
+void aplicar_config(struct Ligacao *lig);
+void registar_peer(struct Ligacao *lig);
+int enviar_snapshot(int epfd, struct Ligacao *lig);
+int escrever_saida(int epfd, struct Ligacao *lig);
+void diretorio_init();
+int diretorio_adicionar(const char *nome, uint32_t ip, uint16_t porta);
+int diretorio_remover(const char *nome, uint32_t ip, uint16_t porta);
+int diretorio_procurar(const char *nome, PeerEntry *peer);
+char *diretorio_snapshot(size_t *len);
+int publicar_deltas(int sockfd, struct sockaddr_in *dest, size_t *bytes);
+int bench_diretorio(int max_peers);
+void *publicador_multicast(void *arg);
+void enviar_config_multicast(int sockfd, struct sockaddr_in *dest, ConfigAnnouncement *anuncio);
+void registo_init();
+int adicionar_cliente(struct sockaddr_in *addr, int fd);
+int atualizar_cliente(struct sockaddr_in *addr, uint32_t epoca, size_t bytes);
+int procurar_cliente(struct sockaddr_in *addr, struct ClienteInfo *info);
+int remover_cliente(struct sockaddr_in *addr);
+int bench_registo(int max_clientes);
+int bench_ligacoes(int ciclos, int clientes, int num_loops);
 void handle_sigint(int sig);
 void encerrar_todos_os_clientes();
 void erro(char *msg);
-void sigusr1_handler(int sig);
 void dummy_sigusr1_handler(int sig);
-void *thread_process_client(void* arg);
 
 
 
 
-int main() 
+/*
+ * Servidor orientado a eventos: N threads (uma por core, ou argv[1]), cada uma com
+ * o seu epoll e o seu socket de escuta em SO_REUSEPORT, pelo que o kernel reparte
+ * as ligações sem locks no accept. Todos os sockets são não bloqueantes e cada
+ * ligação avança numa pequena máquina de estados à medida que os bytes chegam.
+ */
+int main(int argc, char *argv[])
 {
-    int fd, client;
-    struct sockaddr_in addr, client_addr;
-    int client_addr_size;
+    if (argc > 1 && strcmp(argv[1], "--bench-registo") == 0)
+        return bench_registo(argc > 2 ? atoi(argv[2]) : 100000);
+    if (argc > 1 && strcmp(argv[1], "--bench-diretorio") == 0)
+        return bench_diretorio(argc > 2 ? atoi(argv[2]) : 10000);
+    if (argc > 1 && strcmp(argv[1], "--bench-ligacoes") == 0)
+        return bench_ligacoes(argc > 2 ? atoi(argv[2]) : 20000, argc > 3 ? atoi(argv[3]) : 64,
+                              argc > 4 ? atoi(argv[4]) : (int)sysconf(_SC_NPROCESSORS_ONLN));
+
+    int num_loops = argc > 1 ? atoi(argv[1]) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_loops < 1) num_loops = 1;
+    if (num_loops > MAX_LOOPS) num_loops = MAX_LOOPS;
+
     configuracao_ativa.base_timeout = htons(200);
-    client_addr_size = sizeof(client_addr);
+    // Semeada com o relógio para continuar a crescer depois de um reinício do servidor
+    config_epoca = (uint32_t)time(NULL);
 
-    bzero((void *) &addr, sizeof(addr));
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(SERVER_PORT);
-    addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+    registo_init();
+    diretorio_init();
+    diretorio_versao = versao_publicada = (uint32_t)time(NULL);
+
+    if (getrandom(sal_sessao, sizeof(sal_sessao), 0) != (ssize_t)sizeof(sal_sessao)) {
+        perror("[WARN] getrandom");
+        uint64_t semente = ((uint64_t)time(NULL) << 32) ^ (uint64_t)getpid();
+        memcpy(sal_sessao, &semente, sizeof(semente));
+    }
+    powerudp_derive_key(valid_psk, sal_sessao, &chave_sessao);
 
     signal(SIGINT, handle_sigint);
     signal(SIGUSR1, dummy_sigusr1_handler);  // Adicionado
+    signal(SIGPIPE, SIG_IGN);
+
+    pthread_t publicador;
+    if (pthread_create(&publicador, NULL, publicador_multicast, NULL) != 0)
+        erro("na funcao pthread_create");
+
+    pthread_t loops[MAX_LOOPS];
+    for (long i = 0; i < num_loops; i++) {
+        int fd = criar_socket_escuta();
+        if (pthread_create(&loops[i], NULL, event_loop, (void *)(long)fd) != 0)
+            erro("na funcao pthread_create");
+    }
+    printf("[INFO] Servidor à escuta na porta %d com %d threads.\n", SERVER_PORT, num_loops);
+
+    for (int i = 0; i < num_loops; i++)
+        pthread_join(loops[i], NULL);
+    return 0;
+}
 
+int criar_socket_escuta()
+{
+    int fd, reuse = 1;
+    struct sockaddr_in addr;
 
-    if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+    bzero((void *) &addr, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(SERVER_PORT);
+    addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+
+    if ((fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0)
         erro("na funcao socket");
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) < 0 ||
+        setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) < 0)
+        erro("na funcao setsockopt");
     if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0)
         erro("na funcao bind");
-    if (listen(fd, 3) < 0)
+    if (listen(fd, SOMAXCONN) < 0)
         erro("na funcao listen");
+    return fd;
+}
+
+void *event_loop(void *arg)
+{
+    int listen_fd = (int)(long)arg;
+    struct epoll_event ev, eventos[MAX_EVENTS];
+    int epfd = epoll_create1(0);
+    if (epfd < 0)
+        erro("na funcao epoll_create1");
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;     // NULL identifica o socket de escuta
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, listen_fd, &ev) < 0)
+        erro("na funcao epoll_ctl");
 
     while (1)
     {
-        if((client = accept(fd, (struct sockaddr *)&client_addr, (socklen_t *)&client_addr_size)) == -1)
-            erro("na função accept");
-
-        struct ThreadArgs* targs = malloc(sizeof(struct ThreadArgs));
-        targs->client_fd = client;
-        targs->client_addr = client_addr;
-
-        pthread_t tid;
-        if (pthread_create(&tid, NULL, thread_process_client, targs) != 0) {
-            perror("pthread_create");
-            close(client);
-            free(targs);
-            continue;
+        int n = epoll_wait(epfd, eventos, MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            erro("na funcao epoll_wait");
         }
-        pthread_detach(tid); // Libera recursos da thread automaticamente ao terminar
 
-        adicionar_cliente(client_addr.sin_addr);
-    
+        for (int i = 0; i < n; i++) {
+            struct Ligacao *lig = eventos[i].data.ptr;
+            if (lig) {
+                if ((eventos[i].events & EPOLLOUT) && escrever_saida(epfd, lig) < 0)
+                    continue;
+                if (eventos[i].events & ~EPOLLOUT)
+                    tratar_ligacao(epfd, lig);
+                continue;
+            }
+
+            // Aceita todas as ligações pendentes de uma vez
+            while (1) {
+                struct sockaddr_in client_addr;
+                socklen_t client_addr_size = sizeof(client_addr);
+                int client = accept4(listen_fd, (struct sockaddr *)&client_addr, &client_addr_size, SOCK_NONBLOCK);
+                if (client < 0) {
+                    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED)
+                        perror("na função accept");
+                    if (errno == EINTR || errno == ECONNABORTED) continue;
+                    break;
+                }
+
+                if (!(lig = nova_ligacao())) {
+                    close(client);
+                    continue;
+                }
+                lig->fd = client;
+                lig->addr = client_addr;
+                lig->estado = LER_PSK;
+
+                ev.events = EPOLLIN | EPOLLRDHUP;
+                ev.data.ptr = lig;
+                if (epoll_ctl(epfd, EPOLL_CTL_ADD, client, &ev) < 0) {
+                    perror("epoll_ctl");
+                    close(client);
+                    libertar_ligacao(lig);
+                    continue;
+                }
+                adicionar_cliente(&client_addr, client);
+            }
+        }
     }
-    return 0;
+    return NULL;
 }
 
-void process_client(int client_fd, struct sockaddr_in *client_addr)
+struct Ligacao *nova_ligacao()
 {
-    int nread, n= 0;
-    struct ConfigMessage req;
-    const char *valid_psk = "my_secret_key", *ACK = "ACK";
-    char psk[64];
-    client_fd_global = client_fd;
+    struct Ligacao *lig = ligacoes_livres;
+    if (!lig)
+        return calloc(1, sizeof(*lig));
+    ligacoes_livres = lig->proxima_livre;
+    memset(lig, 0, sizeof(*lig));
+    return lig;
+}
 
-    nread = read(client_fd, psk, sizeof(psk) - 1);
-    if (nread <= 0) {
-        fprintf(stderr, "Erro ao ler PSK\n");
-        close(client_fd);
-        return;
-    }
-    psk[nread] = '\0'; // garantir que termina em \0
+void libertar_ligacao(struct Ligacao *lig)
+{
+    free(lig->saida);
+    lig->saida = NULL;
+    lig->proxima_livre = ligacoes_livres;
+    ligacoes_livres = lig;
+}
 
-    if (strcmp(psk, valid_psk) != 0) {
-        fprintf(stderr, "[WARN] PSK inválida: %s\n", psk);
-        const char *NAK = "NAK";
-        write(client_fd, NAK, strlen(NAK));
-        close(client_fd);
-        return;
+void fechar_ligacao(int epfd, struct Ligacao *lig)
+{
+    remover_cliente(&lig->addr);
+    if (lig->nome[0] && diretorio_remover(lig->nome, lig->addr.sin_addr.s_addr, lig->porta_udp) == 0) {
+        pthread_mutex_lock(&config_mutex);
+        diretorio_pendente = 1;
+        pthread_cond_signal(&config_cond);
+        pthread_mutex_unlock(&config_mutex);
     }
+    epoll_ctl(epfd, EPOLL_CTL_DEL, lig->fd, NULL);
+    close(lig->fd);
+    libertar_ligacao(lig);
+}
 
-    signal(SIGUSR1, sigusr1_handler);
-
-    write(client_fd, ACK, strlen(ACK));
+// Lê tudo o que estiver disponível e avança a máquina de estados da ligação
+void tratar_ligacao(int epfd, struct Ligacao *lig)
+{
+    char ack[3 + POWERUDP_SALT_LEN];
+    size_t psk_total = strlen(valid_psk);
 
-    while (1) 
+    while (1)
     {
-        ssize_t r = read(client_fd, &req, sizeof(req));
+        char *dest;
+        size_t falta;
+        if (lig->estado == LER_PSK) {
+            dest = lig->psk + lig->psk_len;
+            falta = psk_total - lig->psk_len;
+        } else if (lig->estado == LER_TIPO) {
+            dest = (char *)&lig->tipo;
+            falta = 1;
+        } else {
+            dest = (char *)&lig->req + lig->req_len;
+            falta = lig->req_total - lig->req_len;
+        }
+
+        ssize_t r = read(lig->fd, dest, falta);
         if (r == 0) {
-            printf("[INFO] Cliente %s fechou a ligação.\n", inet_ntoa(client_addr->sin_addr));
-            break;  // Cliente fechou a ligação, sair do loop
+            if (lig->estado == LER_PSK)
+                fprintf(stderr, "Erro ao ler PSK\n");
+            else if (registar_fechos)
+                printf("[INFO] Cliente %s fechou a ligação.\n", inet_ntoa(lig->addr.sin_addr));
+            fechar_ligacao(epfd, lig);
+            return;
         } else if (r < 0) {
-            perror("[ERRO] Erro ao ler configuração");
-            break; 
-        } else if (r != sizeof(req)) {
-            fprintf(stderr, "[ERRO] Tamanho inesperado da configuração: %ld bytes\n", r);
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+            if (errno == EINTR) continue;
+            perror("[ERRO] Erro ao ler da ligação");
+            fechar_ligacao(epfd, lig);
+            return;
+        }
+
+        if (lig->estado == LER_PSK) {
+            lig->psk_len += r;
+            // Rejeita assim que os bytes recebidos deixam de coincidir com a PSK
+            if (memcmp(lig->psk, valid_psk, lig->psk_len) != 0) {
+                lig->psk[lig->psk_len] = '\0';
+                fprintf(stderr, "[WARN] PSK inválida: %s\n", lig->psk);
+                const char *NAK = "NAK";
+                write(lig->fd, NAK, strlen(NAK));
+                fechar_ligacao(epfd, lig);
+                return;
+            }
+            if (lig->psk_len == psk_total) {
+                // "ACK" seguido do sal da chave de sessão, numa só escrita
+                memcpy(ack, "ACK", 3);
+                memcpy(ack + 3, sal_sessao, POWERUDP_SALT_LEN);
+                write(lig->fd, ack, sizeof(ack));
+                lig->estado = LER_TIPO;
+            }
             continue;
+        }
+
+        if (lig->estado == LER_TIPO) {
+            lig->req_len = 0;
+            if (lig->tipo == POWERUDP_CTRL_CONFIG)
+                lig->req_total = sizeof(lig->req.config);
+            else if (lig->tipo == POWERUDP_CTRL_REGISTER)
+                lig->req_total = sizeof(lig->req.registo);
+            else if (lig->tipo == POWERUDP_CTRL_SNAPSHOT)
+                lig->req_total = 0;
+            else {
+                fprintf(stderr, "[WARN] Pedido desconhecido (%u) de %s\n", lig->tipo, inet_ntoa(lig->addr.sin_addr));
+                fechar_ligacao(epfd, lig);
+                return;
+            }
+            lig->estado = LER_CORPO;
         } else {
-            printf("Nova configuração recebida de %s\n", inet_ntoa(client_addr->sin_addr));
-            pthread_mutex_lock(&config_mutex);
-            configuracao_ativa.enable_retransmission = req.enable_retransmission;
-            configuracao_ativa.enable_backoff = req.enable_backoff;
-            configuracao_ativa.enable_sequence = req.enable_sequence;
-            configuracao_ativa.base_timeout = req.base_timeout;
-            configuracao_ativa.max_retries = req.max_retries;
-            pthread_mutex_unlock(&config_mutex);
-            enviar_config_multicast();
+            lig->req_len += r;
         }
-    }
-    close(client_fd);
-}
+        if (lig->req_len < lig->req_total)
+            continue;
 
-void* thread_process_client(void* arg) {
-    struct ThreadArgs* targs = (struct ThreadArgs*)arg;
-    process_client(targs->client_fd, &targs->client_addr);
-    close(targs->client_fd);
-    free(targs);
-    return NULL;
+        lig->estado = LER_TIPO;
+        if (lig->tipo == POWERUDP_CTRL_CONFIG) {
+            aplicar_config(lig);
+        } else if (lig->tipo == POWERUDP_CTRL_REGISTER) {
+            registar_peer(lig);
+            if (enviar_snapshot(epfd, lig) < 0) return;
+        } else if (enviar_snapshot(epfd, lig) < 0) {
+            return;
+        }
+    }
 }
 
-void enviar_config_multicast() {
-    int sockfd;
-    struct sockaddr_in dest;
-    struct ConfigMessage copia_config;
+void aplicar_config(struct Ligacao *lig)
+{
+    ConfigMessage *req = &lig->req.config;
 
+    printf("Nova configuração recebida de %s\n", inet_ntoa(lig->addr.sin_addr));
     pthread_mutex_lock(&config_mutex);
-    memcpy(&copia_config, &configuracao_ativa, sizeof(copia_config));
+    configuracao_ativa.enable_retransmission = req->enable_retransmission;
+    configuracao_ativa.enable_backoff = req->enable_backoff;
+    configuracao_ativa.enable_sequence = req->enable_sequence;
+    configuracao_ativa.base_timeout = req->base_timeout;
+    configuracao_ativa.max_retries = req->max_retries;
+    configuracao_ativa.congestion_control = req->congestion_control;
+    configuracao_ativa.compression = req->compression;
+    configuracao_ativa.fec_k = req->fec_k;
+    configuracao_ativa.fec_parity = req->fec_parity;
+    uint32_t epoca = ++config_epoca;
+    atualizacoes_recebidas++;
+    config_pendente = 1;
+    pthread_cond_signal(&config_cond);
     pthread_mutex_unlock(&config_mutex);
 
+    atualizar_cliente(&lig->addr, epoca, sizeof(*req));
+}
 
-    if ((sockfd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
-        perror("socket multicast");
+// Põe (ou atualiza) o cliente no diretório de peers com o endereço UDP que anunciou
+void registar_peer(struct Ligacao *lig)
+{
+    PeerRegister *req = &lig->req.registo;
+    req->name[sizeof(req->name) - 1] = '\0';
+    if (!req->name[0]) {
+        fprintf(stderr, "[WARN] Registo sem nome de %s\n", inet_ntoa(lig->addr.sin_addr));
         return;
     }
 
+    // Um novo nome na mesma ligação substitui o anterior
+    int mudou = 0;
+    if (lig->nome[0] && strcmp(lig->nome, req->name) != 0)
+        mudou |= diretorio_remover(lig->nome, lig->addr.sin_addr.s_addr, lig->porta_udp) == 0;
+    mudou |= diretorio_adicionar(req->name, lig->addr.sin_addr.s_addr, req->udp_port) == 0;
+    strcpy(lig->nome, req->name);
+    lig->porta_udp = req->udp_port;
+    printf("[INFO] Peer \"%s\" registado em %s:%u\n", lig->nome, inet_ntoa(lig->addr.sin_addr), ntohs(lig->porta_udp));
+
+    if (mudou) {
+        pthread_mutex_lock(&config_mutex);
+        diretorio_pendente = 1;
+        pthread_cond_signal(&config_cond);
+        pthread_mutex_unlock(&config_mutex);
+    }
+}
+
+/*
+ * Responde com o diretório completo. O que não couber no buffer do socket fica em
+ * lig->saida e segue com EPOLLOUT; um pedido que chegue entretanto é ignorado (o
+ * snapshot pendente já traz uma versão de onde o cliente pode continuar).
+ * Devolve -1 se a ligação foi fechada.
+ */
+int enviar_snapshot(int epfd, struct Ligacao *lig)
+{
+    if (lig->saida)
+        return 0;
+    if (!(lig->saida = diretorio_snapshot(&lig->saida_len))) {
+        fprintf(stderr, "[ERRO] Sem memória para o snapshot do diretório\n");
+        fechar_ligacao(epfd, lig);
+        return -1;
+    }
+    lig->saida_enviada = 0;
+    __atomic_add_fetch(&snapshots_enviados, 1, __ATOMIC_RELAXED);
+    return escrever_saida(epfd, lig);
+}
+
+int escrever_saida(int epfd, struct Ligacao *lig)
+{
+    struct epoll_event ev;
+
+    while (lig->saida && lig->saida_enviada < lig->saida_len) {
+        ssize_t w = write(lig->fd, lig->saida + lig->saida_enviada, lig->saida_len - lig->saida_enviada);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                ev.events = EPOLLIN | EPOLLRDHUP | EPOLLOUT;
+                ev.data.ptr = lig;
+                epoll_ctl(epfd, EPOLL_CTL_MOD, lig->fd, &ev);
+                return 0;
+            }
+            perror("[ERRO] Erro ao escrever o snapshot");
+            fechar_ligacao(epfd, lig);
+            return -1;
+        }
+        lig->saida_enviada += w;
+    }
+
+    if (lig->saida) {
+        free(lig->saida);
+        lig->saida = NULL;
+        ev.events = EPOLLIN | EPOLLRDHUP;
+        ev.data.ptr = lig;
+        epoll_ctl(epfd, EPOLL_CTL_MOD, lig->fd, &ev);
+    }
+    return 0;
+}
+
+/*
+ * Thread que difunde a configuração e os deltas do diretório. Usa sempre o mesmo
+ * socket e, quando chega uma atualização, espera COALESCE_MS para que uma rajada de
+ * atualizações saia num único multicast com a época mais recente (e as entradas e
+ * saídas de peers no menor número de datagramas de delta).
+ */
+void *publicador_multicast(void *arg)
+{
+    int sockfd, config, deltas;
+    ConfigAnnouncement anuncio;
+    struct sockaddr_in dest;
+    (void)arg;
+
+    if ((sockfd = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+        erro("socket multicast");
+
     memset(&dest, 0, sizeof(dest));
     dest.sin_family = AF_INET;
     dest.sin_port = htons(9876); 
     inet_pton(AF_INET, "239.0.0.1", &dest.sin_addr);
 
-    if (sendto(sockfd, &configuracao_ativa, sizeof(configuracao_ativa), 0,
-               (struct sockaddr *)&dest, sizeof(dest)) < 0) {
+    while (1)
+    {
+        pthread_mutex_lock(&config_mutex);
+        while (!config_pendente && !diretorio_pendente)
+            pthread_cond_wait(&config_cond, &config_mutex);
+        pthread_mutex_unlock(&config_mutex);
+
+        usleep(COALESCE_MS * 1000);
+
+        pthread_mutex_lock(&config_mutex);
+        config = config_pendente;
+        deltas = diretorio_pendente;
+        anuncio.epoch = htonl(config_epoca);
+        anuncio.config = configuracao_ativa;
+        config_pendente = diretorio_pendente = 0;
+        if (config)
+            multicasts_enviados++;
+        pthread_mutex_unlock(&config_mutex);
+
+        if (config)
+            enviar_config_multicast(sockfd, &dest, &anuncio);
+        if (deltas) {
+            size_t bytes;
+            int n = publicar_deltas(sockfd, &dest, &bytes);
+            if (n > 0)
+                printf("[INFO] Diretório na versão %u: %d delta(s), %zu bytes via multicast. Deltas: %lu, snapshots: %lu\n",
+                       versao_publicada, n, bytes, deltas_enviados,
+                       __atomic_load_n(&snapshots_enviados, __ATOMIC_RELAXED));
+        }
+    }
+    return NULL;
+}
+
+void enviar_config_multicast(int sockfd, struct sockaddr_in *dest, ConfigAnnouncement *anuncio) {
+    char datagrama[sizeof(*anuncio) + POWERUDP_MAC_LEN];
+    memcpy(datagrama, anuncio, sizeof(*anuncio));
+    powerudp_mac_put(&chave_sessao, datagrama, sizeof(*anuncio));
+    if (sendto(sockfd, datagrama, sizeof(datagrama), 0,
+               (struct sockaddr *)dest, sizeof(*dest)) < 0) {
         perror("sendto multicast");
     } else {
-        printf("[INFO] Configuração enviada via multicast.\n");
+        pthread_mutex_lock(&config_mutex);
+        printf("[INFO] Configuração (época %u) enviada via multicast. Atualizações: %lu, multicasts: %lu\n",
+               ntohl(anuncio->epoch), atualizacoes_recebidas, multicasts_enviados);
+        pthread_mutex_unlock(&config_mutex);
+    }
+}
+
+/*
+**************************************************************************************
+*******************************         REGISTO DE CLIENTES          *********************************************
+***************************************************************************************
+*/
+
+static uint64_t hash_cliente(struct in_addr ip, uint16_t porta) {
+    uint64_t k = ((uint64_t)ip.s_addr << 16) | porta;
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+}
+
+static struct ShardRegisto *shard_de(uint64_t h) {
+    return &registo[h >> 58];   // 6 bits de cima escolhem a fatia (REGISTO_SHARDS = 64)
+}
+
+void registo_init() {
+    for (int i = 0; i < REGISTO_SHARDS; i++) {
+        pthread_mutex_init(&registo[i].mutex, NULL);
+        registo[i].cap = REGISTO_CAP_INICIAL;
+        registo[i].count = 0;
+        registo[i].slots = calloc(REGISTO_CAP_INICIAL, sizeof(struct ClienteInfo));
+        if (!registo[i].slots)
+            erro("calloc registo");
     }
+}
+
+// Devolve o índice do cliente na fatia ou, se não existir, o do slot livre onde ficaria
+static size_t procurar_slot(struct ShardRegisto *sh, struct in_addr ip, uint16_t porta, uint64_t h) {
+    size_t mask = sh->cap - 1;
+    size_t i = h & mask;
+    while (sh->slots[i].ocupado &&
+           (sh->slots[i].ip.s_addr != ip.s_addr || sh->slots[i].porta != porta))
+        i = (i + 1) & mask;
+    return i;
+}
+
+static void crescer_shard(struct ShardRegisto *sh) {
+    struct ClienteInfo *antigos = sh->slots;
+    size_t cap_antiga = sh->cap;
 
-    close(sockfd);
+    struct ClienteInfo *novos = calloc(cap_antiga * 2, sizeof(struct ClienteInfo));
+    if (!novos)
+        return;     // continua com a tabela atual, apenas mais cheia
+    sh->slots = novos;
+    sh->cap = cap_antiga * 2;
+    for (size_t i = 0; i < cap_antiga; i++) {
+        if (!antigos[i].ocupado) continue;
+        uint64_t h = hash_cliente(antigos[i].ip, antigos[i].porta);
+        sh->slots[procurar_slot(sh, antigos[i].ip, antigos[i].porta, h)] = antigos[i];
+    }
+    free(antigos);
 }
 
-void adicionar_cliente(struct in_addr ip) {
-    for (int i = 0; i < num_clientes; i++) {
-        if (clientes[i].ip.s_addr == ip.s_addr) return;
+// Regista (ou atualiza) o cliente ligado a partir de addr
+int adicionar_cliente(struct sockaddr_in *addr, int fd) {
+    uint64_t h = hash_cliente(addr->sin_addr, addr->sin_port);
+    struct ShardRegisto *sh = shard_de(h);
+
+    pthread_mutex_lock(&sh->mutex);
+    if ((sh->count + 1) * 10 > sh->cap * 7)
+        crescer_shard(sh);
+    if (sh->count + 1 >= sh->cap) {
+        pthread_mutex_unlock(&sh->mutex);
+        fprintf(stderr, "[WARN] Registo de clientes cheio.\n");
+        return -1;
     }
 
-    if (num_clientes < 3) {
-        clientes[num_clientes++].ip = ip;
-        printf("[INFO] Cliente adicionado: %s\n", inet_ntoa(ip));
+    struct ClienteInfo *c = &sh->slots[procurar_slot(sh, addr->sin_addr, addr->sin_port, h)];
+    if (!c->ocupado) {
+        memset(c, 0, sizeof(*c));
+        c->ip = addr->sin_addr;
+        c->porta = addr->sin_port;
+        c->ocupado = 1;
+        sh->count++;
+        __atomic_add_fetch(&num_clientes, 1, __ATOMIC_RELAXED);
+    }
+    c->fd = fd;
+    c->ultimo_contacto = time(NULL);
+    pthread_mutex_unlock(&sh->mutex);
+    return 0;
+}
+
+// Atualiza o estado do cliente depois de aplicar uma configuração dele
+int atualizar_cliente(struct sockaddr_in *addr, uint32_t epoca, size_t bytes) {
+    uint64_t h = hash_cliente(addr->sin_addr, addr->sin_port);
+    struct ShardRegisto *sh = shard_de(h);
+    int r = -1;
+
+    pthread_mutex_lock(&sh->mutex);
+    struct ClienteInfo *c = &sh->slots[procurar_slot(sh, addr->sin_addr, addr->sin_port, h)];
+    if (c->ocupado) {
+        c->ultimo_contacto = time(NULL);
+        c->epoca_config = epoca;
+        c->configs_recebidas++;
+        c->bytes_recebidos += bytes;
+        r = 0;
+    }
+    pthread_mutex_unlock(&sh->mutex);
+    return r;
+}
+
+// Copia o estado do cliente para *info; devolve -1 se não estiver registado
+int procurar_cliente(struct sockaddr_in *addr, struct ClienteInfo *info) {
+    uint64_t h = hash_cliente(addr->sin_addr, addr->sin_port);
+    struct ShardRegisto *sh = shard_de(h);
+    int r = -1;
+
+    pthread_mutex_lock(&sh->mutex);
+    struct ClienteInfo *c = &sh->slots[procurar_slot(sh, addr->sin_addr, addr->sin_port, h)];
+    if (c->ocupado) {
+        *info = *c;
+        r = 0;
+    }
+    pthread_mutex_unlock(&sh->mutex);
+    return r;
+}
+
+int remover_cliente(struct sockaddr_in *addr) {
+    uint64_t h = hash_cliente(addr->sin_addr, addr->sin_port);
+    struct ShardRegisto *sh = shard_de(h);
+
+    pthread_mutex_lock(&sh->mutex);
+    size_t mask = sh->cap - 1;
+    size_t i = procurar_slot(sh, addr->sin_addr, addr->sin_port, h);
+    if (!sh->slots[i].ocupado) {
+        pthread_mutex_unlock(&sh->mutex);
+        return -1;
+    }
+
+    // Desloca para trás os elementos seguintes da mesma sequência de sondagem
+    for (size_t j = (i + 1) & mask; sh->slots[j].ocupado; j = (j + 1) & mask) {
+        size_t casa = hash_cliente(sh->slots[j].ip, sh->slots[j].porta) & mask;
+        if (((j - casa) & mask) >= ((j - i) & mask)) {
+            sh->slots[i] = sh->slots[j];
+            i = j;
+        }
+    }
+    sh->slots[i].ocupado = 0;
+    sh->count--;
+    __atomic_sub_fetch(&num_clientes, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&sh->mutex);
+    return 0;
+}
+
+/*
+**************************************************************************************
+*******************************         DIRETÓRIO DE PEERS           *********************************************
+***************************************************************************************
+*/
+
+static uint64_t hash_nome(const char *nome) {
+    uint64_t h = 0xcbf29ce484222325ULL;     // FNV-1a
+    while (*nome) {
+        h ^= (unsigned char)*nome++;
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+void diretorio_init() {
+    diretorio_cap = DIRETORIO_CAP_INICIAL;
+    diretorio_count = 0;
+    diretorio = calloc(diretorio_cap, sizeof(PeerEntry));
+    if (!diretorio)
+        erro("calloc diretorio");
+}
+
+// Índice do peer ou, se não existir, do slot livre onde ficaria
+static size_t diretorio_slot(const char *nome) {
+    size_t mask = diretorio_cap - 1;
+    size_t i = hash_nome(nome) & mask;
+    while (diretorio[i].name[0] && strcmp(diretorio[i].name, nome) != 0)
+        i = (i + 1) & mask;
+    return i;
+}
+
+static int diretorio_crescer() {
+    PeerEntry *antigos = diretorio;
+    size_t cap_antiga = diretorio_cap;
+
+    PeerEntry *novos = calloc(cap_antiga * 2, sizeof(PeerEntry));
+    if (!novos)
+        return -1;
+    diretorio = novos;
+    diretorio_cap = cap_antiga * 2;
+    for (size_t i = 0; i < cap_antiga; i++) {
+        if (antigos[i].name[0])
+            diretorio[diretorio_slot(antigos[i].name)] = antigos[i];
+    }
+    free(antigos);
+    return 0;
+}
+
+// Guarda a alteração para o próximo delta e avança a versão (com diretorio_mutex)
+static void diretorio_alteracao(const PeerEntry *peer, uint8_t op) {
+    if (num_alteracoes == cap_alteracoes) {
+        size_t cap = cap_alteracoes ? cap_alteracoes * 2 : DIRETORIO_CAP_INICIAL;
+        PeerEntry *novas = realloc(alteracoes, cap * sizeof(PeerEntry));
+        if (!novas)
+            erro("realloc alteracoes");     // perder uma alteração deixava os caches errados para sempre
+        alteracoes = novas;
+        cap_alteracoes = cap;
+    }
+    alteracoes[num_alteracoes] = *peer;
+    alteracoes[num_alteracoes].op = op;
+    num_alteracoes++;
+    diretorio_versao++;
+}
+
+// Devolve 0 se o diretório mudou, 1 se o peer já lá estava com este endereço, -1 em erro
+int diretorio_adicionar(const char *nome, uint32_t ip, uint16_t porta) {
+    int r = 0;
+
+    pthread_mutex_lock(&diretorio_mutex);
+    if ((diretorio_count + 1) * 10 > diretorio_cap * 7 && diretorio_crescer() < 0 &&
+        diretorio_count + 1 >= diretorio_cap) {
+        pthread_mutex_unlock(&diretorio_mutex);
+        fprintf(stderr, "[WARN] Diretório de peers cheio.\n");
+        return -1;
+    }
+
+    PeerEntry *p = &diretorio[diretorio_slot(nome)];
+    if (p->name[0] && p->ip == ip && p->udp_port == porta) {
+        r = 1;
     } else {
-        printf("[WARN] Número máximo de clientes atingido.\n");
+        if (!p->name[0]) {
+            strncpy(p->name, nome, sizeof(p->name) - 1);
+            diretorio_count++;
+        }
+        p->ip = ip;
+        p->udp_port = porta;
+        p->op = POWERUDP_PEER_ADD;
+        diretorio_alteracao(p, POWERUDP_PEER_ADD);
+    }
+    pthread_mutex_unlock(&diretorio_mutex);
+    return r;
+}
+
+// Só remove se o nome ainda apontar para este endereço (outra ligação pode tê-lo reclamado)
+int diretorio_remover(const char *nome, uint32_t ip, uint16_t porta) {
+    pthread_mutex_lock(&diretorio_mutex);
+    size_t mask = diretorio_cap - 1;
+    size_t i = diretorio_slot(nome);
+    if (!diretorio[i].name[0] || diretorio[i].ip != ip || diretorio[i].udp_port != porta) {
+        pthread_mutex_unlock(&diretorio_mutex);
+        return -1;
+    }
+    diretorio_alteracao(&diretorio[i], POWERUDP_PEER_REMOVE);
+
+    // Desloca para trás os elementos seguintes da mesma sequência de sondagem
+    for (size_t j = (i + 1) & mask; diretorio[j].name[0]; j = (j + 1) & mask) {
+        size_t casa = hash_nome(diretorio[j].name) & mask;
+        if (((j - casa) & mask) >= ((j - i) & mask)) {
+            diretorio[i] = diretorio[j];
+            i = j;
+        }
+    }
+    memset(&diretorio[i], 0, sizeof(diretorio[i]));
+    diretorio_count--;
+    pthread_mutex_unlock(&diretorio_mutex);
+    return 0;
+}
+
+int diretorio_procurar(const char *nome, PeerEntry *peer) {
+    int r = -1;
+
+    pthread_mutex_lock(&diretorio_mutex);
+    PeerEntry *p = &diretorio[diretorio_slot(nome)];
+    if (p->name[0]) {
+        *peer = *p;
+        r = 0;
+    }
+    pthread_mutex_unlock(&diretorio_mutex);
+    return r;
+}
+
+// Serializa o diretório inteiro (cabeçalho + entradas); o chamador liberta com free
+char *diretorio_snapshot(size_t *len) {
+    pthread_mutex_lock(&diretorio_mutex);
+    *len = sizeof(PeerDirectoryHeader) + diretorio_count * sizeof(PeerEntry);
+    char *buf = malloc(*len);
+    if (buf) {
+        PeerDirectoryHeader *h = (PeerDirectoryHeader *)buf;
+        PeerEntry *e = (PeerEntry *)(h + 1);
+        h->magic = htonl(POWERUDP_DIR_MAGIC);
+        h->base_version = 0;
+        h->version = htonl(diretorio_versao);
+        h->count = htonl(diretorio_count);
+        for (size_t i = 0; i < diretorio_cap; i++) {
+            if (diretorio[i].name[0])
+                *e++ = diretorio[i];
+        }
+    }
+    pthread_mutex_unlock(&diretorio_mutex);
+    return buf;
+}
+
+/*
+ * Difunde as alterações pendentes em datagramas de até DELTA_MAX_ENTRADAS entradas,
+ * cada um encadeado na versão do anterior. Uma alteração custa o mesmo envio com
+ * 1 ou 10k peers no grupo: a replicação fica a cargo da rede. Com dest NULL só
+ * codifica (para o --bench-diretorio). Devolve o número de datagramas.
+ */
+int publicar_deltas(int sockfd, struct sockaddr_in *dest, size_t *bytes) {
+    static char datagrama[sizeof(PeerDirectoryHeader) + DELTA_MAX_ENTRADAS * sizeof(PeerEntry) + POWERUDP_MAC_LEN];
+    PeerDirectoryHeader *h = (PeerDirectoryHeader *)datagrama;
+    PeerEntry *pendentes;
+    size_t n;
+    uint32_t versao;
+    int datagramas = 0;
+
+    // Troca a lista para não prender as threads de eventos durante os envios
+    pthread_mutex_lock(&diretorio_mutex);
+    pendentes = alteracoes;
+    n = num_alteracoes;
+    versao = versao_publicada;
+    versao_publicada = diretorio_versao;
+    alteracoes = NULL;
+    num_alteracoes = cap_alteracoes = 0;
+    pthread_mutex_unlock(&diretorio_mutex);
+
+    *bytes = 0;
+    for (size_t i = 0; i < n; i += DELTA_MAX_ENTRADAS) {
+        size_t k = n - i < DELTA_MAX_ENTRADAS ? n - i : DELTA_MAX_ENTRADAS;
+        size_t len = sizeof(*h) + k * sizeof(PeerEntry);
+        h->magic = htonl(POWERUDP_DIR_MAGIC);
+        h->base_version = htonl(versao);
+        h->version = htonl(versao + k);
+        h->count = htonl(k);
+        memcpy(h + 1, pendentes + i, k * sizeof(PeerEntry));
+        versao += k;
+        powerudp_mac_put(&chave_sessao, datagrama, len);
+        len += POWERUDP_MAC_LEN;
+
+        if (dest && sendto(sockfd, datagrama, len, 0, (struct sockaddr *)dest, sizeof(*dest)) < 0)
+            perror("sendto delta");     // quem o perder pede um snapshot ao ver o salto de versão
+        datagramas++;
+        *bytes += len;
     }
+    free(pendentes);
+    deltas_enviados += datagramas;
+    return datagramas;
+}
+
+/*
+ * Microbenchmark do registo: ./Projeto_serv --bench-registo [N]
+ * Mede o custo médio de inserção, procura e remoção com 1k, 10k e N clientes;
+ * com custo O(1) os tempos por operação ficam praticamente iguais.
+ */
+static double segundos_desde(struct timespec *t0) {
+    struct timespec t1;
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    return (t1.tv_sec - t0->tv_sec) + (t1.tv_nsec - t0->tv_nsec) / 1e9;
+}
+
+int bench_registo(int max_clientes) {
+    int tamanhos[] = { 1000, 10000, max_clientes };
+    struct sockaddr_in addr;
+    struct ClienteInfo info;
+    struct timespec t0;
+
+    registo_init();
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+
+    printf("clientes,insercao_ns,procura_ns,remocao_ns\n");
+    for (int t = 0; t < 3; t++) {
+        int n = tamanhos[t];
+
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        for (int i = 0; i < n; i++) {
+            addr.sin_addr.s_addr = htonl(0x0A000000 | (i >> 4));
+            addr.sin_port = htons(40000 + (i & 15));
+            adicionar_cliente(&addr, i);
+        }
+        double ins = segundos_desde(&t0);
+
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        for (int i = 0; i < n; i++) {
+            addr.sin_addr.s_addr = htonl(0x0A000000 | (i >> 4));
+            addr.sin_port = htons(40000 + (i & 15));
+            if (procurar_cliente(&addr, &info) < 0 || info.fd != i)
+                erro("registo inconsistente");
+        }
+        double proc = segundos_desde(&t0);
+
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        for (int i = 0; i < n; i++) {
+            addr.sin_addr.s_addr = htonl(0x0A000000 | (i >> 4));
+            addr.sin_port = htons(40000 + (i & 15));
+            remover_cliente(&addr);
+        }
+        double rem = segundos_desde(&t0);
+
+        printf("%d,%.1f,%.1f,%.1f\n", n, ins * 1e9 / n, proc * 1e9 / n, rem * 1e9 / n);
+    }
+    return num_clientes == 0 ? 0 : 1;
+}
+
+/*
+ * Benchmark de churn de ligações: ./Projeto_serv --bench-ligacoes [N] [clientes] [loops]
+ * Arranca `loops` event loops neste processo e lança `clientes` threads que, em
+ * conjunto, fazem N ciclos de connect, PSK, espera pelo "ACK" e close. Reporta
+ * aceitações por segundo e a latência de cada ciclo. Com loops = 0 não arranca
+ * servidor nenhum e mede o que já estiver à escuta na SERVER_PORT, o que permite
+ * comparar com outra versão do servidor usando exatamente o mesmo cliente.
+ */
+struct ArgsChurn {
+    int ciclos;
+    double *latencias;          // segundos por ciclo, um por ciclo
+    int falhas;
+};
+
+static void *cliente_churn(void *arg) {
+    struct ArgsChurn *a = arg;
+    struct sockaddr_in addr;
+    struct timespec t0;
+    char resposta[3 + POWERUDP_SALT_LEN];
+    size_t psk_len = strlen(valid_psk);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(SERVER_PORT);
+    addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+
+    for (int i = 0; i < a->ciclos; i++) {
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0)
+            erro("bench_ligacoes: socket");
+        ssize_t r = -1;
+        size_t lidos = 0;
+        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0 &&
+            write(fd, valid_psk, psk_len) == (ssize_t)psk_len) {
+            // Basta o "ACK": o servidor antigo não envia o sal a seguir
+            while (lidos < 3 && (r = read(fd, resposta + lidos, sizeof(resposta) - lidos)) > 0)
+                lidos += r;
+        }
+        close(fd);
+        a->latencias[i] = segundos_desde(&t0);
+        if (lidos < 3 || memcmp(resposta, "ACK", 3) != 0)
+            a->falhas++;
+    }
+    return NULL;
+}
+
+static int comparar_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+int bench_ligacoes(int ciclos, int clientes, int num_loops) {
+    pthread_t threads[256];
+    struct ArgsChurn args[256];
+    struct timespec t0;
+
+    if (clientes < 1) clientes = 1;
+    if (clientes > 256) clientes = 256;
+    if (num_loops > MAX_LOOPS) num_loops = MAX_LOOPS;
+    if (ciclos < clientes)
+        erro("bench_ligacoes: N menor do que o número de clientes");
+    double *latencias = malloc((size_t)ciclos * sizeof(double));
+    if (!latencias)
+        erro("bench_ligacoes");
+
+    signal(SIGPIPE, SIG_IGN);
+    if (num_loops > 0) {
+        registo_init();
+        diretorio_init();
+        registar_fechos = 0;
+        for (int i = 0; i < num_loops; i++) {
+            pthread_t loop;
+            int fd = criar_socket_escuta();
+            if (pthread_create(&loop, NULL, event_loop, (void *)(long)fd) != 0)
+                erro("na funcao pthread_create");
+            pthread_detach(loop);
+        }
+    }
+
+    int feitos = 0;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (int c = 0; c < clientes; c++) {
+        args[c].ciclos = ciclos / clientes + (c < ciclos % clientes);
+        args[c].latencias = latencias + feitos;
+        args[c].falhas = 0;
+        feitos += args[c].ciclos;
+        if (pthread_create(&threads[c], NULL, cliente_churn, &args[c]) != 0)
+            erro("na funcao pthread_create");
+    }
+    int falhas = 0;
+    for (int c = 0; c < clientes; c++) {
+        pthread_join(threads[c], NULL);
+        falhas += args[c].falhas;
+    }
+    double total = segundos_desde(&t0);
+
+    qsort(latencias, ciclos, sizeof(double), comparar_double);
+    printf("ciclos,clientes,loops,segundos,aceitacoes_s,p50_us,p99_us,max_us,falhas\n");
+    printf("%d,%d,%d,%.3f,%.0f,%.1f,%.1f,%.1f,%d\n", ciclos, clientes, num_loops, total,
+           (ciclos - falhas) / total, latencias[ciclos / 2] * 1e6, latencias[(size_t)ciclos * 99 / 100] * 1e6,
+           latencias[ciclos - 1] * 1e6, falhas);
+    free(latencias);
+    return falhas == 0 ? 0 : 1;
+}
+
+/*
+ * Microbenchmark do diretório: ./Projeto_serv --bench-diretorio [N]
+ * Com 1k, 10k e N peers mede o custo de uma adesão (inserção + alteração), o
+ * snapshot que um novo cliente recebe e o fan-out das atualizações: quantos
+ * datagramas e bytes de delta saem quando todos aderem numa rajada e quando um
+ * só peer entra e sai. Cada datagrama vai uma vez para o grupo multicast; em
+ * unicast seriam peers vezes mais envios.
+ */
+int bench_diretorio(int max_peers) {
+    int tamanhos[] = { 1000, 10000, max_peers };
+    int total = max_peers > 10000 ? max_peers : 10000;
+    char (*nomes)[POWERUDP_PEER_NAME_MAX] = malloc((size_t)total * POWERUDP_PEER_NAME_MAX);
+    PeerEntry peer;
+    struct timespec t0;
+    size_t bytes, len;
+
+    if (max_peers < 1 || !nomes)
+        erro("bench_diretorio");
+    for (int i = 0; i < total; i++)
+        snprintf(nomes[i], POWERUDP_PEER_NAME_MAX, "peer-%d", i);
+
+    printf("peers,adesao_ns,procura_ns,snapshot_bytes,snapshot_us,rajada_datagramas,rajada_bytes,"
+           "rajada_us,alteracao_datagramas,alteracao_bytes,envios_unicast_equivalentes\n");
+    for (int t = 0; t < 3; t++) {
+        int n = tamanhos[t];
+        diretorio_init();
+        free(alteracoes);
+        alteracoes = NULL;
+        num_alteracoes = cap_alteracoes = 0;
+        diretorio_versao = versao_publicada = 0;
+
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        for (int i = 0; i < n; i++)
+            diretorio_adicionar(nomes[i], htonl(0x0A000000 | (i >> 4)), htons(40000 + (i & 15)));
+        double ades = segundos_desde(&t0);
+
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        for (int i = 0; i < n; i++) {
+            if (diretorio_procurar(nomes[i], &peer) < 0 || peer.udp_port != htons(40000 + (i & 15)))
+                erro("diretório inconsistente");
+        }
+        double proc = segundos_desde(&t0);
+
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        char *snap = diretorio_snapshot(&len);
+        double snap_t = segundos_desde(&t0);
+        free(snap);
+
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        int rajada = publicar_deltas(-1, NULL, &bytes);
+        double rajada_t = segundos_desde(&t0);
+        size_t rajada_bytes = bytes;
+
+        diretorio_adicionar("novo", htonl(0x0B000001), htons(50000));
+        diretorio_remover("novo", htonl(0x0B000001), htons(50000));
+        int alteracao = publicar_deltas(-1, NULL, &bytes);
+        if (versao_publicada != (uint32_t)n + 2 || diretorio_count != (size_t)n)
+            erro("versões do diretório inconsistentes");
+
+        printf("%d,%.1f,%.1f,%zu,%.1f,%d,%zu,%.1f,%d,%zu,%d\n", n, ades * 1e9 / n, proc * 1e9 / n,
+               len, snap_t * 1e6, rajada, rajada_bytes, rajada_t * 1e6, alteracao, bytes, n);
+        free(diretorio);
+    }
+    free(nomes);
+    return 0;
 }
 
 /*
@@ -222,9 +1189,6 @@ void adicionar_cliente(struct in_addr ip) {
 
 void handle_sigint(int sig) {
     printf("\nServidor a encerrar, a notificar clientes...\n");
-    for (int i = 0; i < num_clientes; i++) {
-        kill(pids[i], SIGUSR1);
-    }
     encerrar_todos_os_clientes();
     exit(0);
 }
@@ -233,27 +1197,18 @@ void dummy_sigusr1_handler(int sig) {
     // Apenas para evitar mensagem "User defined signal 1"
 }
 
+/*
+ * Fecha a ligação de controlo de todos os clientes registados; do lado do cliente
+ * isto aparece como "Conexão TCP encerrada pelo servidor". Corre no handler de
+ * SIGINT, por isso não toma os mutexes (o processo termina a seguir).
+ */
 void encerrar_todos_os_clientes() {
-    for (int i = 0; i < num_clientes; i++) {
-        int sockfd;
-        struct sockaddr_in addr;
-
-        if ((sockfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-            perror("socket para fechar cliente");
-            continue;
+    for (int s = 0; s < REGISTO_SHARDS; s++) {
+        struct ShardRegisto *sh = &registo[s];
+        for (size_t i = 0; i < sh->cap; i++) {
+            if (sh->slots[i].ocupado)
+                shutdown(sh->slots[i].fd, SHUT_RDWR);
         }
-
-        addr.sin_family = AF_INET;
-        addr.sin_port = htons(SERVER_PORT);  // Porta do cliente, se for a mesma
-        addr.sin_addr = clientes[i].ip;
-
-        if (connect(sockfd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
-            perror("connect para fechar cliente");
-            close(sockfd);
-            continue;
-        }
-
-        close(sockfd);
     }
 }
 
@@ -262,8 +1217,3 @@ void erro(char *msg)
     perror(msg);
     exit(1);
 }
-
-void sigusr1_handler(int sig) {
-    close(client_fd_global);
-    exit(0);
-}